@@ -9,6 +9,7 @@
 #include "asm_bler.h"
 
 #include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -44,13 +45,82 @@ static char* tokenize(char* str)
     return *str ? str : NULL;
 }
 
+// address of the next byte in the output image
+static int load_addr(struct asm_ctx* ctx) { return ctx->pc + ctx->load_offset; }
+
+static void update_load_offset(struct asm_ctx* ctx)
+{
+    if (ctx->bank < 0 || !ctx->bank_size)
+        ctx->load_offset = 0;
+    else
+        ctx->load_offset = ASM_BANK_BASE + ctx->bank * ctx->bank_size - (ctx->pc & ~(ctx->bank_size - 1));
+}
+
+static void overlap_error(struct asm_ctx* ctx)
+{
+    ctx->status                 = ASM_ST_ERR_OVERLAP;
+    ctx->status_detail.err_addr = load_addr(ctx);
+}
+
+// find or create the segment ending at the load address
+static struct segment* open_segment(struct asm_ctx* ctx)
+{
+    struct segment** where = &ctx->segments;
+    int addr               = load_addr(ctx);
+    struct segment* seg;
+
+    while (*where && (*where)->addr <= addr) {
+        seg = *where;
+        if (seg->addr + seg->len == addr)
+            return seg;
+        if (seg->addr + seg->len > addr) {
+            overlap_error(ctx);
+            return NULL;
+        }
+        where = &seg->next;
+    }
+
+    seg       = (struct segment*)calloc(1, sizeof(struct segment));
+    seg->addr = addr;
+    seg->next = *where;
+    *where    = seg;
+
+    return seg;
+}
+
 static void append_byte(struct asm_ctx* ctx, uint8_t v)
 {
-    if (ctx->output_alloc <= ctx->pc) {
-        ctx->output_alloc = ((ctx->pc / 1024) + 1) * 1024;
-        ctx->output       = (uint8_t*)realloc(ctx->output, ctx->output_alloc);
+    struct segment* seg = ctx->current_segment;
+
+    if (ctx->status != ASM_ST_OK)
+        return;
+
+    // the next window maps whatever bank is selected at run time
+    if (ctx->bank >= 0 && ctx->bank_size
+        && (unsigned)(load_addr(ctx) - ASM_BANK_BASE - ctx->bank * ctx->bank_size) >= (unsigned)ctx->bank_size) {
+        ctx->status                 = ASM_ST_ERR_BANK;
+        ctx->status_detail.err_addr = ctx->pc;
+        return;
     }
-    ctx->output[ctx->pc++] = v;
+
+    if (!seg || seg->addr + seg->len != load_addr(ctx)) {
+        seg = ctx->current_segment = open_segment(ctx);
+        if (!seg)
+            return;
+    }
+
+    if (seg->next && seg->next->addr <= load_addr(ctx)) {
+        overlap_error(ctx);
+        return;
+    }
+
+    if (seg->alloc <= seg->len) {
+        seg->alloc = ((seg->len / 1024) + 1) * 1024;
+        seg->data  = (uint8_t*)realloc(seg->data, seg->alloc);
+    }
+    seg->data[seg->len++] = v;
+    ctx->pc++;
+    ctx->emitted++;
 }
 
 static void declare_symbol(struct asm_ctx* ctx, const char* sym_name)
@@ -76,7 +146,7 @@ static void declare_reference(struct asm_ctx* ctx, char* ref_name)
 
     ref              = (struct reference*)malloc(sizeof(struct reference));
     ref->name        = strdup(ref_name);
-    ref->addr        = ctx->pc;
+    ref->addr        = load_addr(ctx);
     ref->line_number = ctx->current_line_number;
 
     switch (*mod) {
@@ -121,9 +191,9 @@ static int link(struct asm_ctx* ctx)
             return 1;
         }
         if (ref->mod & REF_MOD_L)
-            ctx->output[target_addr++] = sym->addr;
+            *asm_locate(ctx, target_addr++) = sym->addr;
         if (ref->mod & REF_MOD_H)
-            ctx->output[target_addr] = sym->addr >> 8;
+            *asm_locate(ctx, target_addr) = sym->addr >> 8;
 
         ref = ref->next;
     }
@@ -228,6 +298,11 @@ static int parse_instr(struct asm_ctx* ctx, char* instr)
         return 0;
     }
 
+    if (0 == strcmp(instr, ".bank")) {
+        ctx->dot_bank = 2;
+        return 0;
+    }
+
     if (0 == strcmp(instr, ".set"))
         return 0;
 
@@ -243,13 +318,17 @@ static int parse_instr(struct asm_ctx* ctx, char* instr)
     }
 
     if (0 == strncmp(instr, "OUT", 3)) {
-        // OUT/X
+        // OUT/X, X from 8 to 31, 0 to 7 being short for 24 to 31
         int port;
         if (instr_len < 5)
             goto error;
 
         port = strtoul(instr + 4, NULL, 0);
-        append_byte(ctx, 0x71 | (port << 1));
+        if (port > 31)
+            goto error;
+        if (port < 8)
+            port += 24;
+        append_byte(ctx, 0x41 | (port << 1));
         return 0;
     }
 
@@ -385,6 +464,28 @@ static int parse_param(struct asm_ctx* ctx, char* param)
     if (ctx->dot_org) {
         ctx->pc      = strtoul(param, NULL, 0);
         ctx->dot_org = 0;
+        update_load_offset(ctx);
+        return 0;
+    }
+
+    if (ctx->dot_bank == 2) {
+        // bank number, negative for the plain address space
+        ctx->bank     = strtol(param, NULL, 0);
+        ctx->dot_bank = ctx->bank < 0 ? 0 : 1;
+        update_load_offset(ctx);
+        return 0;
+    }
+
+    if (ctx->dot_bank == 1) {
+        // bank size, a power of 2
+        ctx->bank_size = strtoul(param, NULL, 0);
+        ctx->dot_bank  = 0;
+        if (ctx->bank_size <= 0 || (ctx->bank_size & (ctx->bank_size - 1))) {
+            ctx->status = ASM_ST_ERR_INSTR;
+            strcpy(ctx->status_detail.err_instr, ".bank");
+            return 1;
+        }
+        update_load_offset(ctx);
         return 0;
     }
 
@@ -400,19 +501,85 @@ static int parse_param(struct asm_ctx* ctx, char* param)
     return 0;
 }
 
-void asm_ble(struct asm_ctx* ctx, int (*nextc)(void*), void* arg)
+#define ASM_MAX_INCLUDE_DEPTH 8
+
+static void parse_stream(struct asm_ctx* ctx, int (*nextc)(void*), void* arg);
+
+static void include_file(struct asm_ctx* ctx, char* name)
+{
+    const char* parent_file = ctx->current_file;
+    int parent_line_number  = ctx->current_line_number;
+    char* file_name;
+    FILE* file;
+
+    if (name && *name == '\'') {
+        name++;
+        name[strcspn(name, "'")] = '\0';
+    }
+
+    if (!name || ctx->include_depth >= ASM_MAX_INCLUDE_DEPTH || !(file = fopen(name, "r"))) {
+        ctx->status = ASM_ST_ERR_INCLUDE;
+        strncpy(ctx->status_detail.err_file, name ? name : "", sizeof(ctx->status_detail.err_file) - 1);
+        return;
+    }
+
+    file_name                = strdup(name);
+    ctx->current_file        = file_name;
+    ctx->current_line_number = 0;
+    ctx->include_depth++;
+
+    parse_stream(ctx, (int (*)(void*)) & getc, file);
+
+    fclose(file);
+    ctx->include_depth--;
+
+    // on error, keep the location of the innermost file for reporting
+    if (ctx->status != ASM_ST_OK) {
+        if (ctx->current_file != file_name)
+            free(file_name);
+        return;
+    }
+
+    free(file_name);
+    ctx->current_file        = parent_file;
+    ctx->current_line_number = parent_line_number;
+}
+
+static void list_line(struct asm_ctx* ctx, const char* text)
+{
+    struct line* line = (struct line*)calloc(1, sizeof(struct line));
+
+    line->text          = strdup(text);
+    line->file          = ctx->current_file ? strdup(ctx->current_file) : NULL;
+    line->line_number   = ctx->current_line_number;
+    line->include_depth = ctx->include_depth;
+    line->addr          = ctx->pc;
+    line->load_addr     = load_addr(ctx);
+    line->len           = ctx->emitted; // for now, see asm_ble()
+
+    if (!ctx->last_line)
+        ctx->last_line = &ctx->lines;
+    *ctx->last_line = line;
+    ctx->last_line  = &line->next;
+}
+
+static void parse_stream(struct asm_ctx* ctx, int (*nextc)(void*), void* arg)
 {
     char buffer[256];
+    char text[256]; // with the comment, for the listing
     int c = 0;
 
     while (c >= 0) {
-        int line_len;
+        int line_len, text_len;
         int comment = 0;
         char* ptr   = buffer;
 
         ctx->current_line_number++;
 
-        for (line_len = 0, c = nextc(arg); line_len < (sizeof(buffer) - 1) && c >= 0 && c != '\n'; c = nextc(arg)) {
+        for (line_len = 0, text_len = 0, c = nextc(arg); line_len < (sizeof(buffer) - 1) && c >= 0 && c != '\n';
+             c = nextc(arg)) {
+            if (text_len < (sizeof(text) - 1))
+                text[text_len++] = c;
             if (c == ';')
                 comment = 1;
             if (!comment)
@@ -420,12 +587,25 @@ void asm_ble(struct asm_ctx* ctx, int (*nextc)(void*), void* arg)
         }
 
         buffer[line_len] = '\0';
+        text[text_len]   = '\0';
+
+        if (ctx->listing && (c >= 0 || text_len))
+            list_line(ctx, text);
 
         parse_label(ctx, &ptr);
 
         ptr = tokenize(ptr);
         if (!ptr)
             continue;
+
+        if (0 == strcmp(ptr, ".include")) {
+            // the included file reuses the tokenizer, the rest of this line is ignored
+            include_file(ctx, tokenize(NULL));
+            if (ctx->status != ASM_ST_OK)
+                return;
+            continue;
+        }
+
         if (parse_instr(ctx, ptr))
             return;
 
@@ -433,12 +613,63 @@ void asm_ble(struct asm_ctx* ctx, int (*nextc)(void*), void* arg)
             if (parse_param(ctx, ptr))
                 return;
         }
+
+        // the operands of a directive end with its line
+        if (ctx->dot_org || ctx->dot_bank) {
+            ctx->status = ASM_ST_ERR_OPERAND;
+            strcpy(ctx->status_detail.err_instr, ctx->dot_org ? ".org" : ".bank");
+            ctx->dot_org  = 0;
+            ctx->dot_bank = 0;
+            return;
+        }
+
+        if (ctx->status != ASM_ST_OK)
+            return;
+    }
+}
+
+void asm_ble(struct asm_ctx* ctx, int (*nextc)(void*), void* arg)
+{
+    struct line* line;
+
+    parse_stream(ctx, nextc, arg);
+    if (ctx->status == ASM_ST_OK)
+        link(ctx);
+
+    // the lines hold the emitted counter at their start, a line emits up
+    // to the start of the next one
+    for (line = ctx->lines; line; line = line->next)
+        line->len = (line->next ? line->next->len : ctx->emitted) - line->len;
+}
+
+uint8_t* asm_locate(struct asm_ctx* ctx, int addr)
+{
+    struct segment* seg;
+
+    for (seg = ctx->segments; seg && seg->addr <= addr; seg = seg->next) {
+        if (addr < seg->addr + seg->len)
+            return seg->data + (addr - seg->addr);
     }
-    link(ctx);
+    return NULL;
+}
+
+int asm_image_end(struct asm_ctx* ctx)
+{
+    struct segment* seg = ctx->segments;
+
+    if (!seg)
+        return 0;
+    while (seg->next)
+        seg = seg->next;
+    return seg->addr + seg->len;
 }
 
 void asm_free(struct asm_ctx* ctx)
 {
+    if (ctx->current_file) {
+        free((char*)ctx->current_file);
+        ctx->current_file = NULL;
+    }
 
     while (ctx->references) {
         struct reference* ref = ctx->references;
@@ -448,7 +679,7 @@ void asm_free(struct asm_ctx* ctx)
         free(ref);
     }
 
-    while (ctx->references) {
+    while (ctx->symbols) {
         struct symbol* sym = ctx->symbols;
         ctx->symbols       = ctx->symbols->next;
 
@@ -456,6 +687,22 @@ void asm_free(struct asm_ctx* ctx)
         free(sym);
     }
 
-    if (ctx->output)
-        free(ctx->output);
+    while (ctx->lines) {
+        struct line* line = ctx->lines;
+        ctx->lines        = ctx->lines->next;
+
+        free(line->text);
+        free(line->file);
+        free(line);
+    }
+    ctx->last_line = NULL;
+
+    while (ctx->segments) {
+        struct segment* seg = ctx->segments;
+        ctx->segments       = ctx->segments->next;
+
+        free(seg->data);
+        free(seg);
+    }
+    ctx->current_segment = NULL;
 }
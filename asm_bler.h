@@ -11,15 +11,34 @@
 
 #include <inttypes.h>
 
+// output address of the banked code, see .bank
+#define ASM_BANK_BASE 0x10000
+
 struct asm_ctx {
     int pc;
     int current_line_number;
+    const char* current_file; // NULL for the main input, see .include
+    int include_depth;
 
-    uint8_t* output;
-    int output_alloc;
+    struct segment {
+        int addr;
+        int len;
+        int alloc;
+        uint8_t* data;
+        struct segment* next;
+    } * segments; // sorted by address, never overlapping
+    struct segment* current_segment;
 
     int dot_org;
 
+    // ".bank <bank> <size>": the following code is still assembled for the
+    // addresses set by .org, but output at ASM_BANK_BASE + bank * size
+    // + (pc % size), the bank being mapped on the window holding pc
+    int dot_bank; // parameters still expected
+    int bank; // -1 when not banked
+    int bank_size; // 0 when not banked
+    int load_offset; // output address - pc
+
     struct symbol {
         char* name;
         int addr;
@@ -37,19 +56,46 @@ struct asm_ctx {
         struct reference* next;
     } * references;
 
+    // source lines, recorded when listing is set (see i8008asm -l)
+    int listing;
+    struct line {
+        char* text;
+        char* file; // NULL for the main input
+        int line_number;
+        int include_depth;
+        int addr; // pc at the start of the line
+        int load_addr; // output address of the first byte
+        int len; // bytes emitted, once assembled
+        struct line* next;
+    } * lines; // in source order, includes inline
+    struct line** last_line;
+    int emitted; // bytes emitted so far
+
     enum asm_status {
         ASM_ST_OK = 0,
         ASM_ST_ERR_SYM,
         ASM_ST_ERR_INSTR,
+        ASM_ST_ERR_OVERLAP,
+        ASM_ST_ERR_INCLUDE,
+        ASM_ST_ERR_OPERAND, // err_instr: the directive
+        ASM_ST_ERR_BANK, // err_addr: the first address past the window of the .bank
     } status;
     union {
         struct reference* err_sym;
         char err_instr[8];
+        int err_addr;
+        char err_file[64];
     } status_detail;
 };
 
 void asm_ble(struct asm_ctx* ctx, int (*nextc)(void*), void* arg);
 
+// pointer to the emitted byte at addr, NULL when nothing was emitted there
+uint8_t* asm_locate(struct asm_ctx* ctx, int addr);
+
+// end address of the highest segment
+int asm_image_end(struct asm_ctx* ctx);
+
 void asm_free(struct asm_ctx* ctx);
 
 #endif /* ASM_BLER_H_ */
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Core benchmark: the same program run by i8008_cycle(), calling the bus
+// through cpu->io, and by an instance of the core calling it directly.
+// Build it with optimizations, for instance "make CFLAGS=-O2 bench".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "i8008.h"
+
+static uint8_t mem[0x4000];
+static uint16_t addr;
+static uint8_t ctrl;
+
+static uint8_t bench_io(struct i8008_cpu* cpu, enum i8008_state state, uint8_t bus_out)
+{
+    switch (state) {
+    case I8008_STATE_T1:
+    case I8008_STATE_T1I:
+        addr = bus_out;
+        break;
+    case I8008_STATE_T2:
+        ctrl = bus_out & I8008_T2_CTRL_MSK;
+        addr |= (bus_out & 0x3F) << 8;
+        break;
+    case I8008_STATE_T3:
+        if (ctrl == I8008_T2_CTRL_PCW)
+            mem[addr] = bus_out;
+        else if (ctrl != I8008_T2_CTRL_PCC)
+            return mem[addr];
+        break;
+    case I8008_STATE_STOPPED:
+        i8008_int_req(cpu, 1);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+#define I8008_CORE_IO(cpu, state, bus_out) bench_io(cpu, state, bus_out)
+#include "i8008_core.h"
+
+// memory, ALU, calls and jumps
+static const uint8_t program[] = {
+    0x2E, 0x20, // LHI 0x20
+    0x36, 0x00, // LLI 0
+    0xC7, // loop: LAM
+    0x04, 0x03, // ADI 3
+    0xF8, // LMA
+    0x30, // INL
+    0x46, 0x20, 0x00, // CALL sub
+    0xC1, // LAB
+    0xAE, // XRL
+    0xC8, // LBA
+    0x44, 0x04, 0x00, // JMP loop
+};
+
+static const uint8_t sub[] = {
+    0xC6, // sub: LAL
+    0x24, 0x3F, // ANI 0x3F
+    0xF0, // LLA
+    0x07, // RET
+};
+
+#define INSTRUCTIONS 50000000
+#define RUNS 5
+
+// best time of the runs, in ns per instruction
+static double run(int direct, struct i8008_cpu* cpu)
+{
+    double best = 0;
+    int r;
+
+    for (r = 0; r < RUNS; r++) {
+        struct timespec start, end;
+        double ns;
+
+        memset(mem, 0, sizeof(mem));
+        memcpy(mem, program, sizeof(program));
+        memcpy(mem + 0x20, sub, sizeof(sub));
+        i8008_init(cpu, &bench_io);
+        i8008_int_req(cpu, 0);
+
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+        if (direct) {
+            while (cpu->instructions < INSTRUCTIONS)
+                i8008_core_cycle(cpu);
+        } else {
+            while (cpu->instructions < INSTRUCTIONS)
+                i8008_cycle(cpu);
+        }
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+
+        ns = ((end.tv_sec - start.tv_sec) * 1e9 + end.tv_nsec - start.tv_nsec) / INSTRUCTIONS;
+        if (!r || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+int main()
+{
+    struct i8008_cpu indirect, direct;
+    double indirect_ns = run(0, &indirect);
+    double direct_ns   = run(1, &direct);
+
+    if (indirect.t_states != direct.t_states || memcmp(indirect.regs, direct.regs, sizeof(direct.regs))) {
+        fprintf(stderr, "the cores diverge\n");
+        return 1;
+    }
+
+    printf("indirect calls (i8008_cycle)     %6.2f ns/instruction\n", indirect_ns);
+    printf("direct calls (i8008_core_cycle)  %6.2f ns/instruction\n", direct_ns);
+    printf("speedup                          %6.2fx\n", indirect_ns / direct_ns);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "coverage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+static void unpack(uint8_t* map, const uint8_t* bits)
+{
+    int addr;
+
+    for (addr = 0; addr < I8008_ADDR_SPACE; addr++) {
+        if (bits[addr / 8] & (1 << (addr % 8)))
+            map[addr] = 1;
+    }
+}
+
+static void pack(uint8_t* bits, const uint8_t* map)
+{
+    int addr;
+
+    for (addr = 0; addr < I8008_ADDR_SPACE; addr++) {
+        if (map[addr])
+            bits[addr / 8] |= 1 << (addr % 8);
+    }
+}
+
+// read the bitmap of fd, a short one is padded with zeros
+static void read_bits(int fd, uint8_t* bits)
+{
+    ssize_t len = 0, rc;
+
+    while (len < COVERAGE_FILE_SIZE && (rc = read(fd, bits + len, COVERAGE_FILE_SIZE - len)) > 0)
+        len += rc;
+}
+
+int coverage_load(struct i8008_coverage* coverage, const char* file)
+{
+    uint8_t bits[COVERAGE_FILE_SIZE] = { 0 };
+    int fd                           = open(file, O_RDONLY);
+
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        perror(file);
+        return 1;
+    }
+    read_bits(fd, bits);
+    close(fd);
+
+    unpack(coverage->executed, bits);
+    unpack(coverage->taken, bits + I8008_ADDR_SPACE / 8);
+    unpack(coverage->not_taken, bits + 2 * I8008_ADDR_SPACE / 8);
+
+    return 0;
+}
+
+int coverage_save(const struct i8008_coverage* coverage, const char* file)
+{
+    uint8_t bits[COVERAGE_FILE_SIZE] = { 0 };
+    int fd                           = open(file, O_RDWR | O_CREAT, 0666);
+    int rc                           = 0;
+
+    // concurrent runs merge into the same file
+    if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+        perror(file);
+        return 1;
+    }
+    read_bits(fd, bits);
+
+    pack(bits, coverage->executed);
+    pack(bits + I8008_ADDR_SPACE / 8, coverage->taken);
+    pack(bits + 2 * I8008_ADDR_SPACE / 8, coverage->not_taken);
+
+    if (pwrite(fd, bits, sizeof(bits), 0) != sizeof(bits)) {
+        perror(file);
+        rc = 1;
+    }
+    close(fd);
+
+    return rc;
+}
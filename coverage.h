@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef COVERAGE_H_
+#define COVERAGE_H_
+
+#include <stdint.h>
+
+#include "i8008.h"
+
+// Coverage bitmap file: the executed, taken and not taken maps of struct
+// i8008_coverage in that order, one bit per address, least significant
+// bit first. Merging runs is a bitwise OR.
+#define COVERAGE_FILE_SIZE (3 * I8008_ADDR_SPACE / 8)
+
+// OR the bitmap of file into coverage, a missing file being empty
+int coverage_load(struct i8008_coverage* coverage, const char* file);
+
+// merge coverage into the bitmap of file, created if needed
+int coverage_save(const struct i8008_coverage* coverage, const char* file);
+
+// conditional jump, call or return: sets taken or not_taken
+static inline int coverage_conditional(uint8_t op)
+{
+    return ((op & 0xC5) == 0x40) || ((op & 0xC7) == 0x03);
+}
+
+#endif /* COVERAGE_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "platform.h"
+#include "replay.h"
+
+#define CONSOLE_POLL_PERIOD 8192 // T-states
+#define CONSOLE_OUT_SIZE 256 // initial output buffer size
+
+// INP: 0   a0 <- int enabled   a1 <- console data available
+// INP: 1   console data
+// OUT: 0   a0 -> int enabled
+// OUT: 1   console data
+
+struct console {
+    struct device device;
+    int in_char;
+    struct event poll;
+
+    // output the host could not take yet (nonblocking out_fd)
+    uint8_t* out_buffer;
+    size_t out_len;
+    size_t out_size;
+};
+
+static void console_poll(struct event* event, uint64_t now)
+{
+    struct console* console   = container_of(event, struct console, poll);
+    struct platform* platform = console->device.platform;
+
+    // a replay feeds the input through console_input()
+    if (console->in_char == -1 && !platform->host_input_held) {
+        unsigned char c;
+        ssize_t rc = read(console->device.fd, &c, 1);
+        if (rc == 1) {
+            console->in_char = c;
+            if (platform->replay)
+                replay_input(platform->replay, platform, &console->device, c);
+        } else if (rc == 0) {
+            // end of input: stop waking the halted guest up for nothing
+            console->device.fd_event = NULL;
+        }
+    }
+
+    console->device.irq = console->in_char != -1;
+    platform_irq_update(platform);
+
+    event_schedule(&platform->events, event, now + CONSOLE_POLL_PERIOD);
+}
+
+static void console_input(struct device* device, uint8_t value)
+{
+    struct console* console = container_of(device, struct console, device);
+
+    console->in_char = value;
+    device->irq      = 1;
+    platform_irq_update(device->platform);
+}
+
+static uint8_t console_inp(struct device* device, int port)
+{
+    struct console* console = container_of(device, struct console, device);
+    uint8_t result          = 0;
+
+    switch (port) {
+    case 0:
+        if (device->platform->int_enabled)
+            result |= 1 << 0;
+        if (console->in_char != -1)
+            result |= 1 << 1;
+        break;
+    case 1:
+        result           = console->in_char;
+        console->in_char = -1;
+        device->irq      = 0;
+        break;
+    }
+    return result;
+}
+
+static size_t console_flush(struct device* device)
+{
+    struct console* console = container_of(device, struct console, device);
+    size_t written          = 0;
+
+    while (written < console->out_len) {
+        ssize_t rc = write(device->out_fd, console->out_buffer + written, console->out_len - written);
+        if (rc > 0)
+            written += rc;
+        else if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else if (rc < 0 && errno != EINTR)
+            written = console->out_len; // nobody reads anymore (hangup or write error)
+    }
+
+    console->out_len -= written;
+    memmove(console->out_buffer, console->out_buffer + written, console->out_len);
+    return console->out_len;
+}
+
+static void console_out(struct device* device, int port, uint8_t value)
+{
+    struct console* console = container_of(device, struct console, device);
+
+    switch (port) {
+    case 0:
+        device->platform->int_enabled = value;
+        platform_irq_update(device->platform);
+        break;
+    case 1:
+        // kept until the host takes it, see device_drain_all()
+        if (console->out_len == console->out_size) {
+            console->out_size   = console->out_size ? 2 * console->out_size : CONSOLE_OUT_SIZE;
+            console->out_buffer = (uint8_t*)realloc(console->out_buffer, console->out_size);
+        }
+        console->out_buffer[console->out_len++] = value;
+        console_flush(device);
+        break;
+    }
+}
+
+static void console_close(struct device* device)
+{
+    struct console* console = container_of(device, struct console, device);
+
+    free(console->out_buffer);
+}
+
+// "&<n>" is the already open file descriptor n
+static int console_open(const char* file, int flags)
+{
+    if (file[0] == '&')
+        return atoi(file + 1);
+    return open(file, flags, 0666);
+}
+
+// args: [<input file>][,<output file>], stdin and stdout by default
+static struct device* console_create(struct platform* platform, const char* args)
+{
+    struct console* console;
+    char* in_file  = args ? strdup(args) : NULL;
+    char* out_file = in_file ? strchr(in_file, ',') : NULL;
+    int in_fd      = 0;
+    int out_fd     = 1;
+
+    if (out_file)
+        *(out_file++) = '\0';
+
+    if (in_file && *in_file && (in_fd = console_open(in_file, O_RDONLY)) < 0) {
+        perror(in_file);
+        free(in_file);
+        return NULL;
+    }
+    if (out_file && *out_file && (out_fd = console_open(out_file, O_WRONLY | O_CREAT | O_TRUNC)) < 0) {
+        perror(out_file);
+        free(in_file);
+        return NULL;
+    }
+    free(in_file);
+
+    console          = (struct console*)calloc(1, sizeof(struct console));
+    console->in_char = -1;
+    console->poll    = (struct event)EVENT_INIT_PASSIVE(&console_poll);
+
+    console->device.inp          = &console_inp;
+    console->device.out          = &console_out;
+    console->device.input        = &console_input;
+    console->device.status_ports = 1 << 0;
+    console->device.fd           = in_fd;
+    console->device.fd_event     = &console->poll;
+    console->device.flush        = &console_flush;
+    console->device.out_fd       = out_fd;
+    console->device.close        = &console_close;
+
+    fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    event_schedule(&platform->events, &console->poll, platform_now(platform) + CONSOLE_POLL_PERIOD);
+
+    return &console->device;
+}
+
+const struct device_type console_device_type = {
+    .name             = "console",
+    .help             = "interrupt enable and status, stdin/stdout data ([<input file>][,<output file>], &<fd>)",
+    .inp_ports        = 2,
+    .out_ports        = 2,
+    .default_inp_base = 0,
+    .default_out_base = 24,
+    .irq              = 1,
+    .create           = &console_create,
+};
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+// latency model defaults, in T-states
+#define DISK_SEEK_T_STATES 2500 // any non sequential access
+#define DISK_BYTE_T_STATES 8
+
+// OUT: 0   sector number, low byte
+// OUT: 1   sector number, high byte
+// OUT: 2   memory address, low byte
+// OUT: 3   memory address, high byte
+// OUT: 4   a0-1 -> command (0 read, 1 write, 2 flush)  a2 -> interrupt on completion
+// INP: 0   a0 <- busy  a1 <- error
+//          reading clears the completion interrupt
+// INP: 1   next byte of the sector, from its start after the sector number is written
+
+enum disk_command {
+    DISK_READ  = 0, // sector to memory
+    DISK_WRITE = 1, // memory to sector
+    DISK_FLUSH = 2,
+};
+
+enum disk_status {
+    DISK_ST_BUSY  = 1 << 0,
+    DISK_ST_ERROR = 1 << 1,
+};
+
+#define DISK_CMD_MASK 0x03
+#define DISK_CMD_IRQ (1 << 2)
+
+struct disk {
+    struct device device;
+
+    uint8_t* image; // mapped disk image
+    size_t size;
+    int sector_size;
+    int sectors;
+
+    int seek_t_states;
+    int byte_t_states;
+
+    uint16_t sector;
+    uint16_t addr;
+    int offset; // data port position within the sector
+    uint8_t command;
+    uint8_t status;
+    int next_sector; // sequential access does not seek
+
+    struct event done;
+};
+
+static void disk_done(struct event* event, uint64_t now)
+{
+    struct disk* disk = container_of(event, struct disk, done);
+
+    disk->status &= ~DISK_ST_BUSY;
+    if (disk->command & DISK_CMD_IRQ) {
+        disk->device.irq = 1;
+        platform_irq_update(disk->device.platform);
+    }
+}
+
+// copy between the mapped sector and the guest memory, without intermediate
+// buffer
+static int disk_transfer(struct disk* disk, int write)
+{
+    struct platform* platform = disk->device.platform;
+    uint8_t* sector           = disk->image + (size_t)disk->sector * disk->sector_size;
+    uint16_t addr             = disk->addr;
+    int remaining             = disk->sector_size;
+
+    while (remaining) {
+        int len;
+        uint8_t* mem = platform_mem_map(platform, addr, !write, &len);
+        if (!mem)
+            return 1;
+        if (len > remaining)
+            len = remaining;
+        if (write) {
+            memcpy(sector, mem, len);
+        } else {
+            platform_device_write(platform, addr, len);
+            memcpy(mem, sector, len);
+        }
+        sector += len;
+        addr += len;
+        remaining -= len;
+    }
+    return 0;
+}
+
+static void disk_start(struct disk* disk)
+{
+    struct platform* platform = disk->device.platform;
+    uint64_t duration         = 0;
+    int error                 = 0;
+
+    switch (disk->command & DISK_CMD_MASK) {
+    case DISK_READ:
+    case DISK_WRITE:
+        if (disk->sector >= disk->sectors) {
+            error = 1;
+            break;
+        }
+        error = disk_transfer(disk, (disk->command & DISK_CMD_MASK) == DISK_WRITE);
+        if (disk->sector != disk->next_sector)
+            duration += disk->seek_t_states;
+        duration += disk->sector_size * disk->byte_t_states;
+        disk->next_sector = disk->sector + 1;
+        break;
+    case DISK_FLUSH:
+        error = msync(disk->image, disk->size, MS_SYNC) != 0;
+        break;
+    default:
+        error = 1;
+        break;
+    }
+
+    disk->status = DISK_ST_BUSY | (error ? DISK_ST_ERROR : 0);
+    event_schedule(&platform->events, &disk->done, platform_now(platform) + duration);
+}
+
+static uint8_t disk_inp(struct device* device, int port)
+{
+    struct disk* disk = container_of(device, struct disk, device);
+    uint8_t result    = 0;
+
+    switch (port) {
+    case 0:
+        device->irq = 0;
+        result      = disk->status;
+        break;
+    case 1:
+        if (disk->sector < disk->sectors)
+            result = disk->image[(size_t)disk->sector * disk->sector_size + disk->offset];
+        disk->offset = (disk->offset + 1) % disk->sector_size;
+        break;
+    }
+    return result;
+}
+
+static void disk_out(struct device* device, int port, uint8_t value)
+{
+    struct disk* disk = container_of(device, struct disk, device);
+
+    switch (port) {
+    case 0:
+        disk->sector = (disk->sector & 0xFF00) | value;
+        disk->offset = 0;
+        break;
+    case 1:
+        disk->sector = (disk->sector & 0x00FF) | value << 8;
+        disk->offset = 0;
+        break;
+    case 2:
+        disk->addr = (disk->addr & 0xFF00) | value;
+        break;
+    case 3:
+        disk->addr = (disk->addr & 0x00FF) | value << 8;
+        break;
+    case 4:
+        if (disk->status & DISK_ST_BUSY)
+            event_cancel(&device->platform->events, &disk->done);
+        disk->command = value;
+        disk_start(disk);
+        break;
+    }
+}
+
+static void disk_reset(struct device* device)
+{
+    struct disk* disk = container_of(device, struct disk, device);
+
+    event_cancel(&device->platform->events, &disk->done);
+    disk->sector      = 0;
+    disk->addr        = 0;
+    disk->offset      = 0;
+    disk->command     = 0;
+    disk->status      = 0;
+    disk->next_sector = 0;
+    device->irq       = 0;
+}
+
+static void disk_close(struct device* device)
+{
+    struct disk* disk = container_of(device, struct disk, device);
+
+    msync(disk->image, disk->size, MS_SYNC);
+    munmap(disk->image, disk->size);
+}
+
+// args: <image file>[,<sector size>[,<seek T-states>[,<T-states per byte>]]]
+static struct device* disk_create(struct platform* platform, const char* args)
+{
+    struct disk* disk;
+    char* file;
+    char* param;
+    struct stat st;
+    int fd;
+
+    if (!args) {
+        fprintf(stderr, "disk: missing image file\n");
+        return NULL;
+    }
+
+    disk                = (struct disk*)calloc(1, sizeof(struct disk));
+    disk->sector_size   = 128;
+    disk->seek_t_states = DISK_SEEK_T_STATES;
+    disk->byte_t_states = DISK_BYTE_T_STATES;
+    disk->done          = (struct event)EVENT_INIT(&disk_done);
+
+    file  = strdup(args);
+    param = strchr(file, ',');
+    if (param) {
+        *(param++)        = '\0';
+        disk->sector_size = strtoul(param, &param, 0);
+        if (*param == ',')
+            disk->seek_t_states = strtoul(param + 1, &param, 0);
+        if (*param == ',')
+            disk->byte_t_states = strtoul(param + 1, &param, 0);
+    }
+
+    if (disk->sector_size != 128 && disk->sector_size != 256) {
+        fprintf(stderr, "disk: sectors are 128 or 256 bytes\n");
+        goto error;
+    }
+
+    fd = open(file, O_RDWR);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(file);
+        if (fd >= 0)
+            close(fd);
+        goto error;
+    }
+
+    disk->size    = st.st_size;
+    disk->sectors = disk->size / disk->sector_size;
+    if (disk->sectors > 0x10000)
+        disk->sectors = 0x10000;
+    if (!disk->sectors) {
+        fprintf(stderr, "%s: image smaller than a sector\n", file);
+        close(fd);
+        goto error;
+    }
+
+    disk->image = mmap(NULL, disk->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (disk->image == MAP_FAILED) {
+        perror(file);
+        goto error;
+    }
+    free(file);
+
+    disk->device.inp          = &disk_inp;
+    disk->device.out          = &disk_out;
+    disk->device.reset        = &disk_reset;
+    disk->device.close        = &disk_close;
+    disk->device.status_ports = 1 << 0;
+
+    return &disk->device;
+
+error:
+    free(file);
+    free(disk);
+    return NULL;
+}
+
+const struct device_type disk_device_type = {
+    .name             = "disk",
+    .help             = "mmap-backed block storage; args: image[,sector size[,seek T-states[,T-states per byte]]]",
+    .inp_ports        = 2,
+    .out_ports        = 5,
+    .default_inp_base = 4,
+    .default_out_base = 26,
+    .irq              = 1,
+    .create           = &disk_create,
+};
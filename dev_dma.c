@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <stdlib.h>
+
+#include "platform.h"
+
+#define DMA_SETUP_T_STATES 8
+#define DMA_ACCESS_T_STATES 3 // per memory access, default
+
+// OUT: 0   source address, low byte (fill: the fill value)
+// OUT: 1   source address, high byte
+// OUT: 2   destination address, low byte
+// OUT: 3   destination address, high byte
+// OUT: 4   length, low byte
+// OUT: 5   length, high byte
+// OUT: 6   a0-1 -> operation (0 copy, 1 fill, 2 compare)  a2 -> interrupt on completion
+//          writing this port starts the transfer
+// INP: 0   a0 <- busy  a1 <- compare mismatch  a2 <- first different source byte is lower
+//          reading clears the completion interrupt
+
+enum dma_op {
+    DMA_COPY    = 0,
+    DMA_FILL    = 1,
+    DMA_COMPARE = 2,
+};
+
+enum dma_status {
+    DMA_ST_BUSY     = 1 << 0,
+    DMA_ST_MISMATCH = 1 << 1,
+    DMA_ST_LOWER    = 1 << 2,
+};
+
+#define DMA_MODE_OP_MASK 0x03
+#define DMA_MODE_IRQ (1 << 2)
+
+struct dma {
+    struct device device;
+    uint16_t src;
+    uint16_t dst;
+    uint16_t len;
+    uint8_t mode;
+    uint8_t status;
+    int access_t_states;
+    struct event done;
+};
+
+static void dma_done(struct event* event, uint64_t now)
+{
+    struct dma* dma = container_of(event, struct dma, done);
+
+    dma->status &= ~DMA_ST_BUSY;
+    if (dma->mode & DMA_MODE_IRQ) {
+        dma->device.irq = 1;
+        platform_irq_update(dma->device.platform);
+    }
+}
+
+// the memory is updated at once, the device then stays busy for the
+// duration of the transfer on the bus
+static void dma_start(struct dma* dma)
+{
+    struct platform* platform = dma->device.platform;
+    uint16_t src              = dma->src;
+    uint16_t dst              = dma->dst;
+    int accesses              = 0;
+    int i;
+
+    dma->status = DMA_ST_BUSY;
+
+    switch (dma->mode & DMA_MODE_OP_MASK) {
+    case DMA_COPY:
+        // forward, byte by byte: overlapping ranges replicate the pattern
+        platform_device_write(platform, dst, dma->len);
+        for (i = 0; i < dma->len; i++)
+            platform_mem_write(platform, dst++, platform_mem_read(platform, src++));
+        accesses = 2 * dma->len;
+        break;
+    case DMA_FILL:
+        platform_device_write(platform, dst, dma->len);
+        for (i = 0; i < dma->len; i++)
+            platform_mem_write(platform, dst++, dma->src);
+        accesses = dma->len;
+        break;
+    case DMA_COMPARE:
+        for (i = 0; i < dma->len; i++) {
+            uint8_t a = platform_mem_read(platform, src++);
+            uint8_t b = platform_mem_read(platform, dst++);
+            accesses += 2;
+            if (a != b) {
+                dma->status |= DMA_ST_MISMATCH;
+                if (a < b)
+                    dma->status |= DMA_ST_LOWER;
+                break;
+            }
+        }
+        break;
+    }
+
+    event_schedule(&platform->events, &dma->done,
+                   platform_now(platform) + DMA_SETUP_T_STATES + accesses * dma->access_t_states);
+}
+
+static uint8_t dma_inp(struct device* device, int port)
+{
+    struct dma* dma = container_of(device, struct dma, device);
+
+    device->irq = 0;
+    return dma->status;
+}
+
+static void dma_out(struct device* device, int port, uint8_t value)
+{
+    struct dma* dma = container_of(device, struct dma, device);
+
+    switch (port) {
+    case 0:
+        dma->src = (dma->src & 0xFF00) | value;
+        break;
+    case 1:
+        dma->src = (dma->src & 0x00FF) | value << 8;
+        break;
+    case 2:
+        dma->dst = (dma->dst & 0xFF00) | value;
+        break;
+    case 3:
+        dma->dst = (dma->dst & 0x00FF) | value << 8;
+        break;
+    case 4:
+        dma->len = (dma->len & 0xFF00) | value;
+        break;
+    case 5:
+        dma->len = (dma->len & 0x00FF) | value << 8;
+        break;
+    case 6:
+        // restarting drops the completion of a transfer in progress
+        if (dma->status & DMA_ST_BUSY)
+            event_cancel(&device->platform->events, &dma->done);
+        dma->mode = value;
+        dma_start(dma);
+        break;
+    }
+}
+
+static void dma_reset(struct device* device)
+{
+    struct dma* dma = container_of(device, struct dma, device);
+
+    event_cancel(&device->platform->events, &dma->done);
+    dma->src = dma->dst = dma->len = 0;
+    dma->mode = dma->status = 0;
+    device->irq                 = 0;
+}
+
+static struct device* dma_create(struct platform* platform, const char* args)
+{
+    struct dma* dma = (struct dma*)calloc(1, sizeof(struct dma));
+
+    dma->access_t_states = args ? strtoul(args, NULL, 0) : DMA_ACCESS_T_STATES;
+    dma->done            = (struct event)EVENT_INIT(&dma_done);
+
+    dma->device.inp          = &dma_inp;
+    dma->device.out          = &dma_out;
+    dma->device.reset        = &dma_reset;
+    dma->device.status_ports = 1 << 0;
+
+    return &dma->device;
+}
+
+const struct device_type dma_device_type = {
+    .name             = "dma",
+    .help             = "block copy, fill and compare; args: T-states per memory access (default 3)",
+    .inp_ports        = 1,
+    .out_ports        = 7,
+    .default_inp_base = 3,
+    .default_out_base = 13,
+    .irq              = 1,
+    .create           = &dma_create,
+};
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "platform.h"
+
+// defaults, in KB
+#define MMU_WINDOW_SIZE 2
+#define MMU_MEMORY_SIZE 1024
+#define MMU_ROM_SIZE 256
+
+// OUT: 0   window number
+// OUT: 1   bank number, high byte
+// OUT: 2   bank number, low byte; maps the bank on the window
+//
+// The physical memory is split in banks of the window size, the ROM ones
+// first. Bank b starts at b * window size.
+
+struct mmu {
+    struct device device;
+    size_t window_size;
+    int window;
+    uint8_t bank_high;
+};
+
+static void mmu_switch(struct mmu* mmu, unsigned int bank)
+{
+    struct platform* platform = mmu->device.platform;
+    int pages                 = mmu->window_size / PAGE_SIZE;
+    int banks                 = platform->memory_size / mmu->window_size;
+    int page;
+
+    bank %= banks;
+    for (page = 0; page < pages; page++)
+        platform_map(platform, mmu->window * pages + page, bank * mmu->window_size + page * PAGE_SIZE);
+}
+
+static void mmu_out(struct device* device, int port, uint8_t value)
+{
+    struct mmu* mmu = container_of(device, struct mmu, device);
+
+    switch (port) {
+    case 0:
+        mmu->window = value % (PAGES * PAGE_SIZE / mmu->window_size);
+        break;
+    case 1:
+        mmu->bank_high = value;
+        break;
+    case 2:
+        mmu_switch(mmu, mmu->bank_high << 8 | value);
+        break;
+    }
+}
+
+static void mmu_reset(struct device* device)
+{
+    struct mmu* mmu = container_of(device, struct mmu, device);
+
+    // the mapping itself is reset by the platform
+    mmu->window    = 0;
+    mmu->bank_high = 0;
+}
+
+// args: <window KB>[,<memory KB>[,<ROM KB>]]
+static struct device* mmu_create(struct platform* platform, const char* args)
+{
+    size_t window_size = MMU_WINDOW_SIZE;
+    size_t memory_size = MMU_MEMORY_SIZE;
+    size_t rom_size    = MMU_ROM_SIZE;
+    struct mmu* mmu;
+
+    if (args) {
+        char* end;
+        window_size = strtoul(args, &end, 0);
+        if (*end == ',')
+            memory_size = strtoul(end + 1, &end, 0);
+        if (*end == ',')
+            rom_size = strtoul(end + 1, &end, 0);
+    }
+
+    if (window_size != 1 && window_size != 2 && window_size != 4) {
+        fprintf(stderr, "mmu: windows are 1, 2 or 4 KB\n");
+        return NULL;
+    }
+    // the power-on mapping needs 2 KB of ROM and RAM
+    if (rom_size < 2 || memory_size < rom_size + 2 || memory_size > 65536 * window_size) {
+        fprintf(stderr, "mmu: invalid memory size\n");
+        return NULL;
+    }
+
+    mmu              = (struct mmu*)calloc(1, sizeof(struct mmu));
+    mmu->window_size = window_size * 1024;
+
+    platform->memory_size = memory_size * 1024;
+    platform->rom_size    = rom_size * 1024;
+
+    mmu->device.out   = &mmu_out;
+    mmu->device.reset = &mmu_reset;
+
+    return &mmu->device;
+}
+
+const struct device_type mmu_device_type = {
+    .name             = "mmu",
+    .help             = "bank-switched memory; args: window KB (1, 2, 4)[,memory KB[,ROM KB]]",
+    .inp_ports        = 0,
+    .out_ports        = 3,
+    .default_inp_base = -1,
+    .default_out_base = 20,
+    .create           = &mmu_create,
+};
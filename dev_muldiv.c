@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+
+// OUT: 0   operand A, low byte
+// OUT: 1   operand A, high byte
+// OUT: 2   operand B, low byte
+// OUT: 3   operand B, high byte
+// OUT: 4   command, see below
+// INP: 0   next result byte, least significant first
+
+enum muldiv_command {
+    MULDIV_MUL8    = 0, // A.l * B.l -> 16-bit product
+    MULDIV_MUL16   = 1, // A * B -> 32-bit product
+    MULDIV_DIV8    = 2, // A.l / B.l -> 8-bit quotient, 8-bit remainder
+    MULDIV_DIV16   = 3, // A / B -> 16-bit quotient, 16-bit remainder
+    MULDIV_BIN2BCD = 4, // A -> 5 packed BCD digits (3 bytes)
+    MULDIV_BCD2BIN = 5, // A as 4 packed BCD digits -> 16-bit value
+};
+
+struct muldiv {
+    struct device device;
+    uint16_t a;
+    uint16_t b;
+    uint8_t result[4];
+    int result_idx;
+};
+
+static void set_result(struct muldiv* muldiv, uint32_t value)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        muldiv->result[i] = value >> (8 * i);
+    muldiv->result_idx = 0;
+}
+
+static void muldiv_execute(struct muldiv* muldiv, uint8_t command)
+{
+    uint8_t a_low = muldiv->a, b_low = muldiv->b;
+    uint32_t value = 0;
+    int i;
+
+    switch (command) {
+    case MULDIV_MUL8:
+        value = a_low * b_low;
+        break;
+    case MULDIV_MUL16:
+        value = (uint32_t)muldiv->a * muldiv->b;
+        break;
+    case MULDIV_DIV8:
+        // division by zero: all ones quotient, the dividend as remainder
+        if (b_low)
+            value = (a_low / b_low) | (a_low % b_low) << 8;
+        else
+            value = 0xFF | a_low << 8;
+        break;
+    case MULDIV_DIV16:
+        if (muldiv->b)
+            value = (muldiv->a / muldiv->b) | (uint32_t)(muldiv->a % muldiv->b) << 16;
+        else
+            value = 0xFFFF | (uint32_t)muldiv->a << 16;
+        break;
+    case MULDIV_BIN2BCD:
+        for (i = 0; i < 5; i++) {
+            uint16_t power = 1;
+            int j;
+            for (j = 0; j < i; j++)
+                power *= 10;
+            value |= (uint32_t)((muldiv->a / power) % 10) << (4 * i);
+        }
+        break;
+    case MULDIV_BCD2BIN:
+        for (i = 3; i >= 0; i--)
+            value = value * 10 + ((muldiv->a >> (4 * i)) & 0xF);
+        break;
+    }
+
+    set_result(muldiv, value);
+}
+
+static uint8_t muldiv_inp(struct device* device, int port)
+{
+    struct muldiv* muldiv = container_of(device, struct muldiv, device);
+
+    if (muldiv->result_idx >= sizeof(muldiv->result))
+        return 0;
+    return muldiv->result[muldiv->result_idx++];
+}
+
+static void muldiv_out(struct device* device, int port, uint8_t value)
+{
+    struct muldiv* muldiv = container_of(device, struct muldiv, device);
+
+    switch (port) {
+    case 0:
+        muldiv->a = (muldiv->a & 0xFF00) | value;
+        break;
+    case 1:
+        muldiv->a = (muldiv->a & 0x00FF) | value << 8;
+        break;
+    case 2:
+        muldiv->b = (muldiv->b & 0xFF00) | value;
+        break;
+    case 3:
+        muldiv->b = (muldiv->b & 0x00FF) | value << 8;
+        break;
+    case 4:
+        muldiv_execute(muldiv, value);
+        break;
+    }
+}
+
+static void muldiv_reset(struct device* device)
+{
+    struct muldiv* muldiv = container_of(device, struct muldiv, device);
+
+    muldiv->a = muldiv->b = 0;
+    memset(muldiv->result, 0, sizeof(muldiv->result));
+    muldiv->result_idx = 0;
+}
+
+static struct device* muldiv_create(struct platform* platform, const char* args)
+{
+    struct muldiv* muldiv = (struct muldiv*)calloc(1, sizeof(struct muldiv));
+
+    muldiv->device.inp   = &muldiv_inp;
+    muldiv->device.out   = &muldiv_out;
+    muldiv->device.reset = &muldiv_reset;
+
+    return &muldiv->device;
+}
+
+const struct device_type muldiv_device_type = {
+    .name             = "muldiv",
+    .help             = "multiply, divide and BCD conversion coprocessor (see muldiv.asm)",
+    .inp_ports        = 1,
+    .out_ports        = 5,
+    .default_inp_base = 2,
+    .default_out_base = 8,
+    .create           = &muldiv_create,
+};
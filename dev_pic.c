@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <stdlib.h>
+
+#include "platform.h"
+
+// Lines are assigned to the interrupting devices in attach order, line 0
+// having the highest priority. A line is served when it is not masked and
+// no line of the same or a higher priority is in service.
+//
+// OUT: 0   00 LLL RRR  line L is served by RST R
+//          0100 00SS   select the register read by the port
+//          1000 0000   end of interrupt, highest priority line in service
+//          1000 1LLL   end of interrupt, line L
+//          1100 0000   the next byte written is the mask (1: masked)
+// INP: 0   selected register: 0 pending lines, 1 lines in service, 2 mask
+//
+// Guests written before the controller never write to it: they run in the
+// legacy mode (see struct pic) up to the first command.
+
+#define PIC_CMD_FIELD 0xC0 // the command, in the two upper bits
+#define PIC_CMD_VECTOR 0x00
+#define PIC_CMD_READ 0x40
+#define PIC_CMD_EOI 0x80
+#define PIC_CMD_EOI_LINE 0x08
+#define PIC_CMD_SET_MASK 0xC0
+
+enum pic_register {
+    PIC_REG_PENDING    = 0,
+    PIC_REG_IN_SERVICE = 1,
+    PIC_REG_MASK       = 2,
+};
+
+#define INSTR_HLT 0x00
+#define INSTR_NOP 0xC0 // LAA
+#define INSTR_RST(n) (0x05 | (n) << 3)
+
+void pic_reset(struct platform* platform)
+{
+    struct pic* pic = &platform->pic;
+    int line;
+
+    pic->mask        = 0;
+    pic->in_service  = 0;
+    pic->mask_next   = 0;
+    pic->read_select = PIC_REG_PENDING;
+    pic->legacy      = 1;
+    pic->legacy_line = -1;
+
+    // RST 0 being the reset, line n is served by RST n + 1
+    for (line = 0; line < IRQ_LINES; line++)
+        pic->vectors[line] = line < 7 ? line + 1 : 7;
+}
+
+static uint8_t pic_pending(struct platform* platform)
+{
+    struct device* device;
+    uint8_t pending = 0;
+
+    for (device = platform->devices; device; device = device->next) {
+        if (device->irq && device->irq_line >= 0)
+            pending |= 1 << device->irq_line;
+    }
+    return pending;
+}
+
+int pic_next(struct platform* platform)
+{
+    struct pic* pic = &platform->pic;
+    uint8_t candidates;
+    int line;
+
+    // in the legacy mode, a halted CPU wakes up even with the interrupts disabled
+    if (!platform->int_enabled && !(pic->legacy && platform->halted))
+        return -1;
+
+    candidates = pic_pending(platform) & ~pic->mask;
+    if (pic->in_service) // lines of a higher priority than the one served
+        candidates &= (pic->in_service & -pic->in_service) - 1;
+
+    for (line = 0; line < IRQ_LINES; line++) {
+        if (candidates & (1 << line))
+            return line;
+    }
+    return -1;
+}
+
+uint8_t pic_acknowledge(struct platform* platform)
+{
+    struct pic* pic = &platform->pic;
+    int line        = pic_next(platform);
+    int halted      = platform->halted;
+
+    platform->halted = 0;
+
+    // nothing to serve (anymore): stay halted, or go on
+    if (line < 0)
+        return halted ? INSTR_HLT : INSTR_NOP;
+
+    if (pic->legacy) {
+        // RST 1 whatever the line, the handler ending with RETI
+        pic->legacy_line      = platform->int_enabled ? line : -1;
+        platform->int_enabled = 0;
+        return INSTR_RST(1);
+    }
+
+    pic->in_service |= 1 << line;
+    return INSTR_RST(pic->vectors[line]);
+}
+
+void pic_reti(struct platform* platform)
+{
+    struct pic* pic = &platform->pic;
+
+    if (!pic->legacy)
+        return;
+
+    pic->legacy_line      = -1;
+    platform->int_enabled = 1;
+    platform_irq_update(platform);
+}
+
+static uint8_t pic_inp(struct device* device, int port)
+{
+    struct platform* platform = device->platform;
+
+    switch (platform->pic.read_select) {
+    case PIC_REG_PENDING:
+        return pic_pending(platform);
+    case PIC_REG_IN_SERVICE:
+        return platform->pic.in_service;
+    case PIC_REG_MASK:
+        return platform->pic.mask;
+    }
+    return 0;
+}
+
+static void pic_out(struct device* device, int port, uint8_t value)
+{
+    struct platform* platform = device->platform;
+    struct pic* pic           = &platform->pic;
+
+    if (pic->legacy) {
+        // out of the legacy mode: an interrupt being served is now in
+        // service, with the interrupts enabled again, for its EOI
+        pic->legacy = 0;
+        if (pic->legacy_line >= 0) {
+            pic->in_service |= 1 << pic->legacy_line;
+            platform->int_enabled = 1;
+            pic->legacy_line      = -1;
+        }
+    }
+
+    if (pic->mask_next) {
+        pic->mask      = value;
+        pic->mask_next = 0;
+        platform_irq_update(platform);
+        return;
+    }
+
+    switch (value & PIC_CMD_FIELD) {
+    case PIC_CMD_VECTOR:
+        pic->vectors[(value >> 3) & 7] = value & 7;
+        break;
+    case PIC_CMD_READ:
+        pic->read_select = value & 3;
+        break;
+    case PIC_CMD_EOI:
+        if (value & PIC_CMD_EOI_LINE)
+            pic->in_service &= ~(1 << (value & 7));
+        else
+            pic->in_service &= pic->in_service - 1; // lowest bit, highest priority
+        platform_irq_update(platform);
+        break;
+    case PIC_CMD_SET_MASK:
+        pic->mask_next = 1;
+        break;
+    }
+}
+
+static struct device* pic_create(struct platform* platform, const char* args)
+{
+    struct device* device = (struct device*)calloc(1, sizeof(struct device));
+
+    device->inp = &pic_inp;
+    device->out = &pic_out;
+
+    return device;
+}
+
+const struct device_type pic_device_type = {
+    .name             = "pic",
+    .help             = "vectored interrupt controller: masks, priorities, end of interrupt",
+    .inp_ports        = 1,
+    .out_ports        = 1,
+    .default_inp_base = 6,
+    .default_out_base = 23,
+    .create           = &pic_create,
+};
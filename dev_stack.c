@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <stdlib.h>
+
+#include "platform.h"
+
+// INP: 0   pop from the external stack
+// OUT: 0   push on the external stack
+
+struct stack {
+    struct device device;
+    uint8_t data[8];
+    int ptr;
+};
+
+static uint8_t stack_inp(struct device* device, int port)
+{
+    struct stack* stack = container_of(device, struct stack, device);
+
+    stack->ptr = (stack->ptr - 1) & 7;
+    return stack->data[stack->ptr];
+}
+
+static void stack_out(struct device* device, int port, uint8_t value)
+{
+    struct stack* stack = container_of(device, struct stack, device);
+
+    stack->data[stack->ptr] = value;
+    stack->ptr              = (stack->ptr + 1) & 7;
+}
+
+static void stack_reset(struct device* device)
+{
+    struct stack* stack = container_of(device, struct stack, device);
+
+    stack->ptr = 0;
+}
+
+static struct device* stack_create(struct platform* platform, const char* args)
+{
+    struct stack* stack = (struct stack*)calloc(1, sizeof(struct stack));
+
+    stack->device.inp   = &stack_inp;
+    stack->device.out   = &stack_out;
+    stack->device.reset = &stack_reset;
+
+    return &stack->device;
+}
+
+const struct device_type stack_device_type = {
+    .name             = "stack",
+    .help             = "8-byte external stack",
+    .inp_ports        = 1,
+    .out_ports        = 1,
+    .default_inp_base = 7,
+    .default_out_base = 31,
+    .create           = &stack_create,
+};
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+
+extern const struct device_type console_device_type;
+extern const struct device_type stack_device_type;
+extern const struct device_type muldiv_device_type;
+extern const struct device_type dma_device_type;
+extern const struct device_type disk_device_type;
+extern const struct device_type mmu_device_type;
+extern const struct device_type pic_device_type;
+
+static const struct device_type* device_types[] = {
+    &console_device_type,
+    &stack_device_type,
+    &muldiv_device_type,
+    &dma_device_type,
+    &disk_device_type,
+    &mmu_device_type,
+    &pic_device_type,
+    NULL,
+};
+
+static const struct device_type* find_type(const char* name, size_t len)
+{
+    int i;
+
+    for (i = 0; device_types[i]; i++) {
+        if (strlen(device_types[i]->name) == len && 0 == strncmp(device_types[i]->name, name, len))
+            return device_types[i];
+    }
+    return NULL;
+}
+
+static int check_ports(struct platform* platform, const struct device_type* type, int inp_base, int out_base)
+{
+    int port;
+
+    if (type->inp_ports && (inp_base < 0 || inp_base + type->inp_ports > INP_PORTS)) {
+        fprintf(stderr, "%s: input ports out of range\n", type->name);
+        return 1;
+    }
+    if (type->out_ports
+        && (out_base < OUT_PORT_BASE || out_base + type->out_ports > OUT_PORT_BASE + OUT_PORTS)) {
+        fprintf(stderr, "%s: output ports out of range\n", type->name);
+        return 1;
+    }
+
+    for (port = inp_base; port < inp_base + type->inp_ports; port++) {
+        if (platform->inp_devices[port]) {
+            fprintf(stderr, "%s: INP/%d already used by %s\n", type->name, port,
+                    platform->inp_devices[port]->type->name);
+            return 1;
+        }
+    }
+    for (port = out_base; port < out_base + type->out_ports; port++) {
+        if (platform->out_devices[port - OUT_PORT_BASE]) {
+            fprintf(stderr, "%s: OUT/%d already used by %s\n", type->name, port,
+                    platform->out_devices[port - OUT_PORT_BASE]->type->name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int device_attach(struct platform* platform, const char* spec)
+{
+    const struct device_type* type;
+    const char* args = strchr(spec, ':');
+    const char* at   = strchr(spec, '@');
+    struct device* device;
+    int inp_base, out_base;
+    int port;
+
+    if (at && args && at > args)
+        at = NULL; // '@' within the arguments
+
+    type = find_type(spec, at ? at - spec : args ? args - spec : strlen(spec));
+    if (!type) {
+        fprintf(stderr, "%s: unknown device\n", spec);
+        return 1;
+    }
+
+    inp_base = type->default_inp_base;
+    out_base = type->default_out_base;
+    if (at) {
+        char* end;
+        inp_base = strtol(at + 1, &end, 0);
+        if (*end == ',')
+            out_base = strtol(end + 1, &end, 0);
+    }
+
+    if (check_ports(platform, type, inp_base, out_base))
+        return 1;
+
+    device = type->create(platform, args ? args + 1 : NULL);
+    if (!device)
+        return 1;
+
+    device->type     = type;
+    device->platform = platform;
+    device->inp_base = type->inp_ports ? inp_base : -1;
+    device->out_base = type->out_ports ? out_base : -1;
+    device->irq_line = type->irq && platform->pic.lines < IRQ_LINES ? platform->pic.lines++ : -1;
+
+    for (port = 0; port < type->inp_ports; port++)
+        platform->inp_devices[inp_base + port] = device;
+    for (port = 0; port < type->out_ports; port++)
+        platform->out_devices[out_base - OUT_PORT_BASE + port] = device;
+
+    device->next      = platform->devices;
+    platform->devices = device;
+
+    return 0;
+}
+
+void device_reset_all(struct platform* platform)
+{
+    struct device* device;
+
+    for (device = platform->devices; device; device = device->next) {
+        if (device->reset)
+            device->reset(device);
+    }
+}
+
+void device_drain_all(struct platform* platform)
+{
+    struct device* device;
+
+    for (device = platform->devices; device; device = device->next) {
+        while (device->flush && device->flush(device)) {
+            struct pollfd fd = { .fd = device->out_fd, .events = POLLOUT };
+            if (poll(&fd, 1, -1) < 0)
+                return;
+        }
+    }
+}
+
+void device_close_all(struct platform* platform)
+{
+    while (platform->devices) {
+        struct device* device = platform->devices;
+        platform->devices     = device->next;
+
+        if (device->close)
+            device->close(device);
+        free(device); // the struct device comes first in the implementations
+    }
+    memset(platform->inp_devices, 0, sizeof(platform->inp_devices));
+    memset(platform->out_devices, 0, sizeof(platform->out_devices));
+}
+
+void device_list(FILE* out)
+{
+    int i;
+
+    for (i = 0; device_types[i]; i++) {
+        const struct device_type* type = device_types[i];
+
+        fprintf(out, "\t%s", type->name);
+        if (type->inp_ports)
+            fprintf(out, "\tINP/%d-%d", type->default_inp_base, type->default_inp_base + type->inp_ports - 1);
+        else
+            fprintf(out, "\t");
+        if (type->out_ports)
+            fprintf(out, "\tOUT/%d-%d", type->default_out_base, type->default_out_base + type->out_ports - 1);
+        else
+            fprintf(out, "\t");
+        fprintf(out, "\t%s\n", type->help);
+    }
+}
@@ -14,7 +14,7 @@ struct i8008_opcode {
     unsigned char size;
 };
 
-struct i8008_opcode i8008_opcodes[] = {
+static const struct i8008_opcode i8008_opcodes[] = {
     /* 00 */ { "HLT", 1 },
     /* 01 */ { "HLT", 1 },
     /* 02 */ { "RLC", 1 },
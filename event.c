@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "event.h"
+
+#include <assert.h>
+
+static void place(struct event_queue* queue, struct event* event, int idx)
+{
+    queue->heap[idx] = event;
+    event->heap_idx  = idx;
+}
+
+static void sift_up(struct event_queue* queue, int idx)
+{
+    struct event* event = queue->heap[idx];
+
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (queue->heap[parent]->when <= event->when)
+            break;
+        place(queue, queue->heap[parent], idx);
+        idx = parent;
+    }
+    place(queue, event, idx);
+}
+
+static void sift_down(struct event_queue* queue, int idx)
+{
+    struct event* event = queue->heap[idx];
+
+    while (1) {
+        int child = 2 * idx + 1;
+        if (child >= queue->count)
+            break;
+        if (child + 1 < queue->count && queue->heap[child + 1]->when < queue->heap[child]->when)
+            child++;
+        if (event->when <= queue->heap[child]->when)
+            break;
+        place(queue, queue->heap[child], idx);
+        idx = child;
+    }
+    place(queue, event, idx);
+}
+
+static void update_deadline(struct event_queue* queue)
+{
+    queue->deadline = queue->count ? queue->heap[0]->when : EVENT_NEVER;
+}
+
+void event_schedule(struct event_queue* queue, struct event* event, uint64_t when)
+{
+    if (event->heap_idx < 0) {
+        assert(queue->count < sizeof(queue->heap) / sizeof(queue->heap[0]));
+        event->when = when;
+        place(queue, event, queue->count++);
+        sift_up(queue, event->heap_idx);
+    } else if (when < event->when) {
+        event->when = when;
+        sift_up(queue, event->heap_idx);
+    } else {
+        event->when = when;
+        sift_down(queue, event->heap_idx);
+    }
+    update_deadline(queue);
+}
+
+void event_cancel(struct event_queue* queue, struct event* event)
+{
+    int idx = event->heap_idx;
+    struct event* moved;
+
+    if (idx < 0)
+        return;
+
+    event->heap_idx = -1;
+    event->when     = EVENT_NEVER;
+
+    if (--queue->count != idx) {
+        // move the last event in the hole
+        moved = queue->heap[queue->count];
+        place(queue, moved, idx);
+        sift_up(queue, idx);
+        sift_down(queue, moved->heap_idx);
+    }
+    update_deadline(queue);
+}
+
+uint64_t event_active_deadline(const struct event_queue* queue)
+{
+    uint64_t deadline = EVENT_NEVER;
+    int i;
+
+    for (i = 0; i < queue->count; i++) {
+        if (!queue->heap[i]->passive && queue->heap[i]->when < deadline)
+            deadline = queue->heap[i]->when;
+    }
+    return deadline;
+}
+
+void event_run(struct event_queue* queue, uint64_t now)
+{
+    while (queue->count && queue->heap[0]->when <= now) {
+        struct event* event = queue->heap[0];
+        event_cancel(queue, event);
+        event->handler(event, now);
+    }
+}
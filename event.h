@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef EVENT_H_
+#define EVENT_H_
+
+#include <stdint.h>
+
+#define EVENT_NEVER UINT64_MAX
+
+struct event {
+    uint64_t when; // T-state timestamp
+    void (*handler)(struct event* event, uint64_t now);
+    int heap_idx; // -1 when not scheduled
+    int passive; // only polls the host, may be postponed while the guest is idle
+};
+
+#define EVENT_INIT(h) { .when = EVENT_NEVER, .handler = (h), .heap_idx = -1 }
+#define EVENT_INIT_PASSIVE(h) { .when = EVENT_NEVER, .handler = (h), .heap_idx = -1, .passive = 1 }
+
+// min-heap on the event timestamps
+struct event_queue {
+    struct event* heap[32];
+    int count;
+    uint64_t deadline; // timestamp of the first event, kept up to date for the CPU loop
+};
+
+#define EVENT_QUEUE_INIT { .count = 0, .deadline = EVENT_NEVER }
+
+// (re)schedule event at when, an already scheduled event is moved
+void event_schedule(struct event_queue* queue, struct event* event, uint64_t when);
+
+void event_cancel(struct event_queue* queue, struct event* event);
+
+// timestamp of the first event that is not passive
+uint64_t event_active_deadline(const struct event_queue* queue);
+
+// fire the events due at now, handlers may schedule new events
+void event_run(struct event_queue* queue, uint64_t now);
+
+#endif /* EVENT_H_ */
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "forksrv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct forksrv {
+    struct platform* platform;
+
+    int marker_out; // the marker is an OUT port, a PC otherwise
+    int marker;
+    int started; // in a child
+
+    uint8_t* map;
+    uint16_t prev_block; // AFL edge hashing: previous block id, shifted
+    int block_start; // the next instruction starts a basic block
+};
+
+// jumps, calls (conditional or not), returns and RST
+static int is_branch(uint8_t op) { return (op & 0xC1) == 0x40 || (op & 0xC3) == 0x03 || (op & 0xC7) == 0x05; }
+
+struct forksrv* forksrv_open(struct platform* platform, const char* marker)
+{
+    struct forksrv* forksrv;
+    const char* shm_id = getenv("__AFL_SHM_ID");
+    char* end;
+    int out;
+    long value;
+
+    if (0 == strncmp(marker, "out:", 4))
+        out = 1;
+    else if (0 == strncmp(marker, "pc:", 3))
+        out = 0;
+    else {
+        fprintf(stderr, "%s: invalid fork server marker\n", marker);
+        return NULL;
+    }
+    value = strtol(strchr(marker, ':') + 1, &end, 0);
+    if (*end || (out && (value < OUT_PORT_BASE || value >= OUT_PORT_BASE + OUT_PORTS)) || value < 0
+        || value > 0x3FFF) {
+        fprintf(stderr, "%s: invalid fork server marker\n", marker);
+        return NULL;
+    }
+
+    forksrv              = (struct forksrv*)calloc(1, sizeof(struct forksrv));
+    forksrv->platform    = platform;
+    forksrv->marker_out  = out;
+    forksrv->marker      = value;
+    forksrv->block_start = 1;
+
+    if (shm_id) {
+        forksrv->map = (uint8_t*)shmat(atoi(shm_id), NULL, 0);
+        if (forksrv->map == (void*)-1) {
+            perror("shmat");
+            free(forksrv);
+            return NULL;
+        }
+    } else
+        forksrv->map = (uint8_t*)calloc(1, FORKSRV_MAP_SIZE);
+
+    // the boot must not consume the test cases
+    platform->host_input_held = 1;
+
+    return forksrv;
+}
+
+static void serve(struct forksrv* forksrv)
+{
+    uint32_t msg = 0;
+    int status;
+    pid_t pid;
+
+    // hello
+    if (write(FORKSRV_FD + 1, &msg, 4) != 4) {
+        fprintf(stderr, "fork server: no controller on fd %d\n", FORKSRV_FD + 1);
+        exit(1);
+    }
+
+    for (;;) {
+        if (read(FORKSRV_FD, &msg, 4) != 4)
+            exit(0); // the fuzzer is gone
+
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (!pid) {
+            close(FORKSRV_FD);
+            close(FORKSRV_FD + 1);
+            return;
+        }
+
+        if (write(FORKSRV_FD + 1, &pid, 4) != 4 || waitpid(pid, &status, 0) < 0
+            || write(FORKSRV_FD + 1, &status, 4) != 4)
+            exit(1);
+    }
+}
+
+void forksrv_marker(struct forksrv* forksrv, int out, int value)
+{
+    if (forksrv->started || out != forksrv->marker_out || value != forksrv->marker)
+        return;
+
+    serve(forksrv);
+
+    // in the child, from the warm state
+    forksrv->started                   = 1;
+    forksrv->platform->host_input_held = 0;
+}
+
+void forksrv_step(struct forksrv* forksrv)
+{
+    struct i8008_cpu* cpu = &forksrv->platform->cpu;
+    uint16_t pc           = cpu->stack[cpu->stack_idx] & 0x3FFF;
+
+    if (!forksrv->started) {
+        if (!forksrv->marker_out)
+            forksrv_marker(forksrv, 0, pc);
+        return;
+    }
+
+    if (forksrv->block_start) {
+        // spread the 14-bit addresses over the map
+        uint16_t block = pc * 0x9E5;
+
+        forksrv->map[block ^ forksrv->prev_block]++;
+        forksrv->prev_block = block >> 1;
+    }
+
+    // an interrupt acknowledge cycle comes next, or a branch
+    forksrv->block_start = cpu->int_req || is_branch(platform_mem_read(forksrv->platform, pc));
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef FORKSRV_H_
+#define FORKSRV_H_
+
+#include "platform.h"
+
+// Fork server for AFL-style fuzzers. The machine boots once, without host
+// input, up to a marker: an OUT to a given port or a given PC. There, the
+// process turns into the server of the AFL control protocol (control pipe
+// on fd 198, status pipe on fd 199): each request forks a copy-on-write
+// child that resumes from the marker and reads the test case from stdin.
+// The children record the edges between the basic blocks of the guest in
+// the AFL coverage map (__AFL_SHM_ID), a private map otherwise.
+
+#define FORKSRV_FD 198
+#define FORKSRV_MAP_SIZE 65536
+
+struct forksrv;
+
+// marker: "out:<port>" or "pc:<address>"
+struct forksrv* forksrv_open(struct platform* platform, const char* marker);
+
+// the guest reached the marker, OUT port if out is set, PC otherwise:
+// only returns in the children
+void forksrv_marker(struct forksrv* forksrv, int out, int value);
+
+// before each instruction: edge coverage, PC marker
+void forksrv_step(struct forksrv* forksrv);
+
+#endif /* FORKSRV_H_ */
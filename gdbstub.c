@@ -0,0 +1,591 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "gdbstub.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "disasm.h"
+
+#define GDB_POLL_PERIOD 65536 // T-states
+#define GDB_MAX_BLOCK 256 // instructions run unchecked at most
+#define GDB_PACKET_SIZE 4096
+
+#define SIGINT_NUMBER 2
+#define SIGTRAP_NUMBER 5
+
+static const char hex[] = "0123456789abcdef";
+
+// target description, the register layout of the 'g' packet
+static const char target_xml[] = "<?xml version=\"1.0\"?>\n"
+                                 "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+                                 "<target version=\"1.0\">\n"
+                                 "  <feature name=\"org.i8008.cpu\">\n"
+                                 "    <flags id=\"i8008_flags\" size=\"1\">\n"
+                                 "      <field name=\"C\" start=\"0\" end=\"0\"/>\n"
+                                 "      <field name=\"Z\" start=\"1\" end=\"1\"/>\n"
+                                 "      <field name=\"S\" start=\"2\" end=\"2\"/>\n"
+                                 "      <field name=\"P\" start=\"3\" end=\"3\"/>\n"
+                                 "    </flags>\n"
+                                 "    <reg name=\"a\" bitsize=\"8\" type=\"uint8\" regnum=\"0\"/>\n"
+                                 "    <reg name=\"b\" bitsize=\"8\" type=\"uint8\"/>\n"
+                                 "    <reg name=\"c\" bitsize=\"8\" type=\"uint8\"/>\n"
+                                 "    <reg name=\"d\" bitsize=\"8\" type=\"uint8\"/>\n"
+                                 "    <reg name=\"e\" bitsize=\"8\" type=\"uint8\"/>\n"
+                                 "    <reg name=\"h\" bitsize=\"8\" type=\"uint8\"/>\n"
+                                 "    <reg name=\"l\" bitsize=\"8\" type=\"uint8\"/>\n"
+                                 "    <reg name=\"flags\" bitsize=\"8\" type=\"i8008_flags\"/>\n"
+                                 "    <reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+                                 "  </feature>\n"
+                                 "</target>\n";
+
+static int from_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int hex_byte(const char* str) { return from_hex(str[0]) << 4 | from_hex(str[1]); }
+
+static uint16_t* pc(struct gdb* gdb) { return &gdb->platform->cpu.stack[gdb->platform->cpu.stack_idx]; }
+
+static int get_char(struct gdb* gdb)
+{
+    unsigned char c;
+
+    if (read(gdb->fd, &c, 1) != 1)
+        return -1;
+    return c;
+}
+
+static void send_packet(struct gdb* gdb, const char* data)
+{
+    size_t len  = strlen(data);
+    char* frame = (char*)malloc(len + 5);
+    uint8_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        sum += data[i];
+    sprintf(frame, "$%s#%02x", data, sum);
+
+    // the acknowledge is read with the next packet
+    write(gdb->fd, frame, len + 4);
+    free(frame);
+}
+
+// next command packet, NULL when the connection is lost
+static char* receive_packet(struct gdb* gdb, char* buffer)
+{
+    int c, len, checksum[2];
+    uint8_t sum;
+
+    for (;;) {
+        // skip the acknowledges, and ^C while stopped
+        do {
+            c = get_char(gdb);
+            if (c < 0)
+                return NULL;
+        } while (c != '$');
+
+        for (len = 0, sum = 0; (c = get_char(gdb)) >= 0 && c != '#';) {
+            if (len < GDB_PACKET_SIZE - 1)
+                buffer[len++] = c;
+            sum += c;
+        }
+        buffer[len] = '\0';
+        if (c < 0)
+            return NULL;
+
+        checksum[0] = get_char(gdb);
+        checksum[1] = get_char(gdb);
+        if (checksum[0] < 0 || checksum[1] < 0)
+            return NULL;
+
+        if (from_hex(checksum[0]) << 4 == (sum & 0xF0) && from_hex(checksum[1]) == (sum & 0x0F)) {
+            write(gdb->fd, "+", 1);
+            return buffer;
+        }
+        write(gdb->fd, "-", 1); // retransmission request
+    }
+}
+
+static void read_registers(struct gdb* gdb, char* out)
+{
+    struct i8008_cpu* cpu = &gdb->platform->cpu;
+    uint8_t regs[10];
+    int i;
+
+    memcpy(regs, cpu->regs, 7);
+    regs[7] = i8008_get_flags(cpu);
+    regs[8] = *pc(gdb);
+    regs[9] = *pc(gdb) >> 8;
+
+    for (i = 0; i < sizeof(regs); i++) {
+        *(out++) = hex[regs[i] >> 4];
+        *(out++) = hex[regs[i] & 0xF];
+    }
+    *out = '\0';
+}
+
+static void write_register(struct gdb* gdb, int reg, const char* value)
+{
+    struct i8008_cpu* cpu = &gdb->platform->cpu;
+
+    if (reg < 7)
+        cpu->regs[reg] = hex_byte(value);
+    else if (reg == 7)
+        i8008_set_flags(cpu, hex_byte(value));
+    else if (reg == 8)
+        *pc(gdb) = (hex_byte(value) | hex_byte(value + 2) << 8) & 0x3FFF;
+}
+
+static void read_memory(struct gdb* gdb, unsigned int addr, unsigned int len, char* out)
+{
+    if (len > GDB_PACKET_SIZE / 2 - 1)
+        len = GDB_PACKET_SIZE / 2 - 1;
+
+    while (len--) {
+        uint8_t value = platform_mem_read(gdb->platform, addr++ & 0x3FFF);
+        *(out++)      = hex[value >> 4];
+        *(out++)      = hex[value & 0xF];
+    }
+    *out = '\0';
+}
+
+// through the physical memory: the debugger may patch the ROM
+static void write_memory(struct gdb* gdb, unsigned int addr, unsigned int len, const char* data)
+{
+    struct platform* platform = gdb->platform;
+
+    for (; len-- && data[0] && data[1]; data += 2, addr++)
+        platform->memory[platform_mem_phys(platform, addr & 0x3FFF)] = hex_byte(data);
+}
+
+// Z and z packets: "<type>,<addr>,<kind or length>"
+static int set_point(struct gdb* gdb, const char* args, int insert)
+{
+    unsigned int type, addr, len;
+    int bits;
+
+    if (sscanf(args, "%x,%x,%x", &type, &addr, &len) != 3)
+        return -1;
+
+    switch (type) {
+    case 0: // software breakpoint, as a hardware one
+    case 1:
+        bits = GDB_BREAK;
+        len  = 1;
+        break;
+    case 2:
+        bits = GDB_WATCH_WRITE;
+        break;
+    case 3:
+        bits = GDB_WATCH_READ;
+        break;
+    case 4:
+        bits = GDB_WATCH_READ | GDB_WATCH_WRITE;
+        break;
+    default:
+        return 1; // unsupported
+    }
+
+    for (; len--; addr++) {
+        if (insert)
+            gdb->points[addr & 0x3FFF] |= bits;
+        else
+            gdb->points[addr & 0x3FFF] &= ~bits;
+    }
+    return 0;
+}
+
+// qXfer:features:read:<annex>:<offset>,<length>
+static void read_features(const char* args, char* reply)
+{
+    const char* annex = "target.xml:";
+    unsigned int offset, len;
+
+    if (strncmp(args, annex, strlen(annex)) || sscanf(args + strlen(annex), "%x,%x", &offset, &len) != 2) {
+        strcpy(reply, "E00");
+        return;
+    }
+    if (offset > sizeof(target_xml) - 1)
+        offset = sizeof(target_xml) - 1;
+    if (len > GDB_PACKET_SIZE - 2)
+        len = GDB_PACKET_SIZE - 2;
+    if (len > sizeof(target_xml) - 1 - offset)
+        len = sizeof(target_xml) - 1 - offset;
+
+    // 'l': the last part
+    reply[0] = offset + len < sizeof(target_xml) - 1 ? 'm' : 'l';
+    memcpy(reply + 1, target_xml + offset, len);
+    reply[1 + len] = '\0';
+}
+
+static void report_stop(struct gdb* gdb, int signal)
+{
+    char reply[32];
+
+    if (gdb->watch_hit)
+        snprintf(reply, sizeof(reply), "T%02x%swatch:%x;", signal,
+                 gdb->watch_hit == GDB_WATCH_WRITE ? "" : gdb->watch_hit == GDB_WATCH_READ ? "r" : "a",
+                 gdb->watch_addr);
+    else
+        snprintf(reply, sizeof(reply), "S%02x", signal);
+    send_packet(gdb, reply);
+}
+
+// backwards, by one instruction or up to a breakpoint or a written watchpoint
+static void reverse(struct gdb* gdb, int step)
+{
+    uint16_t writes[UNDO_MAX_WRITES];
+    int n, i;
+
+    while ((n = undo_instruction(gdb->undo, writes)) >= 0) {
+        for (i = 0; i < n; i++)
+            gdb_access(gdb, writes[i], GDB_WATCH_WRITE);
+
+        if (step || gdb->watch_hit || (gdb->points[*pc(gdb) & 0x3FFF] & GDB_BREAK)) {
+            report_stop(gdb, SIGTRAP_NUMBER);
+            gdb->watch_hit = 0;
+            return;
+        }
+    }
+    send_packet(gdb, "T05replaylog:begin;");
+}
+
+// qRcmd: the output is the hex encoded reply
+static void monitor(struct gdb* gdb, const char* command_hex, char* reply)
+{
+    char command[256], output[128];
+    size_t len;
+    long value;
+
+    for (len = 0; len < sizeof(command) - 1 && command_hex[2 * len] && command_hex[2 * len + 1]; len++)
+        command[len] = hex_byte(command_hex + 2 * len);
+    command[len] = '\0';
+
+    if (!gdb->undo)
+        snprintf(output, sizeof(output), "no undo log (see -u)\n");
+    else if (1 == sscanf(command, "back %li", &value))
+        snprintf(output, sizeof(output), "%" PRIu64 " instructions undone\n", undo_back(gdb->undo, value));
+    else if (1 == sscanf(command, "last-write %li", &value)) {
+        uint64_t undone = undo_back_to_write(gdb->undo, value & 0x3FFF);
+        if (undone)
+            snprintf(output, sizeof(output), "%" PRIu64 " instructions undone, PC 0x%04X\n", undone, *pc(gdb));
+        else
+            snprintf(output, sizeof(output), "no write to 0x%04lX in the log\n", value & 0x3FFF);
+    } else
+        snprintf(output, sizeof(output), "commands: back <count>, last-write <addr>\n");
+
+    for (len = 0; output[len]; len++) {
+        *(reply++) = hex[(uint8_t)output[len] >> 4];
+        *(reply++) = hex[output[len] & 0xF];
+    }
+    *reply = '\0';
+}
+
+enum serve_result {
+    SERVE_CONTINUE,
+    SERVE_STEP,
+    SERVE_DETACH,
+    SERVE_KILL,
+};
+
+// the guest is stopped: handle the commands until it resumes
+static enum serve_result serve(struct gdb* gdb, int signal)
+{
+    static char buffer[GDB_PACKET_SIZE], reply[GDB_PACKET_SIZE];
+    char* packet;
+
+    // the client asks for the initial stop reason
+    if (gdb->connected)
+        report_stop(gdb, signal);
+    gdb->connected = 1;
+
+    while ((packet = receive_packet(gdb, buffer))) {
+        unsigned int addr, len;
+        int rc;
+
+        reply[0] = '\0';
+
+        switch (packet[0]) {
+        case '?':
+            report_stop(gdb, signal);
+            continue;
+        case 'g':
+            read_registers(gdb, reply);
+            break;
+        case 'G': {
+            int reg;
+            for (reg = 0; reg < 8 && packet[1 + 2 * reg]; reg++)
+                write_register(gdb, reg, packet + 1 + 2 * reg);
+            if (strlen(packet + 1) >= 20)
+                write_register(gdb, 8, packet + 17);
+            strcpy(reply, "OK");
+            break;
+        }
+        case 'p':
+            read_registers(gdb, reply);
+            addr = strtoul(packet + 1, NULL, 16);
+            if (addr < 8)
+                memmove(reply, reply + 2 * addr, 2);
+            else if (addr == 8)
+                memmove(reply, reply + 16, 4);
+            else {
+                strcpy(reply, "E01");
+                break;
+            }
+            reply[addr < 8 ? 2 : 4] = '\0';
+            break;
+        case 'P': {
+            char* value;
+            addr = strtoul(packet + 1, &value, 16);
+            if (*value != '=' || addr > 8) {
+                strcpy(reply, "E01");
+                break;
+            }
+            write_register(gdb, addr, value + 1);
+            strcpy(reply, "OK");
+            break;
+        }
+        case 'm':
+            if (sscanf(packet + 1, "%x,%x", &addr, &len) != 2) {
+                strcpy(reply, "E01");
+                break;
+            }
+            read_memory(gdb, addr, len, reply);
+            break;
+        case 'M':
+            if (sscanf(packet + 1, "%x,%x:", &addr, &len) != 2 || !strchr(packet, ':')) {
+                strcpy(reply, "E01");
+                break;
+            }
+            write_memory(gdb, addr, len, strchr(packet, ':') + 1);
+            strcpy(reply, "OK");
+            break;
+        case 'Z':
+        case 'z':
+            rc = set_point(gdb, packet + 1, packet[0] == 'Z');
+            if (!rc)
+                strcpy(reply, "OK");
+            else if (rc < 0)
+                strcpy(reply, "E01");
+            break;
+        case 'c':
+            if (packet[1])
+                *pc(gdb) = strtoul(packet + 1, NULL, 16) & 0x3FFF;
+            return SERVE_CONTINUE;
+        case 's':
+            if (packet[1])
+                *pc(gdb) = strtoul(packet + 1, NULL, 16) & 0x3FFF;
+            return SERVE_STEP;
+        case 'b':
+            if (!gdb->undo || (packet[1] != 's' && packet[1] != 'c'))
+                break; // unsupported
+            reverse(gdb, packet[1] == 's');
+            continue;
+        case 'D':
+            send_packet(gdb, "OK");
+            return SERVE_DETACH;
+        case 'k':
+            return SERVE_KILL;
+        case 'q':
+            if (0 == strncmp(packet, "qSupported", 10))
+                snprintf(reply, sizeof(reply), "PacketSize=%x;qXfer:features:read+%s", GDB_PACKET_SIZE,
+                         gdb->undo ? ";ReverseStep+;ReverseContinue+" : "");
+            else if (0 == strncmp(packet, "qXfer:features:read:", 20))
+                read_features(packet + 20, reply);
+            else if (0 == strncmp(packet, "qRcmd,", 6))
+                monitor(gdb, packet + 6, reply);
+            else if (0 == strcmp(packet, "qAttached"))
+                strcpy(reply, "1");
+            else if (0 == strcmp(packet, "qC"))
+                strcpy(reply, "QC1");
+            break;
+        case 'H':
+            strcpy(reply, "OK");
+            break;
+        }
+
+        send_packet(gdb, reply);
+    }
+
+    // connection lost
+    return SERVE_DETACH;
+}
+
+// instructions from the PC up to the end of its basic block: a branch, a
+// HLT, or the instruction before the next breakpoint
+static long block_length(struct gdb* gdb)
+{
+    uint16_t addr = *pc(gdb) & 0x3FFF;
+    long len;
+
+    for (len = 1; len < GDB_MAX_BLOCK; len++) {
+        uint8_t op = platform_mem_read(gdb->platform, addr);
+
+        if ((op & 0xC1) == 0x40 || (op & 0xC3) == 0x03 || (op & 0xC7) == 0x05 || op == 0x00 || op == 0x01
+            || op == 0xFF)
+            break;
+
+        addr = (addr + i8008_opcodes[op].size) & 0x3FFF;
+        if (gdb->points[addr] & GDB_BREAK)
+            break;
+    }
+    return len;
+}
+
+int gdb_check(struct gdb* gdb)
+{
+    int signal = 0;
+
+    if (gdb->detached) {
+        gdb->budget = LONG_MAX;
+        return 0;
+    }
+
+    if (gdb->interrupted)
+        signal = SIGINT_NUMBER;
+    else if (gdb->stepping || gdb->watch_hit || (gdb->points[*pc(gdb) & 0x3FFF] & GDB_BREAK))
+        signal = SIGTRAP_NUMBER;
+
+    if (signal) {
+        switch (serve(gdb, signal)) {
+        case SERVE_CONTINUE:
+            gdb->stepping = 0;
+            break;
+        case SERVE_STEP:
+            gdb->stepping = 1;
+            break;
+        case SERVE_DETACH:
+            gdb->detached = 1;
+            memset(gdb->points, 0, sizeof(gdb->points));
+            event_cancel(&gdb->platform->events, &gdb->poll);
+            close(gdb->fd);
+            gdb->budget = LONG_MAX;
+            return 0;
+        case SERVE_KILL:
+            return 1;
+        }
+        gdb->interrupted = 0;
+        gdb->watch_hit   = 0;
+    }
+
+    gdb->budget = gdb->stepping ? 1 : block_length(gdb);
+    return 0;
+}
+
+void gdb_close(struct gdb* gdb, int status)
+{
+    char reply[8];
+
+    if (gdb->detached)
+        return;
+
+    snprintf(reply, sizeof(reply), "W%02x", status & 0xFF);
+    send_packet(gdb, reply);
+    close(gdb->fd);
+}
+
+static void gdb_poll(struct event* event, uint64_t now)
+{
+    struct gdb* gdb = container_of(event, struct gdb, poll);
+    unsigned char c;
+
+    while (recv(gdb->fd, &c, 1, MSG_DONTWAIT) == 1) {
+        if (c == 0x03) {
+            gdb->interrupted = 1;
+            gdb->budget      = 0;
+        }
+    }
+
+    event_schedule(&gdb->platform->events, event, now + GDB_POLL_PERIOD);
+}
+
+struct gdb* gdb_open(struct platform* platform, const char* where)
+{
+    struct gdb* gdb;
+    char* end;
+    long port = strtol(where, &end, 10);
+    int sock, fd, one = 1;
+
+    if (*where && !*end) {
+        struct sockaddr_in addr = { 0 };
+
+        addr.sin_family      = AF_INET;
+        addr.sin_port        = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0 || setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+            || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("gdb");
+            if (sock >= 0)
+                close(sock);
+            return NULL;
+        }
+    } else {
+        struct sockaddr_un addr = { 0 };
+        struct stat st;
+
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, where, sizeof(addr.sun_path) - 1);
+
+        // only a socket left over by a previous run is replaced
+        if (lstat(where, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                fprintf(stderr, "%s: not a socket\n", where);
+                return NULL;
+            }
+            unlink(where);
+        }
+
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror(where);
+            if (sock >= 0)
+                close(sock);
+            return NULL;
+        }
+    }
+
+    fprintf(stderr, "gdb: waiting for the client on %s\n", where);
+    if (listen(sock, 1) < 0 || (fd = accept(sock, NULL, NULL)) < 0) {
+        perror("gdb");
+        close(sock);
+        return NULL;
+    }
+    close(sock);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    gdb           = (struct gdb*)calloc(1, sizeof(struct gdb));
+    gdb->platform = platform;
+    gdb->fd       = fd;
+    gdb->stepping = 1; // stopped until the client resumes
+    gdb->poll     = (struct event)EVENT_INIT_PASSIVE(&gdb_poll);
+
+    event_schedule(&platform->events, &gdb->poll, platform_now(platform) + GDB_POLL_PERIOD);
+
+    return gdb;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef GDBSTUB_H_
+#define GDBSTUB_H_
+
+#include "event.h"
+#include "platform.h"
+#include "undo.h"
+
+// GDB remote serial protocol server. The registers are, in order: A, B,
+// C, D, E, H, L and the flags (8 bits each, see enum i8008_flags), then
+// the PC (16 bits), as described to the client by target.xml. The
+// addresses are those of the CPU.
+//
+// The breakpoints are a bitmap checked at the basic block boundaries
+// only: when a block is entered, the instructions up to the next branch,
+// HLT or breakpoint run unchecked (see budget).
+//
+// With an undo log, the client can step and continue backwards (up to a
+// breakpoint or a write watchpoint), and the monitor commands "back
+// <count>" and "last-write <addr>" go back by instructions, or to before
+// the last write to an address.
+
+#define GDB_BREAK (1 << 0)
+#define GDB_WATCH_WRITE (1 << 1)
+#define GDB_WATCH_READ (1 << 2)
+
+struct gdb {
+    struct platform* platform;
+    int fd;
+
+    uint8_t points[0x4000]; // GDB_* bits per address
+
+    // instructions left before the next check, see gdb_check()
+    long budget;
+
+    int stepping;
+    int interrupted; // ^C from the client
+    int watch_hit; // GDB_WATCH_* of the last watched access
+    uint16_t watch_addr;
+    int connected; // the initial stop was served
+    int detached;
+
+    struct event poll; // for ^C while running
+
+    struct undo* undo; // reverse execution, NULL if none
+};
+
+// listen on "<port>" (TCP, loopback) or "<path>" (Unix socket) and wait
+// for the client, the guest is stopped until it resumes it
+struct gdb* gdb_open(struct platform* platform, const char* where);
+
+// block boundary: stop and serve the client if needed, compute the next
+// budget; returns 1 when the client kills the guest
+int gdb_check(struct gdb* gdb);
+
+// the guest exited with status
+void gdb_close(struct gdb* gdb, int status);
+
+static inline void gdb_access(struct gdb* gdb, uint16_t addr, int watch)
+{
+    if (gdb->points[addr & 0x3FFF] & watch) {
+        gdb->watch_hit  = watch;
+        gdb->watch_addr = addr;
+        gdb->budget     = 0;
+    }
+}
+
+#endif /* GDBSTUB_H_ */
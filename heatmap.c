@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "heatmap.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+struct heatmap* heatmap_create(size_t size)
+{
+    struct heatmap* heatmap = (struct heatmap*)calloc(1, sizeof(struct heatmap));
+
+    heatmap->size     = size;
+    heatmap->counts   = calloc(size, sizeof(*heatmap->counts));
+    heatmap->modified = (uint8_t*)calloc(size, 1);
+
+    return heatmap;
+}
+
+void heatmap_write(struct heatmap* heatmap, size_t phys, uint16_t addr)
+{
+    heatmap_count(heatmap, phys, HEATMAP_WRITE);
+
+    if (!heatmap->counts[phys][HEATMAP_FETCH])
+        return;
+
+    heatmap->smc_writes++;
+    if (!heatmap->modified[phys]) {
+        heatmap->modified[phys] = 1;
+        fprintf(stderr, "self-modifying code: write to 0x%04X (physical 0x%05zX) by the instruction at 0x%04X\n", addr,
+                phys, heatmap->pc);
+    }
+}
+
+int heatmap_save(const struct heatmap* heatmap, const char* file)
+{
+    FILE* out = fopen(file, "w");
+    size_t phys;
+
+    if (!out) {
+        perror(file);
+        return 1;
+    }
+
+    fprintf(out, "# physical address, fetches, reads, writes; %" PRIu64 " writes to fetched addresses\n",
+            heatmap->smc_writes);
+    for (phys = 0; phys < heatmap->size; phys++) {
+        const uint32_t* counts = heatmap->counts[phys];
+
+        if (!counts[HEATMAP_FETCH] && !counts[HEATMAP_READ] && !counts[HEATMAP_WRITE])
+            continue;
+        fprintf(out, "0x%05zX %" PRIu32 " %" PRIu32 " %" PRIu32 "%s\n", phys, counts[HEATMAP_FETCH],
+                counts[HEATMAP_READ], counts[HEATMAP_WRITE], heatmap->modified[phys] ? " smc" : "");
+    }
+
+    fclose(out);
+
+    return 0;
+}
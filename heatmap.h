@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef HEATMAP_H_
+#define HEATMAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Memory access counters per physical address, and self-modifying code
+// detection: a write to an address fetched before as an instruction (or
+// operand) byte is reported once per address. The DMA and disk writes are
+// counted as writes of the instruction running (see platform.device_write).
+
+enum heatmap_access {
+    HEATMAP_FETCH = 0,
+    HEATMAP_READ  = 1,
+    HEATMAP_WRITE = 2,
+};
+
+struct heatmap {
+    size_t size;
+    uint32_t (*counts)[3]; // by enum heatmap_access, saturating
+    uint8_t* modified; // fetched then written
+    uint64_t smc_writes;
+    uint16_t pc; // address of the instruction being executed
+};
+
+struct heatmap* heatmap_create(size_t size);
+
+static inline void heatmap_count(struct heatmap* heatmap, size_t phys, enum heatmap_access access)
+{
+    if (heatmap->counts[phys][access] != UINT32_MAX)
+        heatmap->counts[phys][access]++;
+}
+
+// a write to phys, seen at addr by the CPU
+void heatmap_write(struct heatmap* heatmap, size_t phys, uint16_t addr);
+
+// one "<physical address> <fetches> <reads> <writes> [smc]" line per
+// accessed address
+int heatmap_save(const struct heatmap* heatmap, const char* file);
+
+#endif /* HEATMAP_H_ */
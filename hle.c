@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hle.h"
+
+#define CONSOLE_DATA_PORT 25 // OUT/1
+
+// The muldiv.asm routines, their guest T-states measured with the
+// emulator. They leave in A the last byte read from the device.
+
+static unsigned int hle_mul8(struct hle* hle, struct platform* platform)
+{
+    uint8_t* regs    = platform->cpu.regs;
+    uint16_t product = regs[REG_B] * regs[REG_C];
+
+    regs[REG_L] = product;
+    regs[REG_A] = regs[REG_H] = product >> 8;
+    return 67;
+}
+
+static unsigned int hle_mul16(struct hle* hle, struct platform* platform)
+{
+    uint8_t* regs    = platform->cpu.regs;
+    uint32_t product = (uint32_t)(regs[REG_B] << 8 | regs[REG_C]) * (regs[REG_D] << 8 | regs[REG_E]);
+
+    regs[REG_L] = product;
+    regs[REG_H] = product >> 8;
+    regs[REG_E] = product >> 16;
+    regs[REG_A] = regs[REG_D] = product >> 24;
+    return 131;
+}
+
+static unsigned int hle_div8(struct hle* hle, struct platform* platform)
+{
+    uint8_t* regs    = platform->cpu.regs;
+    uint8_t dividend = regs[REG_B], divisor = regs[REG_C];
+
+    // division by zero: all ones quotient, the dividend as remainder
+    regs[REG_B] = divisor ? dividend / divisor : 0xFF;
+    regs[REG_A] = regs[REG_C] = divisor ? dividend % divisor : dividend;
+    return 67;
+}
+
+static unsigned int hle_div16(struct hle* hle, struct platform* platform)
+{
+    uint8_t* regs      = platform->cpu.regs;
+    uint16_t dividend  = regs[REG_B] << 8 | regs[REG_C];
+    uint16_t divisor   = regs[REG_D] << 8 | regs[REG_E];
+    uint16_t quotient  = divisor ? dividend / divisor : 0xFFFF;
+    uint16_t remainder = divisor ? dividend % divisor : dividend;
+
+    regs[REG_B] = quotient >> 8;
+    regs[REG_C] = quotient;
+    regs[REG_E] = remainder;
+    regs[REG_A] = regs[REG_D] = remainder >> 8;
+    return 131;
+}
+
+static unsigned int hle_bin2bcd(struct hle* hle, struct platform* platform)
+{
+    uint8_t* regs  = platform->cpu.regs;
+    uint16_t value = regs[REG_H] << 8 | regs[REG_L];
+    uint32_t bcd   = 0;
+    int i;
+
+    for (i = 0; i < 5; i++, value /= 10)
+        bcd |= (uint32_t)(value % 10) << (4 * i);
+
+    regs[REG_L] = bcd;
+    regs[REG_H] = bcd >> 8;
+    regs[REG_A] = regs[REG_D] = bcd >> 16;
+    return 80;
+}
+
+static unsigned int hle_bcd2bin(struct hle* hle, struct platform* platform)
+{
+    uint8_t* regs  = platform->cpu.regs;
+    uint16_t bcd   = regs[REG_H] << 8 | regs[REG_L];
+    uint16_t value = 0;
+    int i;
+
+    for (i = 3; i >= 0; i--)
+        value = value * 10 + ((bcd >> (4 * i)) & 0xF);
+
+    regs[REG_L] = value;
+    regs[REG_A] = regs[REG_H] = value >> 8;
+    return 67;
+}
+
+// The print routine of example_hello.asm: the NUL terminated string at
+// H:L to the console, H:L being left on the NUL. It returns with A = 0
+// and the flags of CPI 0.
+static unsigned int hle_print(struct hle* hle, struct platform* platform)
+{
+    struct i8008_cpu* cpu = &platform->cpu;
+    uint16_t addr         = cpu->regs[REG_H] << 8 | cpu->regs[REG_L];
+    unsigned int t_states = 21;
+    uint8_t c;
+
+    while ((c = platform_mem_read(platform, addr))) {
+        hle->out(platform, CONSOLE_DATA_PORT, c);
+        addr++;
+        t_states += 102;
+    }
+
+    cpu->regs[REG_H] = addr >> 8;
+    cpu->regs[REG_L] = addr;
+    cpu->regs[REG_A] = 0;
+    i8008_set_flags(cpu, I8008_F_ZERO | I8008_F_PARITY);
+    return t_states;
+}
+
+static const struct hle_routine routines[] = {
+    { "mul8", "H:L = B * C", &hle_mul8 },
+    { "mul16", "D:E:H:L = B:C * D:E", &hle_mul16 },
+    { "div8", "B = B / C, C = B % C", &hle_div8 },
+    { "div16", "B:C = B:C / D:E, D:E = B:C % D:E", &hle_div16 },
+    { "bin2bcd", "D:H:L = H:L as 5 packed BCD digits", &hle_bin2bcd },
+    { "bcd2bin", "H:L = H:L as 4 packed BCD digits", &hle_bcd2bin },
+    { "print", "NUL terminated string at H:L to OUT/1", &hle_print },
+};
+
+#define ROUTINES_NUMBER (sizeof(routines) / sizeof(routines[0]))
+
+struct hle* hle_create(void (*out)(struct platform* platform, int port, uint8_t value))
+{
+    struct hle* hle = (struct hle*)calloc(1, sizeof(struct hle));
+
+    hle->out = out;
+    return hle;
+}
+
+int hle_add(struct hle* hle, const char* spec)
+{
+    const char* cost = strchr(spec, ':');
+    const char* at   = strchr(spec, '@');
+    size_t len       = at ? at - spec : cost ? cost - spec : strlen(spec);
+    struct hle_trap* trap;
+    int i;
+
+    for (i = 0; i < ROUTINES_NUMBER; i++) {
+        if (strlen(routines[i].name) == len && 0 == strncmp(routines[i].name, spec, len))
+            break;
+    }
+    if (i == ROUTINES_NUMBER) {
+        fprintf(stderr, "%s: unknown routine\n", spec);
+        return 1;
+    }
+
+    hle->list = (struct hle_trap*)realloc(hle->list, (hle->count + 1) * sizeof(struct hle_trap));
+    trap      = &hle->list[hle->count++];
+
+    trap->routine  = &routines[i];
+    trap->t_states = cost ? strtol(cost + 1, NULL, 0) : -1;
+    trap->calls    = 0;
+    if (at)
+        trap->symbol = strndup(at + 1, cost ? cost - at - 1 : strlen(at + 1));
+    else
+        trap->symbol = routines[i].name;
+
+    return 0;
+}
+
+int hle_resolve(struct hle* hle, const struct symmap* symbols)
+{
+    int rc = 0;
+    int i;
+
+    memset(hle->traps, 0, sizeof(hle->traps));
+    for (i = 0; i < hle->count; i++) {
+        struct hle_trap* trap = &hle->list[i];
+        char* end;
+        long addr = strtol(trap->symbol, &end, 0);
+
+        if (*end)
+            addr = symmap_lookup(symbols, trap->symbol);
+        if (addr < 0) {
+            fprintf(stderr, "%s: unknown symbol\n", trap->symbol);
+            rc = 1;
+            continue;
+        }
+        hle->traps[addr & 0x3FFF] = trap;
+    }
+
+    return rc;
+}
+
+void hle_call(struct hle* hle, struct hle_trap* trap, struct platform* platform)
+{
+    struct i8008_cpu* cpu = &platform->cpu;
+    unsigned int t_states = trap->routine->run(hle, platform);
+
+    // RET
+    if (cpu->stack_idx == 0)
+        cpu->stack_wraps++;
+    cpu->stack_idx = (cpu->stack_idx + 7) % 8;
+
+    cpu->t_states += trap->t_states >= 0 ? trap->t_states : t_states;
+    cpu->instructions++;
+    trap->calls++;
+}
+
+void hle_report(const struct hle* hle, FILE* out)
+{
+    int i;
+
+    for (i = 0; i < hle->count; i++)
+        fprintf(out, "hle: %s@%s calls=%" PRIu64 "\n", hle->list[i].routine->name, hle->list[i].symbol,
+                hle->list[i].calls);
+}
+
+void hle_list(FILE* out)
+{
+    int i;
+
+    for (i = 0; i < ROUTINES_NUMBER; i++)
+        fprintf(out, "\t%s\t%s\n", routines[i].name, routines[i].help);
+}
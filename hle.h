@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef HLE_H_
+#define HLE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "platform.h"
+#include "symmap.h"
+
+// High level emulation of library routines. A trap is set on the entry
+// point of a guest routine, found in the symbol map: when the CPU is
+// about to execute it, a native implementation updates the registers and
+// the memory as the guest code would, the T-states of the guest code (or
+// the configured cost) are charged, and the routine returns as with RET.
+// The whole call counts as one instruction, and the guest code is left
+// untouched.
+//
+// The traps are keyed by CPU address, whatever the memory mapping. The
+// native muldiv.asm routines do not go through the muldiv device, whose
+// registers are left as they were.
+
+struct hle;
+
+struct hle_routine {
+    const char* name;
+    const char* help;
+    // returns the T-states the guest routine takes, RET included
+    unsigned int (*run)(struct hle* hle, struct platform* platform);
+};
+
+struct hle_trap {
+    const struct hle_routine* routine;
+    const char* symbol; // or address
+    long t_states; // charged per call, -1 for those of the guest routine
+    uint64_t calls;
+};
+
+struct hle {
+    struct hle_trap* traps[0x4000]; // by address, NULL if none
+
+    struct hle_trap* list;
+    int count;
+
+    // output port of the console, for print
+    void (*out)(struct platform* platform, int port, uint8_t value);
+};
+
+struct hle* hle_create(void (*out)(struct platform* platform, int port, uint8_t value));
+
+// parse "<routine>[@<symbol>|<address>][:<T-states>]", the symbol being
+// the routine name by default
+int hle_add(struct hle* hle, const char* spec);
+
+// set the traps at the addresses of their symbols (again after a reload)
+int hle_resolve(struct hle* hle, const struct symmap* symbols);
+
+static inline struct hle_trap* hle_trap_at(struct hle* hle, uint16_t addr) { return hle->traps[addr & 0x3FFF]; }
+
+// the CPU is about to execute the trapped routine: run it and return
+void hle_call(struct hle* hle, struct hle_trap* trap, struct platform* platform);
+
+// calls per trap
+void hle_report(const struct hle* hle, FILE* out);
+
+void hle_list(FILE* out);
+
+#endif /* HLE_H_ */
@@ -35,6 +35,13 @@ enum i8008_regs {
     REG_MEM = 7,
 };
 
+enum i8008_flags {
+    I8008_F_CARRY  = 1 << 0,
+    I8008_F_ZERO   = 1 << 1,
+    I8008_F_SIGN   = 1 << 2,
+    I8008_F_PARITY = 1 << 3,
+};
+
 enum i8008_t2_ctrl {
     I8008_T2_CTRL_PCI = 0 << 6, // read instruction
     I8008_T2_CTRL_PCR = 2 << 6, // read data
@@ -43,23 +50,68 @@ enum i8008_t2_ctrl {
     I8008_T2_CTRL_MSK = 3 << 6,
 };
 
+#define I8008_ADDR_SPACE 0x4000
+
+// Code coverage, a byte per address to keep it to a single store per
+// instruction. The conditional jumps, calls and returns set taken or
+// not_taken.
+struct i8008_coverage {
+    uint8_t executed[I8008_ADDR_SPACE];
+    uint8_t taken[I8008_ADDR_SPACE];
+    uint8_t not_taken[I8008_ADDR_SPACE];
+};
+
+// Superinstructions: common idioms whose instructions run in a single
+// i8008_cycle() call, when fuse_deadline is set. Each instruction is
+// fetched through the bus as usual, and runs only if the caller would
+// have run it: no interrupt requested and t_states below the deadline.
+enum i8008_fusion {
+    I8008_FUSE_LAM_CPI_RTZ = 0, // end of string test
+    I8008_FUSE_LAL_ADI_LLA, // L increment (incHL)
+    I8008_FUSE_LLI_LHI, // H:L load
+    I8008_FUSE_LHI_LLI,
+    I8008_FUSIONS,
+};
+
 typedef uint8_t(i8008_io_func)(struct i8008_cpu* cpu, enum i8008_state state, uint8_t bus_out);
 
 struct i8008_cpu {
     i8008_io_func* io;
 
     uint8_t regs[7];
-    uint8_t flags;
+    uint8_t flags; // use i8008_get_flags(), only the carry is always up to date
+
+    // zero, sign and parity are derived from the last result when needed
+    uint8_t flags_result;
+    int flags_lazy;
 
     int stack_idx;
     uint16_t stack[8];
 
     int int_req;
     int int_cycle;
+
+    struct i8008_coverage* coverage; // optional, set after i8008_init()
+
+    // statistics
+    uint64_t instructions;
+    uint64_t t_states;
+    uint64_t stack_wraps; // nesting beyond the 7 levels, or return from the outermost level
+    uint64_t fusions[I8008_FUSIONS]; // complete idioms run fused
+
+    // superinstructions enabled when set, usually the next event timestamp
+    const uint64_t* fuse_deadline;
 };
 
 void i8008_init(struct i8008_cpu* cpu, i8008_io_func* io_func);
+// run an instruction, see i8008_core.h for a core calling the bus directly
 void i8008_cycle(struct i8008_cpu* cpu);
+// run a batch of instructions, while t_states is below *deadline (see
+// i8008_core_run()), returns how many
+uint64_t i8008_run(struct i8008_cpu* cpu, const uint64_t* deadline);
 void i8008_int_req(struct i8008_cpu* cpu, int int_req);
 
+uint8_t i8008_get_flags(struct i8008_cpu* cpu);
+void i8008_set_flags(struct i8008_cpu* cpu, uint8_t flags);
+
 #endif // 8008_H_INCLUDED
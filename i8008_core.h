@@ -0,0 +1,642 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef I8008_CORE_H_
+#define I8008_CORE_H_
+
+#include <assert.h>
+
+#include "i8008.h"
+
+// The CPU core, for a translation unit to build its own instance of it:
+// it defines I8008_CORE_IO(cpu, state, bus_out), the bus callback, then
+// includes this file and calls i8008_core_cycle() instead of
+// i8008_cycle(), i8008_core_run() instead of i8008_run(). A static
+// callback is called directly, and can be inlined in the instruction
+// handlers; cpu->io is ignored. i8008.c is the instance behind the
+// i8008_init()/i8008_cycle() API, through cpu->io.
+//
+// The CPU is still set up by i8008_init().
+
+#ifndef I8008_CORE_IO
+#error "I8008_CORE_IO must be defined"
+#endif
+
+#define MEM_PTR(cpu) (((uint16_t)(cpu)->regs[REG_H]) << 8 | (cpu)->regs[REG_L])
+#define PC(cpu) ((cpu)->stack[(cpu)->stack_idx])
+#define FIELD(value, left, right) (((value) >> (right)) & ((1 << ((left) + 1 - (right))) - 1))
+
+enum i8008_ual_op {
+    I8008_OP_ADD  = 0,
+    I8008_OP_ADDC = 1,
+    I8008_OP_SUB  = 2,
+    I8008_OP_SUBB = 3,
+    I8008_OP_AND  = 4,
+    I8008_OP_XOR  = 5,
+    I8008_OP_OR   = 6,
+    I8008_OP_CMP  = 7,
+    I8008_OP_INC, // required to prevent carry modification
+    I8008_OP_DEC, // idem
+};
+
+// outcome of the conditional branch being executed
+static void cover_branch(struct i8008_cpu* cpu, int taken)
+{
+    uint16_t pc = (PC(cpu) - 1) & 0x3FFF;
+
+    if (taken)
+        cpu->coverage->taken[pc] = 1;
+    else
+        cpu->coverage->not_taken[pc] = 1;
+}
+
+static uint8_t mem_fetch_byte(struct i8008_cpu* cpu, uint16_t addr, int is_instr, int is_inter)
+{
+    addr = addr & 0x3FFF;
+
+    I8008_CORE_IO(cpu, is_inter ? I8008_STATE_T1I : I8008_STATE_T1, addr);
+    I8008_CORE_IO(cpu, I8008_STATE_T2, addr >> 8 | (is_instr ? I8008_T2_CTRL_PCI : I8008_T2_CTRL_PCR));
+
+    return I8008_CORE_IO(cpu, I8008_STATE_T3, 0);
+}
+
+static void mem_write_byte(struct i8008_cpu* cpu, uint16_t addr, uint8_t value)
+{
+    addr = addr & 0x3FFF;
+
+    I8008_CORE_IO(cpu, I8008_STATE_T1, addr);
+    I8008_CORE_IO(cpu, I8008_STATE_T2, (addr >> 8) | I8008_T2_CTRL_PCW);
+
+    I8008_CORE_IO(cpu, I8008_STATE_T3, value);
+}
+
+static void inc_pc(struct i8008_cpu* cpu)
+{
+    if (!cpu->int_cycle)
+        PC(cpu)++;
+}
+
+// zero, sign and parity flags for each result, see i8008_init()
+extern uint8_t i8008_zsp_flags[256];
+
+static void update_flags(struct i8008_cpu* cpu, uint8_t v)
+{
+    cpu->flags_result = v;
+    cpu->flags_lazy   = 1;
+}
+
+static void materialize_flags(struct i8008_cpu* cpu)
+{
+    if (cpu->flags_lazy) {
+        cpu->flags      = (cpu->flags & I8008_F_CARRY) | i8008_zsp_flags[cpu->flags_result];
+        cpu->flags_lazy = 0;
+    }
+}
+
+static void update_carry(struct i8008_cpu* cpu, int c)
+{
+    if (!!c != !!(cpu->flags & I8008_F_CARRY))
+        cpu->flags ^= I8008_F_CARRY;
+}
+
+static void instr_INVAL(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    // TODO
+}
+
+static void instr_HALT(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    cpu->t_states += 1;
+    I8008_CORE_IO(cpu, I8008_STATE_STOPPED, 0);
+    assert(cpu->int_req);
+}
+
+static void instr_LOAD(struct i8008_cpu* cpu, uint8_t op_code, int immediate)
+{
+    unsigned int dst, src;
+    int t4_done_in_current_cycle = 0;
+    uint8_t reg_b;
+
+    // 1 1  D D D  S S S
+    dst = FIELD(op_code, 5, 3);
+    src = FIELD(op_code, 2, 0);
+
+    if (dst == REG_MEM && src == REG_MEM) {
+        instr_HALT(cpu, op_code);
+        return;
+    }
+
+    // read source
+    if (immediate) {
+        reg_b = mem_fetch_byte(cpu, PC(cpu), 0, 0);
+        inc_pc(cpu);
+        cpu->t_states += 3;
+    } else {
+        if (src == REG_MEM) {
+            reg_b = mem_fetch_byte(cpu, MEM_PTR(cpu), 0, 0);
+            cpu->t_states += 3;
+        } else {
+            reg_b = cpu->regs[src];
+            I8008_CORE_IO(cpu, I8008_STATE_T4, reg_b);
+            t4_done_in_current_cycle = 1;
+        }
+    }
+
+    // write destination
+    if (dst == REG_MEM) {
+        mem_write_byte(cpu, MEM_PTR(cpu), reg_b);
+        cpu->t_states += t4_done_in_current_cycle ? 4 : 3;
+    } else {
+        cpu->t_states += 2;
+        if (!t4_done_in_current_cycle)
+            I8008_CORE_IO(cpu, I8008_STATE_T4, reg_b);
+        cpu->regs[dst] = reg_b;
+        I8008_CORE_IO(cpu, I8008_STATE_T5, reg_b);
+    }
+}
+
+// {src|imm} op dst -> dst
+static void instr_ALU(struct i8008_cpu* cpu, enum i8008_ual_op op, enum i8008_regs src, enum i8008_regs dst,
+                      int immediate)
+{
+    uint8_t reg_b;
+    uint16_t result;
+
+    cpu->t_states += 2;
+
+    // read source
+    if (op == I8008_OP_INC || op == I8008_OP_DEC) {
+        reg_b = 1;
+    } else if (immediate) {
+        reg_b = mem_fetch_byte(cpu, PC(cpu), 0, 0);
+        inc_pc(cpu);
+        cpu->t_states += 3;
+    } else {
+        if (src == REG_MEM) {
+            reg_b = mem_fetch_byte(cpu, MEM_PTR(cpu), 0, 0);
+            cpu->t_states += 3;
+        } else {
+            reg_b = cpu->regs[src];
+        }
+        I8008_CORE_IO(cpu, I8008_STATE_T4, reg_b);
+    }
+
+    result = cpu->regs[dst];
+
+    // operation
+    switch (op) {
+    case I8008_OP_ADDC:
+        if (cpu->flags & I8008_F_CARRY)
+            result++;
+    case I8008_OP_ADD:
+    case I8008_OP_INC:
+        result += reg_b;
+        break;
+    case I8008_OP_SUBB:
+        if (cpu->flags & I8008_F_CARRY)
+            result--;
+    case I8008_OP_SUB:
+    case I8008_OP_DEC:
+    case I8008_OP_CMP:
+        result -= reg_b;
+        break;
+    case I8008_OP_AND:
+        result &= reg_b;
+        break;
+    case I8008_OP_XOR:
+        result ^= reg_b;
+        break;
+    case I8008_OP_OR:
+        result |= reg_b;
+        break;
+    }
+
+    // store result
+    if (op != I8008_OP_CMP)
+        cpu->regs[dst] = result;
+
+    update_flags(cpu, result);
+
+    if (op != I8008_OP_INC && op != I8008_OP_DEC)
+        update_carry(cpu, result & 0x100);
+}
+
+static void instr_INCDEC(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    unsigned int dst;
+
+    // 0 0  D D D  0 0 I/D
+    dst = FIELD(op_code, 5, 3);
+
+    if (dst == REG_A) {
+        instr_HALT(cpu, op_code);
+        return;
+    }
+
+    if (dst == REG_MEM) {
+        instr_INVAL(cpu, op_code);
+        return;
+    }
+
+    instr_ALU(cpu, op_code & 1 ? I8008_OP_DEC : I8008_OP_INC, 0, dst, 0);
+}
+
+static void instr_ROT(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    uint8_t* a = &cpu->regs[REG_A];
+    int a7     = (*a & 0x80) >> 7;
+    int a0     = (*a & 0x01);
+    int carry  = (cpu->flags & I8008_F_CARRY) ? 1 : 0;
+
+    cpu->t_states += 2;
+
+    switch (op_code >> 3) {
+    case 0: // RLC
+        *a <<= 1;
+        *a |= a7;
+        carry = a7;
+        break;
+    case 1: // RRC
+        *a >>= 1;
+        *a |= (a0 << 7);
+        carry = a0;
+        break;
+    case 2: // RAL
+        *a <<= 1;
+        *a |= carry;
+        carry = a7;
+        break;
+    case 3: // RAR
+        *a >>= 1;
+        *a |= (carry << 7);
+        carry = a0;
+        break;
+    }
+    update_carry(cpu, carry);
+}
+
+static void instr_JMPCALL(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    int do_jump = 0;
+    int is_a_call;
+
+    // JMP 0 1  X X X  1 0 0
+    // JFc 0 1  0 C C  0 0 0
+    // JFc 0 1  1 C C  0 0 0
+    // CAL 0 1  X X X  1 1 0
+    // CFc 0 1  0 C C  0 1 0
+    // CTc 0 1  1 C C  0 1 0
+
+    is_a_call = op_code & 0x2;
+
+    // determine what to do
+    if (op_code & 0x4) {
+        // JMP
+        do_jump = 1;
+    } else {
+        // JFc, JTc
+        int flag_idx = FIELD(op_code, 4, 3);
+        int flag_val;
+
+        materialize_flags(cpu);
+        flag_val = cpu->flags & (1 << flag_idx);
+
+        if (op_code & 0x20)
+            do_jump = flag_val; // JTc / CTc
+        else
+            do_jump = !flag_val; // JFc / CFc
+
+        if (cpu->coverage)
+            cover_branch(cpu, do_jump);
+    }
+
+    // actual jump
+    if (do_jump) {
+        uint8_t reg_b, reg_a;
+        reg_b = mem_fetch_byte(cpu, PC(cpu), 0, 0);
+        inc_pc(cpu);
+        reg_a = mem_fetch_byte(cpu, PC(cpu), 0, 0);
+        inc_pc(cpu);
+        I8008_CORE_IO(cpu, I8008_STATE_T4, reg_a);
+        I8008_CORE_IO(cpu, I8008_STATE_T5, reg_b);
+        cpu->t_states += 8;
+
+        if (is_a_call) {
+            cpu->stack_idx = (cpu->stack_idx + 1) % 8;
+            if (cpu->stack_idx == 0)
+                cpu->stack_wraps++;
+        }
+
+        PC(cpu) = FIELD(reg_a, 5, 0);
+        PC(cpu) <<= 8;
+        PC(cpu) |= reg_b;
+    } else {
+        // skip the address
+        inc_pc(cpu);
+        inc_pc(cpu);
+        cpu->t_states += 6;
+    }
+}
+
+static void instr_RET(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    // RET 0 0  X X X  1 1 1
+    // RFc 0 0  0 C C  0 1 1
+    // RTc 0 0  1 C C  0 1 1
+
+    int do_return;
+
+    // determine what to do
+    if (op_code & 0x4) {
+        // RET
+        do_return = 1;
+    } else {
+        // RFc, RTc
+        int flag_idx = FIELD(op_code, 4, 3);
+        int flag_val;
+
+        materialize_flags(cpu);
+        flag_val = cpu->flags & (1 << flag_idx);
+
+        if (op_code & 0x20)
+            do_return = flag_val; // RTc / RTc
+        else
+            do_return = !flag_val; // RFc / RFc
+
+        if (cpu->coverage)
+            cover_branch(cpu, do_return);
+    }
+
+    if (do_return) {
+        if (cpu->stack_idx == 0)
+            cpu->stack_wraps++;
+        cpu->stack_idx = (cpu->stack_idx + 7) % 8;
+        I8008_CORE_IO(cpu, I8008_STATE_T4, 0);
+        I8008_CORE_IO(cpu, I8008_STATE_T5, 0);
+        cpu->t_states += 2;
+    }
+}
+
+static void instr_RST(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    // 0 0  A A A  1 0 1
+
+    // return address
+    cpu->stack_idx = (cpu->stack_idx + 1) % 8;
+    if (cpu->stack_idx == 0)
+        cpu->stack_wraps++;
+
+    PC(cpu) = op_code & 0x38;
+
+    I8008_CORE_IO(cpu, I8008_STATE_T4, 0);
+    I8008_CORE_IO(cpu, I8008_STATE_T5, PC(cpu));
+    cpu->t_states += 2;
+}
+
+static void instr_IO(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    // INP 0 1  0 0 M  M M 1
+    // OUT 0 1  R R M  M M 1
+    uint8_t reg_b;
+    int r = FIELD(op_code, 5, 4);
+
+    I8008_CORE_IO(cpu, I8008_STATE_T1, cpu->regs[REG_A]);
+    I8008_CORE_IO(cpu, I8008_STATE_T2, op_code); // opcode prefix matches PCC cycle bits
+
+    if (r == 0) {
+        reg_b = I8008_CORE_IO(cpu, I8008_STATE_T3, 0);
+        materialize_flags(cpu);
+        I8008_CORE_IO(cpu, I8008_STATE_T4, cpu->flags);
+        cpu->regs[REG_A] = reg_b;
+        I8008_CORE_IO(cpu, I8008_STATE_T5, reg_b);
+        cpu->t_states += 5;
+    } else {
+        I8008_CORE_IO(cpu, I8008_STATE_WAIT, 0);
+        cpu->t_states += 3;
+    }
+}
+
+#define OP_LAM 0xC7
+#define OP_LAL 0xC6
+#define OP_LLA 0xF0
+#define OP_LHI 0x2E
+#define OP_LLI 0x36
+#define OP_ADI 0x04
+#define OP_CPI 0x3C
+#define OP_RTZ 0x2B
+
+// The superinstruction handlers below inline the effects of instr_LOAD(),
+// instr_ALU() and instr_RET() for their operands, bus cycles included.
+
+// fetch the instruction following a fused one, if the caller would run it
+static int fetch_next(struct i8008_cpu* cpu, uint8_t* op_code)
+{
+    if (cpu->int_req || cpu->t_states >= *cpu->fuse_deadline)
+        return 0;
+
+    if (cpu->coverage)
+        cpu->coverage->executed[PC(cpu) & 0x3FFF] = 1;
+    *op_code = mem_fetch_byte(cpu, PC(cpu), 1, 0);
+    PC(cpu)++;
+    cpu->instructions++;
+    cpu->t_states += 3;
+    return 1;
+}
+
+// Lrr, the registers being different
+static void fused_move(struct i8008_cpu* cpu, enum i8008_regs dst, enum i8008_regs src)
+{
+    uint8_t v = cpu->regs[src];
+
+    I8008_CORE_IO(cpu, I8008_STATE_T4, v);
+    cpu->regs[dst] = v;
+    I8008_CORE_IO(cpu, I8008_STATE_T5, v);
+    cpu->t_states += 2;
+}
+
+// LrM, or LrI when immediate
+static void fused_load(struct i8008_cpu* cpu, enum i8008_regs dst, int immediate)
+{
+    uint8_t v = mem_fetch_byte(cpu, immediate ? PC(cpu) : MEM_PTR(cpu), 0, 0);
+
+    if (immediate)
+        PC(cpu)++;
+    I8008_CORE_IO(cpu, I8008_STATE_T4, v);
+    cpu->regs[dst] = v;
+    I8008_CORE_IO(cpu, I8008_STATE_T5, v);
+    cpu->t_states += 5;
+}
+
+// ADI, CPI
+static void fused_alu_imm(struct i8008_cpu* cpu, enum i8008_ual_op op)
+{
+    uint16_t result = cpu->regs[REG_A];
+    uint8_t v       = mem_fetch_byte(cpu, PC(cpu), 0, 0);
+
+    PC(cpu)++;
+    cpu->t_states += 5;
+
+    if (op == I8008_OP_ADD) {
+        result += v;
+        cpu->regs[REG_A] = result;
+    } else
+        result -= v;
+    update_flags(cpu, result);
+    update_carry(cpu, result & 0x100);
+}
+
+// Run op_code and the rest of its idiom. Returns the opcode fetched to
+// be run on its own when it is not part of the idiom, -1 if none.
+static int execute_fused(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    uint8_t next;
+
+    switch (op_code) {
+    case OP_LAM:
+        fused_load(cpu, REG_A, 0);
+        if (!fetch_next(cpu, &next))
+            return -1;
+        if (next != OP_CPI)
+            return next;
+        fused_alu_imm(cpu, I8008_OP_CMP);
+        if (!fetch_next(cpu, &next))
+            return -1;
+        if (next != OP_RTZ)
+            return next;
+        materialize_flags(cpu);
+        if (cpu->coverage)
+            cover_branch(cpu, cpu->flags & I8008_F_ZERO);
+        if (cpu->flags & I8008_F_ZERO) {
+            if (cpu->stack_idx == 0)
+                cpu->stack_wraps++;
+            cpu->stack_idx = (cpu->stack_idx + 7) % 8;
+            I8008_CORE_IO(cpu, I8008_STATE_T4, 0);
+            I8008_CORE_IO(cpu, I8008_STATE_T5, 0);
+            cpu->t_states += 2;
+        }
+        cpu->fusions[I8008_FUSE_LAM_CPI_RTZ]++;
+        return -1;
+    case OP_LAL:
+        fused_move(cpu, REG_A, REG_L);
+        if (!fetch_next(cpu, &next))
+            return -1;
+        if (next != OP_ADI)
+            return next;
+        fused_alu_imm(cpu, I8008_OP_ADD);
+        if (!fetch_next(cpu, &next))
+            return -1;
+        if (next != OP_LLA)
+            return next;
+        fused_move(cpu, REG_L, REG_A);
+        cpu->fusions[I8008_FUSE_LAL_ADI_LLA]++;
+        return -1;
+    case OP_LLI:
+    case OP_LHI:
+        fused_load(cpu, op_code == OP_LLI ? REG_L : REG_H, 1);
+        if (!fetch_next(cpu, &next))
+            return -1;
+        if (next != (op_code == OP_LLI ? OP_LHI : OP_LLI))
+            return next;
+        fused_load(cpu, op_code == OP_LLI ? REG_H : REG_L, 1);
+        cpu->fusions[op_code == OP_LLI ? I8008_FUSE_LLI_LHI : I8008_FUSE_LHI_LLI]++;
+        return -1;
+    default:
+        return op_code;
+    }
+}
+
+// fetch and execute an instruction, see i8008_cycle()
+static void i8008_core_cycle(struct i8008_cpu* cpu)
+{
+    uint8_t op_code;
+
+    if (cpu->int_req)
+        cpu->int_cycle = 1;
+    else if (cpu->coverage)
+        cpu->coverage->executed[PC(cpu) & 0x3FFF] = 1;
+
+    op_code = mem_fetch_byte(cpu, PC(cpu), 1, cpu->int_cycle);
+    inc_pc(cpu);
+    cpu->instructions++;
+    cpu->t_states += 3; // PCI cycle, the instruction handlers account for the following ones
+
+    if (cpu->fuse_deadline && !cpu->int_cycle) {
+        int next = execute_fused(cpu, op_code);
+        if (next < 0)
+            return;
+        op_code = next;
+    }
+
+    switch (FIELD(op_code, 7, 6)) {
+    case 0: // 0 0  X X X  X X X
+        switch (FIELD(op_code, 2, 0)) {
+        case 0: // 0 0  X X X  0 0 X
+        case 1:
+            instr_INCDEC(cpu, op_code);
+            break;
+        case 2: // 0 0  X X X  0 1 0
+            instr_ROT(cpu, op_code);
+            break;
+        case 3: // 0 0  X X X  X 1 1
+        case 7:
+            instr_RET(cpu, op_code);
+            break;
+        case 4: // 0 0  X X X  1 0 0
+            instr_ALU(cpu, (op_code >> 3) & 0x7, 0, REG_A, 1);
+            break;
+        case 5: // 0 0  X X X  1 0 1
+            instr_RST(cpu, op_code);
+            break;
+        case 6: // 0 0  X X X  1 1 0
+            instr_LOAD(cpu, op_code, 1);
+            break;
+        }
+        break;
+    case 1:
+        if (op_code & 1) // 0 1  X X X  X X 1
+            instr_IO(cpu, op_code);
+        else // 0 1  X X X  X X 0
+            instr_JMPCALL(cpu, op_code);
+        break;
+    case 2:
+        instr_ALU(cpu, FIELD(op_code, 5, 3), FIELD(op_code, 2, 0), REG_A, 0);
+        break;
+    case 3:
+        instr_LOAD(cpu, op_code, 0);
+        break;
+    }
+
+    cpu->int_cycle = 0;
+}
+
+// Run instructions while t_states is below *deadline, read again after
+// each one: the bus callback ends the batch early by moving it, for
+// instance by scheduling an event at 0 (see event_queue.deadline).
+// Returns the number of instructions run.
+static inline uint64_t i8008_core_run(struct i8008_cpu* cpu, const uint64_t* deadline)
+{
+    uint64_t instructions = cpu->instructions;
+
+    while (cpu->t_states < *deadline)
+        i8008_core_cycle(cpu);
+    return cpu->instructions - instructions;
+}
+
+#undef MEM_PTR
+#undef PC
+#undef FIELD
+#undef OP_LAM
+#undef OP_LAL
+#undef OP_LLA
+#undef OP_LHI
+#undef OP_LLI
+#undef OP_ADI
+#undef OP_CPI
+#undef OP_RTZ
+
+#endif /* I8008_CORE_H_ */
@@ -7,18 +7,280 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "asm_bler.h"
+#include "coverage.h"
+#include "symmap.h"
 
-int main()
+enum output_format {
+    FMT_BIN,
+    FMT_IHEX,
+    FMT_SEG,
+};
+
+static void usage(const char* prg_name)
+{
+    printf("%s [-f bin|ihex|seg] [-m <map>] [-l <listing> [-c <coverage>]] < source.asm > image\n"
+           "\t-f\toutput format (default: bin)\n"
+           "\t\tbin\tflat image starting at address 0, gaps are zero-filled\n"
+           "\t\tihex\tIntel HEX records\n"
+           "\t\tseg\tsegment list: addr (LE16), length (LE16), data\n"
+           "\t-m\twrite the symbol map to <map>\n"
+           "\t-l\twrite the listing to <listing>\n"
+           "\t-c\tannotate the listing with the coverage bitmap (from i8008emu -c), + executed, - not,\n"
+           "\t\tconditional branches: t taken, n not taken\n",
+           prg_name);
+}
+
+static int write_bin(struct asm_ctx* ctx, FILE* out)
+{
+    static const uint8_t zeros[256];
+    struct segment* seg;
+    int addr = 0;
+
+    if (asm_image_end(ctx) > ASM_BANK_BASE) {
+        fprintf(stderr, "Banked output needs the ihex or seg format\n");
+        return 1;
+    }
+
+    for (seg = ctx->segments; seg; seg = seg->next) {
+        while (addr < seg->addr) {
+            int gap = seg->addr - addr;
+            if (gap > sizeof(zeros))
+                gap = sizeof(zeros);
+            fwrite(zeros, gap, 1, out);
+            addr += gap;
+        }
+        fwrite(seg->data, seg->len, 1, out);
+        addr += seg->len;
+    }
+    return 0;
+}
+
+static void write_ihex_record(FILE* out, int type, int addr, const uint8_t* data, int len)
+{
+    uint8_t sum = len + (addr >> 8) + addr + type;
+    int i;
+
+    fprintf(out, ":%02X%04X%02X", len, addr & 0xFFFF, type);
+    for (i = 0; i < len; i++) {
+        fprintf(out, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(out, "%02X\n", (uint8_t)-sum);
+}
+
+static void write_ihex(struct asm_ctx* ctx, FILE* out)
+{
+    struct segment* seg;
+    int high = 0; // upper 16 bits of the addresses, see the extended linear address record
+
+    for (seg = ctx->segments; seg; seg = seg->next) {
+        int offset, len;
+        for (offset = 0; offset < seg->len; offset += len) {
+            int addr = seg->addr + offset;
+
+            len = seg->len - offset;
+            if (len > 16)
+                len = 16;
+            if (len > 0x10000 - (addr & 0xFFFF))
+                len = 0x10000 - (addr & 0xFFFF); // records do not cross 64 KB boundaries
+
+            if (addr >> 16 != high) {
+                uint8_t data[2] = { addr >> 24, addr >> 16 };
+                high            = addr >> 16;
+                write_ihex_record(out, 0x04, 0, data, sizeof(data));
+            }
+            write_ihex_record(out, 0x00, addr, seg->data + offset, len);
+        }
+    }
+    write_ihex_record(out, 0x01, 0, NULL, 0);
+}
+
+static void write_seg(struct asm_ctx* ctx, FILE* out)
+{
+    struct segment* seg;
+    int high = 0;
+
+    for (seg = ctx->segments; seg; seg = seg->next) {
+        int offset, len;
+        for (offset = 0; offset < seg->len; offset += len) {
+            int addr = seg->addr + offset;
+            uint8_t header[4];
+
+            len = seg->len - offset;
+            if (len > 0x8000)
+                len = 0x8000;
+            if (len > 0x10000 - (addr & 0xFFFF))
+                len = 0x10000 - (addr & 0xFFFF); // segments do not cross 64 KB boundaries
+
+            // an empty segment sets the upper 16 bits of the following addresses
+            if (addr >> 16 != high) {
+                uint8_t high_header[4] = { addr >> 16, addr >> 24, 0, 0 };
+                high                   = addr >> 16;
+                fwrite(high_header, sizeof(high_header), 1, out);
+            }
+
+            header[0] = addr;
+            header[1] = addr >> 8;
+            header[2] = len;
+            header[3] = len >> 8;
+            fwrite(header, sizeof(header), 1, out);
+            fwrite(seg->data + offset, len, 1, out);
+        }
+    }
+}
+
+static int write_map(struct asm_ctx* ctx, const char* file)
+{
+    struct symmap map = { 0 };
+    FILE* out;
+    int i;
+
+    out = fopen(file, "w");
+    if (!out) {
+        perror(file);
+        return 1;
+    }
+
+    symmap_from_asm(&map, ctx);
+    for (i = 0; i < map.count; i++)
+        fprintf(out, "0x%04X %s\n", map.entries[i].addr, map.entries[i].name);
+    symmap_free(&map);
+
+    fclose(out);
+
+    return 0;
+}
+
+static int write_listing(struct asm_ctx* ctx, const char* file, const char* coverage_file)
+{
+    static struct i8008_coverage coverage;
+    const char* current_file = NULL;
+    struct line* line;
+    int lines = 0, lines_hit = 0, outcomes = 0, outcomes_hit = 0;
+    FILE* out;
+
+    if (coverage_file && coverage_load(&coverage, coverage_file))
+        return 1;
+
+    out = fopen(file, "w");
+    if (!out) {
+        perror(file);
+        return 1;
+    }
+
+    for (line = ctx->lines; line; line = line->next) {
+        char bytes[16] = "", cov[4] = "";
+        int i, addr = line->addr & (I8008_ADDR_SPACE - 1);
+
+        if (line->file != current_file && (!line->file || !current_file || strcmp(line->file, current_file)))
+            fprintf(out, "%*s; %s\n", coverage_file ? 24 : 19, "", line->file ? line->file : "(main)");
+        current_file = line->file;
+
+        for (i = 0; i < line->len && i < 3; i++)
+            sprintf(bytes + 3 * i, "%02X ", *asm_locate(ctx, line->load_addr + i));
+        if (line->len > 3)
+            strcpy(bytes + 9, "...");
+
+        if (coverage_file && line->len) {
+            uint8_t op = *asm_locate(ctx, line->load_addr);
+
+            cov[0] = coverage.executed[addr] ? '+' : '-';
+            lines++;
+            lines_hit += coverage.executed[addr];
+            if (coverage_conditional(op)) {
+                cov[1] = coverage.taken[addr] ? 't' : '-';
+                cov[2] = coverage.not_taken[addr] ? 'n' : '-';
+                outcomes += 2;
+                outcomes_hit += coverage.taken[addr] + coverage.not_taken[addr];
+            }
+        }
+
+        if (line->len)
+            fprintf(out, "%04X  %-12s", line->addr, bytes);
+        else
+            fprintf(out, "%18s", "");
+        if (coverage_file)
+            fprintf(out, "%-4s ", cov);
+        fprintf(out, "%5d  %s\n", line->line_number, line->text);
+    }
+
+    fclose(out);
+
+    if (coverage_file)
+        fprintf(stderr, "coverage: %d/%d lines, %d/%d branch outcomes\n", lines_hit, lines, outcomes_hit, outcomes);
+
+    return 0;
+}
+
+int main(int argc, char** argv)
 {
-    struct asm_ctx ctx = { 0 };
+    struct asm_ctx ctx        = { 0 };
+    enum output_format format = FMT_BIN;
+    const char* map_file      = NULL;
+    const char* listing_file  = NULL;
+    const char* coverage_file = NULL;
+    int rc;
+
+    while ((rc = getopt(argc, argv, "f:m:l:c:h")) != -1) {
+        switch (rc) {
+        case 'm':
+            map_file = optarg;
+            break;
+        case 'l':
+            listing_file = optarg;
+            ctx.listing  = 1;
+            break;
+        case 'c':
+            coverage_file = optarg;
+            break;
+        case 'f':
+            if (0 == strcmp(optarg, "bin"))
+                format = FMT_BIN;
+            else if (0 == strcmp(optarg, "ihex"))
+                format = FMT_IHEX;
+            else if (0 == strcmp(optarg, "seg"))
+                format = FMT_SEG;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
     asm_ble(&ctx, (int (*)(void*)) & getc, stdin);
+    if (ctx.current_file)
+        fprintf(stderr, "In '%s':\n", ctx.current_file);
 
     switch (ctx.status) {
     case ASM_ST_OK:
-        fwrite(ctx.output, ctx.pc, 1, stdout);
+        switch (format) {
+        case FMT_BIN:
+            if (write_bin(&ctx, stdout))
+                return 1;
+            break;
+        case FMT_IHEX:
+            write_ihex(&ctx, stdout);
+            break;
+        case FMT_SEG:
+            write_seg(&ctx, stdout);
+            break;
+        }
+        if (map_file && write_map(&ctx, map_file))
+            return 1;
+        if (listing_file && write_listing(&ctx, listing_file, coverage_file))
+            return 1;
         fprintf(stderr, "success\n");
         break;
     case ASM_ST_ERR_INSTR:
@@ -28,6 +290,20 @@ int main()
         fprintf(stderr, "Unknown symbol '%s' at line %d\n", ctx.status_detail.err_sym->name,
                 ctx.status_detail.err_sym->line_number);
         return 1;
+    case ASM_ST_ERR_OVERLAP:
+        fprintf(stderr, "Overlapping output at address 0x%04X at line %d\n", ctx.status_detail.err_addr,
+                ctx.current_line_number);
+        return 1;
+    case ASM_ST_ERR_INCLUDE:
+        fprintf(stderr, "Cannot include '%s' at line %d\n", ctx.status_detail.err_file, ctx.current_line_number);
+        return 1;
+    case ASM_ST_ERR_OPERAND:
+        fprintf(stderr, "Missing operand for '%s' at line %d\n", ctx.status_detail.err_instr, ctx.current_line_number);
+        return 1;
+    case ASM_ST_ERR_BANK:
+        fprintf(stderr, "Address 0x%04X past the window of the bank at line %d\n", ctx.status_detail.err_addr,
+                ctx.current_line_number);
+        return 1;
     }
 
     return 0;
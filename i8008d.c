@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Multi-session emulator daemon: each connection to its Unix socket gets its
+// own machine, booted from the same image, the connection being the
+// console. A single epoll loop time-slices the runnable machines, running
+// each one for a slice of T-states in turn with i8008_core_run(); the
+// machines halted or polling for console input with nothing else to wait
+// for are parked until their connection is readable, and the machines whose
+// console output the connection cannot take yet wait for it to be writable.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "i8008.h"
+#include "image.h"
+#include "platform.h"
+
+#define SLICE 100000 // default T-states run by a session in turn
+#define SESSIONS_MAX 256 // default
+#define EPOLL_EVENTS 64
+
+struct session {
+    struct platform platform;
+    int fd; // the connection, also the console
+    int parked; // waits for the connection to be readable
+    int pending; // console output pending, waits for the connection to be writable
+    int over; // halted for good, or hung up
+    struct event yield; // ends the slice, passive: the time does not run to it
+    struct session* next;
+};
+
+static const char* rom_file      = NULL;
+static const char** device_specs = NULL;
+static int device_specs_number   = 0;
+static uint64_t slice            = SLICE;
+static int sessions_max          = SESSIONS_MAX;
+static int idle_skip             = 1;
+
+// the memory of each machine at boot, the image being loaded once
+static uint8_t* boot_memory = NULL;
+static size_t boot_memory_size;
+
+static struct session* sessions = NULL;
+static int sessions_number      = 0;
+static int runnable             = 0; // sessions neither parked nor with output pending
+static int epoll_fd             = -1;
+
+static volatile sig_atomic_t stop = 0;
+
+// what the session waits for, see session_park() and session_flush()
+static void session_stall(struct session* session, int parked, int pending)
+{
+    struct epoll_event ev = { .events = 0, .data.ptr = session };
+
+    if (parked == session->parked && pending == session->pending)
+        return;
+
+    runnable += (session->parked || session->pending) - (parked || pending);
+    session->parked  = parked;
+    session->pending = pending;
+
+    if (parked)
+        ev.events |= EPOLLIN;
+    if (pending)
+        ev.events |= EPOLLOUT;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->fd, &ev);
+}
+
+// the console, while it can still read from the connection
+static struct device* session_console(struct session* session)
+{
+    struct device* device;
+
+    for (device = session->platform.devices; device; device = device->next) {
+        if (device->fd == session->fd && device->fd_event)
+            return device;
+    }
+    return NULL;
+}
+
+// end the slice: nothing can happen until the connection is readable
+static void session_park(struct session* session)
+{
+    struct platform* platform = &session->platform;
+
+    if (!session_console(session)) {
+        // the input is over
+        session->over = 1;
+    } else {
+        session_stall(session, 1, session->pending);
+    }
+    event_schedule(&platform->events, &session->yield, 0);
+}
+
+// the connection is readable
+static void session_wake(struct session* session)
+{
+    struct platform* platform = &session->platform;
+    struct device* console    = session_console(session);
+
+    if (console)
+        event_schedule(&platform->events, console->fd_event, platform_now(platform));
+    session_stall(session, 0, session->pending);
+}
+
+// write the console output the connection can take, the session waits for
+// it to be writable while some is pending (dropped on hangups)
+static void session_flush(struct session* session)
+{
+    struct device* device;
+    int pending = 0;
+
+    for (device = session->platform.devices; device; device = device->next) {
+        if (device->flush && device->out_fd == session->fd && device->flush(device))
+            pending = 1;
+    }
+    session_stall(session, session->parked, pending);
+}
+
+static void yield(struct event* event, uint64_t now) {}
+
+// the CPU halted, as in the i8008emu batch mode, the host input coming from
+// the connection
+static void halt_wait(struct session* session)
+{
+    struct platform* platform = &session->platform;
+
+    if (platform_halt_over(platform)) {
+        session->over = 1;
+        event_schedule(&platform->events, &session->yield, 0);
+        return;
+    }
+
+    if (platform_halt(platform))
+        session_park(session);
+}
+
+// run the detected polling loop up to the next device event at once
+static void idle_fast_forward(struct event* event, uint64_t now)
+{
+    struct platform* platform = container_of(event, struct platform, idle.event);
+    uint64_t deadline         = event_active_deadline(&platform->events);
+
+    // only the connection can wake the guest up, the loop goes on then
+    if (deadline == EVENT_NEVER)
+        session_park(container_of(platform, struct session, platform));
+
+    platform_idle_run(platform, deadline);
+}
+
+#define PLATFORM_HOOK_HALT(platform) halt_wait(container_of(platform, struct session, platform))
+#include "platform_bus.h"
+
+// the CPU core, calling platform_bus directly
+#define I8008_CORE_IO(cpu, state, bus_out) platform_bus(cpu, state, bus_out)
+#include "i8008_core.h"
+
+static void session_close(struct session* session)
+{
+    struct platform* platform = &session->platform;
+    struct session** link;
+
+    fprintf(stderr, "session %d: closed, %" PRIu64 " instructions, %" PRIu64 " T-states\n", session->fd,
+            platform->cpu.instructions, platform->cpu.t_states);
+
+    for (link = &sessions; *link != session; link = &(*link)->next)
+        ;
+    *link = session->next;
+    sessions_number--;
+    if (!session->parked && !session->pending)
+        runnable--;
+
+    device_close_all(platform);
+    close(session->fd);
+    free(platform->memory);
+    free(session);
+}
+
+// a machine on the connection fd, booted from boot_memory, NULL on errors
+static struct session* session_open(int fd)
+{
+    struct session* session   = (struct session*)calloc(1, sizeof(struct session));
+    struct platform* platform = &session->platform;
+    struct epoll_event ev     = { .events = 0, .data.ptr = session };
+    char console[32];
+    int i;
+
+    session->fd             = fd;
+    session->yield          = (struct event)EVENT_INIT_PASSIVE(&yield);
+    platform->events        = (struct event_queue)EVENT_QUEUE_INIT;
+    platform->idle.event    = (struct event)EVENT_INIT(&idle_fast_forward);
+    platform->idle.disabled = !idle_skip;
+    platform->rom_size      = ROM_SIZE;
+    platform->memory_size   = ROM_SIZE + RAM_SIZE;
+
+    // devices first, a memory controller sets the memory size
+    snprintf(console, sizeof(console), "console:&%d,&%d", fd, fd);
+    if (device_attach(platform, console))
+        goto fail;
+    for (i = 0; i < device_specs_number; i++) {
+        if (device_attach(platform, device_specs[i]))
+            goto fail;
+    }
+
+    // the same devices as the boot memory, the same memory size
+    platform->memory = (uint8_t*)malloc(platform->memory_size);
+    memcpy(platform->memory, boot_memory, boot_memory_size);
+    platform_map_reset(platform);
+    pic_reset(platform);
+
+    i8008_init(&platform->cpu, &platform_bus);
+    platform->cpu.fuse_deadline = &platform->events.deadline;
+
+    // only the hangups until parked
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        goto fail;
+    }
+
+    session->next = sessions;
+    sessions      = session;
+    sessions_number++;
+    runnable++;
+
+    fprintf(stderr, "session %d: opened\n", fd);
+    return session;
+
+fail:
+    device_close_all(platform);
+    free(platform->memory);
+    free(session);
+    return NULL;
+}
+
+// one slice of the session
+static void session_run(struct session* session)
+{
+    struct platform* platform = &session->platform;
+    uint64_t end              = platform_now(platform) + slice;
+
+    event_schedule(&platform->events, &session->yield, end);
+    while (!session->parked && !session->over && platform_now(platform) < end) {
+        i8008_core_run(&platform->cpu, &platform->events.deadline);
+        event_run(&platform->events, platform_now(platform));
+    }
+    event_cancel(&platform->events, &session->yield);
+}
+
+static void accept_sessions(int listen_fd)
+{
+    int fd;
+
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        if (sessions_number >= sessions_max) {
+            fprintf(stderr, "session %d: refused, %d sessions\n", fd, sessions_number);
+            close(fd);
+        } else if (!session_open(fd)) {
+            close(fd);
+        }
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
+}
+
+// remove a socket left over at path, 1 when path is something else
+static int unlink_socket(const char* path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) < 0)
+        return 0;
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "%s: not a socket\n", path);
+        return 1;
+    }
+    unlink(path);
+    return 0;
+}
+
+static int listen_on(const char* path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if (unlink_socket(path))
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char* prg_name)
+{
+    printf("%s [-I] [-S <T-states>] [-n <sessions>] [-d <device>]... <socket> <rom>\n"
+           "\t-I\tdo not fast-forward the guest polling loops\n"
+           "\t-S\tT-states run by a session in turn (default: %d)\n"
+           "\t-n\tserve up to <sessions> connections at once (default: %d)\n"
+           "\t-d\tattach the device <name>[@<inp base>[,<out base>]][:<args>] to each machine, \"-d list\"\n"
+           "\t\tlists them (default: -d stack -d muldiv -d dma -d pic), the console being the connection\n"
+           "\t<socket>\tlisten on the Unix socket <socket>\n"
+           "\t<rom>\tthe image each machine boots (see i8008emu)\n",
+           prg_name, SLICE, SESSIONS_MAX);
+}
+
+static void request_quit(int sig) { stop = 1; }
+
+int main(int argc, char** argv)
+{
+    static const char* default_devices[] = { "stack", "muldiv", "dma", "pic" };
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    struct platform boot = { .events = EVENT_QUEUE_INIT, .rom_size = ROM_SIZE, .memory_size = ROM_SIZE + RAM_SIZE };
+    const char* path;
+    int listen_fd, rc, i;
+
+    device_specs = (const char**)calloc(argc, sizeof(const char*));
+    while ((rc = getopt(argc, argv, "IS:n:d:h")) != -1) {
+        switch (rc) {
+        case 'd':
+            if (0 == strcmp(optarg, "list")) {
+                device_list(stdout);
+                exit(0);
+            }
+            device_specs[device_specs_number++] = optarg;
+            break;
+        case 'S':
+            slice = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            sessions_max = strtoul(optarg, NULL, 0);
+            break;
+        case 'I':
+            idle_skip = 0;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind + 2 != argc || !slice) {
+        usage(argv[0]);
+        exit(1);
+    }
+    path     = argv[optind];
+    rom_file = argv[optind + 1];
+    if (!device_specs_number) {
+        device_specs        = default_devices;
+        device_specs_number = sizeof(default_devices) / sizeof(default_devices[0]);
+    }
+
+    // the image is loaded once for all the sessions, with their devices: a
+    // memory controller sets the memory size
+    for (i = 0; i < device_specs_number; i++) {
+        if (device_attach(&boot, device_specs[i]))
+            exit(1);
+    }
+    boot.memory = (uint8_t*)calloc(1, boot.memory_size);
+    platform_map_reset(&boot);
+    pic_reset(&boot);
+    if (image_load(&boot, rom_file, NULL))
+        exit(1);
+    device_close_all(&boot);
+    boot_memory      = boot.memory;
+    boot_memory_size = boot.memory_size;
+
+    signal(SIGPIPE, SIG_IGN); // the console output of a hung up session
+    signal(SIGINT, &request_quit);
+    signal(SIGTERM, &request_quit);
+
+    listen_fd = listen_on(path);
+    epoll_fd  = epoll_create1(EPOLL_CLOEXEC);
+    if (listen_fd < 0 || epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        if (epoll_fd < 0)
+            perror("epoll");
+        exit(1);
+    }
+
+    while (!stop) {
+        struct epoll_event events[EPOLL_EVENTS];
+        struct session *session, *next;
+        int n, i;
+
+        // block only when all the sessions are parked
+        n = epoll_wait(epoll_fd, events, EPOLL_EVENTS, runnable ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            session = (struct session*)events[i].data.ptr;
+            if (!session)
+                accept_sessions(listen_fd);
+            else if (events[i].events & (EPOLLHUP | EPOLLERR))
+                session->over = 1;
+            else if (events[i].events & EPOLLIN)
+                session_wake(session);
+            if (session && (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+                session_flush(session);
+        }
+
+        // a slice for each runnable session, closed once its output is written
+        for (session = sessions; session; session = next) {
+            next = session->next;
+            if (!session->parked && !session->pending && !session->over) {
+                session_run(session);
+                session_flush(session);
+            }
+            if (session->over && !session->pending)
+                session_close(session);
+        }
+    }
+
+    while (sessions)
+        session_close(sessions);
+    close(listen_fd);
+    unlink_socket(path);
+
+    return 0;
+}
@@ -6,214 +6,365 @@
  * LICENSE file in the root directory of this source tree.
  */
 
-#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
 #include <poll.h>
-#include <stddef.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "coverage.h"
 #include "disasm.h"
+#include "event.h"
+#include "forksrv.h"
+#include "gdbstub.h"
+#include "heatmap.h"
+#include "hle.h"
+#include "image.h"
 #include "i8008.h"
+#include "platform.h"
+#include "profiler.h"
+#include "rec.h"
+#include "replay.h"
+#include "stats.h"
+#include "symmap.h"
+#include "undo.h"
 
-#define container_of(ptr, type, member) (type*)((char*)(ptr)-offsetof(type, member))
+// periods in T-states
+#define HOUSEKEEPING_PERIOD 32768
 
 static int trace = 0;
+static int fuse  = 1;
+
+static const char* rom_file      = NULL;
+static const char* rom_file_name = NULL; // basename, as reported by inotify
+static int watch_fd              = -1;
+static int reset_on_reload       = 0;
+
+static struct i8008_stats* stats;
+static volatile sig_atomic_t stats_dump_requested = 0;
+
+// why the execution loop ends, see the -b option for the exit statuses
+enum stop_reason {
+    STOP_NONE = 0,
+    STOP_SIGNAL, // SIGINT or SIGTERM
+    STOP_HALT, // the guest halted for good
+    STOP_STALL, // the guest waits for host input that cannot come
+    STOP_LIMIT, // instruction or T-state limit reached
+    STOP_EXIT_PORT, // the guest wrote its exit status
+};
+
+static volatile sig_atomic_t stop = STOP_NONE;
+
+// headless batch mode
+static int batch              = 0;
+static int stop_on_halt       = 0; // at the first HLT, not only when nothing can end it
+static int exit_port          = -1;
+static int exit_status        = 0; // written to exit_port
+static uint64_t instr_limit   = UINT64_MAX;
+static uint64_t t_state_limit = UINT64_MAX;
+
+static struct forksrv* forksrv = NULL;
+static struct gdb* gdb         = NULL;
+
+static const char* coverage_file = NULL;
+static struct i8008_coverage coverage;
 
-static uint8_t rom[2048];
-static uint8_t ram[2048];
+static const char* heatmap_file = NULL;
+static struct heatmap* heatmap  = NULL;
 
-static uint8_t* mem_location(uint16_t addr, int write)
+static struct undo* undo = NULL;
+
+static struct hle* hle = NULL;
+
+static int profile_hz = 0;
+static struct symmap symbols;
+
+static void reload_rom(struct platform* platform);
+
+// drain the inotify events, returns 1 if the rom file was rewritten
+static int rom_changed(void)
 {
-    static uint8_t dummy;
-    if ((addr & 2048) == 0) {
-        if (write)
-            return &dummy;
-        return rom + (addr & (2048 - 1));
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t len;
+
+    while ((len = read(watch_fd, buffer, sizeof(buffer))) > 0) {
+        char* ptr = buffer;
+        while (ptr < buffer + len) {
+            struct inotify_event* event = (struct inotify_event*)ptr;
+            if (event->len && 0 == strcmp(event->name, rom_file_name))
+                changed = 1;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
     }
-    return ram + (addr & (2048 - 1));
+    return changed;
 }
 
-static uint8_t mem_read(uint16_t addr) { return *mem_location(addr, 0); }
+static void stats_sync(struct platform* platform)
+{
+    stats->instructions = platform->cpu.instructions;
+    stats->t_states     = platform->cpu.t_states;
+    stats->stack_wraps  = platform->cpu.stack_wraps;
+    memcpy(stats->fusions, platform->cpu.fusions, sizeof(stats->fusions));
+
+    if (stats_dump_requested) {
+        stats_dump_requested = 0;
+        stats_dump(stats, stderr);
+    }
+}
 
-static void mem_write(uint16_t addr, uint8_t value) { *mem_location(addr, 1) = value; }
+// block until a device host file descriptor (or the debugger connection) is
+// readable, its event is then scheduled right away, the pending device
+// output being written before. Returns 1 when only devices woke up, the
+// debugger being served by the main loop.
+static int host_wait(struct platform* platform)
+{
+    struct pollfd fds[INP_PORTS + OUT_PORTS + 2];
+    struct event* fd_events[INP_PORTS + OUT_PORTS + 1];
+    struct device* device;
+    struct timespec start, end;
+    int nfds = 0, ready = 0, i;
+
+    // a replay ends with its log
+    if (platform->host_input_held)
+        return 0;
+
+    for (device = platform->devices; device; device = device->next) {
+        if (device->fd_event) {
+            fds[nfds].fd      = device->fd;
+            fds[nfds].events  = POLLIN;
+            fd_events[nfds++] = device->fd_event;
+        }
+    }
+    if (gdb && !gdb->detached) {
+        fds[nfds].fd      = gdb->fd;
+        fds[nfds].events  = POLLIN;
+        fd_events[nfds++] = &gdb->poll;
+    }
+    fds[nfds].fd     = watch_fd;
+    fds[nfds].events = POLLIN;
 
-struct platform {
-    struct i8008_cpu cpu;
-    uint8_t addr_low;
-    uint8_t addr_high;
-    uint8_t ctrl;
+    if (batch && !nfds && watch_fd < 0) {
+        // nothing can come from the host anymore
+        stop = platform->halted ? STOP_HALT : STOP_STALL;
+        return 0;
+    }
 
-    int kickstarted;
-    uint8_t stuffed_instructions[3];
-    int stuffed_instructions_number;
+    stats_sync(platform);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    uint8_t (*mem_read)(uint16_t addr);
-    void (*mem_write)(uint16_t addr, uint8_t value);
+    // the guest output first, it may be what the host waits for
+    device_drain_all(platform);
 
-    int io_in_char;
-    int int_enabled;
+    while (pic_next(platform) < 0 && !stop) {
+        if (poll(fds, watch_fd >= 0 ? nfds + 1 : nfds, -1) < 0) {
+            // interrupted by a signal
+            stats_sync(platform);
+            if (stop)
+                break;
+            continue;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].revents) {
+                event_schedule(&platform->events, fd_events[i], platform_now(platform));
+                ready = ready < 0 || (gdb && fd_events[i] == &gdb->poll) ? -1 : 1;
+            }
+        }
+        if (ready)
+            break;
+        if (rom_changed()) {
+            if (reset_on_reload) {
+                // the reset has to wait for the end of the current instruction
+                platform->reload_pending = 1;
+                event_schedule(&platform->events, &platform->housekeeping, 0);
+                break;
+            }
+            reload_rom(platform);
+        }
+    }
 
-    uint8_t external_stack[8];
-    int external_stack_ptr;
-};
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->halt_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    return ready > 0;
+}
 
-static void io_console_wait(struct platform* platform)
+// let the time run until an interrupt can be served: up to the next device
+// event, or until a host file descriptor is readable
+static void halt_wait(struct platform* platform)
 {
-    struct pollfd in_fd = { .fd = 0, .events = POLLIN };
+    if (stop_on_halt) {
+        stop = STOP_HALT;
+        return;
+    }
+
+    if (batch && platform_halt_over(platform)) {
+        stop = STOP_HALT;
+        return;
+    }
 
-    if (platform->io_in_char == -1)
-        poll(&in_fd, 1, -1);
+    // the host events run here: a wake-up serving nothing (the end of the
+    // input) would otherwise cost the guest an HLT that a replay cannot see
+    while (platform_halt(platform) && host_wait(platform))
+        event_run(&platform->events, platform_now(platform));
 }
 
-static void io_console_poll(struct platform* platform)
+// the loop statistics, counted from a status port read to the next one
+static void idle_check(struct platform* platform, int port, int loop)
 {
-    if (platform->io_in_char == -1) {
-        char c;
-        ssize_t rc = read(0, &c, 1);
-        if (rc == 1)
-            platform->io_in_char = c;
+    struct idle* idle = &platform->idle;
+
+    if (loop) {
+        idle->period.mem_fetches = stats->mem_fetches - idle->mem_fetches;
+        idle->period.mem_reads   = stats->mem_reads - idle->mem_reads;
+        idle->period.io          = stats->io[port] - idle->io;
     }
 
-    if (platform->io_in_char != -1 && platform->int_enabled)
-        i8008_int_req(&platform->cpu, 1);
+    idle->mem_fetches = stats->mem_fetches;
+    idle->mem_reads   = stats->mem_reads;
+    idle->io          = stats->io[port];
 }
 
-// INP: m=0   a0 <- int enabled   a1 <- console data available
-// INP: m=1   console data
-// OUT: m=0   a0 <- int enabled
-// OUT: m=1   console data
+// run the detected polling loop up to the next device event at once
+static void idle_fast_forward(struct event* event, uint64_t now)
+{
+    struct platform* platform  = container_of(event, struct platform, idle.event);
+    struct idle_period* period = &platform->idle.period;
+    uint64_t deadline          = event_active_deadline(&platform->events);
+    uint64_t iterations;
+
+    if (deadline == EVENT_NEVER) {
+        // only the host can wake the guest up
+        host_wait(platform);
+        deadline = platform->events.deadline;
+    }
 
-// m=7: push/pop on external stack
+    iterations = platform_idle_run(platform, deadline);
+    stats->mem_fetches += iterations * period->mem_fetches;
+    stats->mem_reads += iterations * period->mem_reads;
+    stats->io[platform->idle.last.port] += iterations * period->io;
+}
 
-static uint8_t io_inp(struct platform* platform, int m, uint8_t a)
+static void heatmap_access(struct platform* platform, uint16_t addr, enum heatmap_access access)
 {
-    uint8_t result = 0;
-
-    switch (m) {
-    case 0:
-        if (platform->int_enabled)
-            result |= 1 << 0;
-        if (platform->io_in_char != -1)
-            result |= 1 << 1;
+    size_t phys = platform_mem_phys(platform, addr);
+
+    switch (access) {
+    case HEATMAP_FETCH:
+        heatmap->pc = addr;
+        heatmap_count(heatmap, phys, HEATMAP_FETCH);
         break;
-    case 1:
-        result               = platform->io_in_char;
-        platform->io_in_char = -1;
+    case HEATMAP_READ:
+        // the operands are read at the PC
+        if (addr == (platform->cpu.stack[platform->cpu.stack_idx] & 0x3FFF))
+            access = HEATMAP_FETCH;
+        heatmap_count(heatmap, phys, access);
         break;
-    case 7:
-        result = platform->external_stack[--platform->external_stack_ptr];
+    case HEATMAP_WRITE:
+        // writes to the ROM are lost
+        if (platform->write_pages[(addr >> PAGE_SHIFT) & (PAGES - 1)] != platform->scratch_page)
+            heatmap_write(heatmap, phys, addr);
         break;
     }
-    return result;
 }
 
-static void io_out(struct platform* platform, int m, uint8_t a)
+// the DMA and disk writes, a load over fetched code is self-modifying code too
+static void device_write(struct platform* platform, uint16_t addr, int len)
 {
-    switch (m) {
-    case 0:
-        platform->int_enabled = a;
-        break;
-    case 1:
-        write(1, &a, 1);
-        break;
-    case 7:
-        platform->external_stack[platform->external_stack_ptr++] = a;
-        break;
-    }
+    for (; len > 0; len--, addr++)
+        heatmap_access(platform, addr, HEATMAP_WRITE);
 }
 
-static uint8_t io_func(struct i8008_cpu* cpu, enum i8008_state state, uint8_t bus_out)
+static void interrupt_check(struct platform* platform, uint8_t instr)
 {
-    struct platform* platform = container_of(cpu, struct platform, cpu);
-
-    io_console_poll(platform);
-
-    switch (state) {
-    case I8008_STATE_T1I:
-        i8008_int_req(cpu, 0); // acknowledge the interrupt
-        platform->int_enabled                 = 0; // avoid reentrance
-        platform->stuffed_instructions[0]     = 0x0D; // RST(1)
-        platform->stuffed_instructions_number = 1;
-    case I8008_STATE_T1:
-        platform->addr_low = bus_out;
-        break;
-    case I8008_STATE_T2:
-        platform->ctrl      = bus_out & I8008_T2_CTRL_MSK;
-        platform->addr_high = bus_out & ~I8008_T2_CTRL_MSK;
-        break;
-    case I8008_STATE_T3: {
-        uint16_t addr = platform->addr_high;
-        addr          = (addr << 8) | platform->addr_low;
-        switch (platform->ctrl) {
-        case I8008_T2_CTRL_PCI: {
-            uint8_t instr;
-            if (platform->stuffed_instructions_number)
-                return platform->stuffed_instructions[--platform->stuffed_instructions_number];
-
-            instr = platform->mem_read(addr);
-            if (instr == 0x1f) // RETI
-                platform->int_enabled = 1;
-
-            return instr;
-        }
-        case I8008_T2_CTRL_PCR:
-            return platform->mem_read(addr);
-        case I8008_T2_CTRL_PCC: {
-            int r = (platform->addr_high >> 4) & 3;
-            int m = (platform->addr_high >> 1) & 7;
-            if (r == 0) {
-                // INP
-                return io_inp(platform, m, platform->addr_low);
-            }
-            break;
-        }
-        case I8008_T2_CTRL_PCW:
-            platform->mem_write(addr, bus_out);
-            break;
-        }
-        break;
+    if (gdb)
+        gdb->budget = 0; // a basic block boundary
+    if ((instr & 0xC7) == 0x05) { // RST
+        stats->interrupts++;
+        if (platform->replay)
+            replay_interrupt(platform->replay, platform, (instr >> 3) & 7);
     }
-    case I8008_STATE_STOPPED:
-        // Only an interrupt can make us return
-        if (platform->kickstarted)
-            io_console_wait(platform);
-        else {
-            // the CPU starts in STOPPED state, wake it
-            platform->kickstarted = 1;
-        }
-        i8008_int_req(&platform->cpu, 1);
+}
+
+static void mem_check(struct platform* platform, uint16_t addr, uint8_t ctrl)
+{
+    switch (ctrl) {
+    case I8008_T2_CTRL_PCI:
+        stats->mem_fetches++;
+        if (heatmap)
+            heatmap_access(platform, addr, HEATMAP_FETCH);
         break;
-    case I8008_STATE_WAIT:
-        if (platform->ctrl == I8008_T2_CTRL_PCC) {
-            int r = (platform->addr_high >> 4) & 3;
-            int m = (platform->addr_high >> 1) & 7;
-            if (r != 0) {
-                // OUT
-                io_out(platform, m, platform->addr_low);
-                return bus_out;
-            }
-        }
+    case I8008_T2_CTRL_PCR:
+        stats->mem_reads++;
+        if (heatmap)
+            heatmap_access(platform, addr, HEATMAP_READ);
+        if (gdb && addr != (platform->cpu.stack[platform->cpu.stack_idx] & 0x3FFF)) // not an operand
+            gdb_access(gdb, addr, GDB_WATCH_READ);
         break;
-    default:
+    case I8008_T2_CTRL_PCW:
+        stats->mem_writes++;
+        if (heatmap)
+            heatmap_access(platform, addr, HEATMAP_WRITE);
+        if (gdb)
+            gdb_access(gdb, addr, GDB_WATCH_WRITE);
+        if (undo)
+            undo_write(undo, addr);
         break;
     }
-    return 0;
 }
 
+#define PLATFORM_HOOK_HALT(platform) halt_wait(platform)
+#define PLATFORM_HOOK_INTERRUPT(platform, instr) interrupt_check(platform, instr)
+#define PLATFORM_HOOK_MEM(platform, addr, ctrl) mem_check(platform, addr, ctrl)
+#define PLATFORM_HOOK_IO(platform, port) stats->io[port]++
+#define PLATFORM_HOOK_IDLE(platform, port, loop) idle_check(platform, port, loop)
+#define PLATFORM_HOOK_OUT(platform, port, value) \
+    do {                                         \
+        if (forksrv)                             \
+            forksrv_marker(forksrv, 1, port);    \
+        if (port == exit_port) {                 \
+            exit_status = value;                 \
+            stop        = STOP_EXIT_PORT;        \
+            return;                              \
+        }                                        \
+    } while (0)
+#include "platform_bus.h"
+
+// the I/O of the recompiled code, see rec.h
+uint8_t rec_inp(struct platform* platform, int port)
+{
+    stats->io[port]++;
+    return platform_inp(platform, port);
+}
+
+int rec_out(struct platform* platform, int port, uint8_t value)
+{
+    stats->io[port]++;
+    platform_out(platform, port, value);
+    return stop != STOP_NONE;
+}
+
+// the CPU core, calling platform_bus directly
+#define I8008_CORE_IO(cpu, state, bus_out) platform_bus(cpu, state, bus_out)
+#include "i8008_core.h"
+
 static void print_debug_info(struct platform* platform)
 {
     uint16_t pc = platform->cpu.stack[platform->cpu.stack_idx];
-    uint8_t op  = mem_read(pc);
+    uint8_t op  = platform_mem_read(platform, pc);
     char disasm[16];
 
     switch (i8008_opcodes[op].size) {
     case 2:
-        snprintf(disasm, sizeof(disasm), "%s 0x%02X", i8008_opcodes[op].mnemonic, (unsigned int)mem_read(pc + 1));
+        snprintf(disasm, sizeof(disasm), "%s 0x%02X", i8008_opcodes[op].mnemonic, (unsigned int)platform_mem_read(platform, pc + 1));
         break;
     case 3:
         snprintf(disasm, sizeof(disasm), "%s 0x%04X", i8008_opcodes[op].mnemonic,
-                 (((unsigned int)mem_read(pc + 2)) << 8) + mem_read(pc + 1));
+                 (((unsigned int)platform_mem_read(platform, pc + 2)) << 8) + platform_mem_read(platform, pc + 1));
         break;
     default:
         snprintf(disasm, sizeof(disasm), "%s", i8008_opcodes[op].mnemonic);
@@ -224,45 +375,269 @@ static void print_debug_info(struct platform* platform)
             platform->cpu.regs[REG_H], platform->cpu.regs[REG_L], disasm);
 }
 
+static void print_summary(struct platform* platform, FILE* out)
+{
+    static const char* reasons[] = {
+        [STOP_NONE]      = "running",
+        [STOP_SIGNAL]    = "signal",
+        [STOP_HALT]      = "halt",
+        [STOP_STALL]     = "stall",
+        [STOP_LIMIT]     = "limit",
+        [STOP_EXIT_PORT] = "exit port",
+    };
+    struct i8008_cpu* cpu = &platform->cpu;
+    uint8_t flags         = i8008_get_flags(cpu);
+
+    fprintf(out, "stop: %s", reasons[stop]);
+    if (stop == STOP_EXIT_PORT)
+        fprintf(out, " (%d)", exit_status);
+    fprintf(out, "\nPC=%04x A=%02x B=%02x C=%02x D=%02x E=%02x H=%02x L=%02x flags=%c%c%c%c\n",
+            cpu->stack[cpu->stack_idx], cpu->regs[REG_A], cpu->regs[REG_B], cpu->regs[REG_C], cpu->regs[REG_D],
+            cpu->regs[REG_E], cpu->regs[REG_H], cpu->regs[REG_L], flags & I8008_F_CARRY ? 'C' : '-',
+            flags & I8008_F_ZERO ? 'Z' : '-', flags & I8008_F_SIGN ? 'S' : '-', flags & I8008_F_PARITY ? 'P' : '-');
+    fprintf(out, "instructions=%" PRIu64 " T-states=%" PRIu64 "\n", cpu->instructions, cpu->t_states);
+}
+
+// exit status of the run
+static int stop_status(void)
+{
+    switch (stop) {
+    case STOP_EXIT_PORT:
+        return exit_status;
+    case STOP_LIMIT:
+        return 2;
+    case STOP_STALL:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
 static void usage(const char* prg_name)
 {
-    printf("%s [-t] [<rom>]\n"
-           "\t-t\ttrace instructions (stderr)\n"
-           "\t<rom>\tload file as rom content\n",
+    printf("%s [-t] [-I] [-f] [-w] [-r] [-s <name>] [-p <hz>] [-m <map>] [-R|-P <log>] [-b] [-H] [-n <count>] [-T <count>]\n"
+           "\t[-x <port>] [-F out:<port>|pc:<addr>] [-c <coverage>] [-M <heatmap>]\n"
+           "\t[-g <port>|<path>] [-u <MB>] [-e <routine>]... [-d <device>]... [<rom>]\n"
+           "\t-t\ttrace instructions (stderr), implies -I\n"
+           "\t-I\tdo not fast-forward the guest polling loops\n"
+           "\t-f\tinterpret each instruction: no superinstructions, nor recompiled code (see i8008rec)\n"
+           "\t-w\treload the rom when its file changes, keeping the machine state\n"
+           "\t-r\treload the rom when its file changes, resetting the machine\n"
+           "\t-s\tpublish the statistics counters in the shared memory object <name>\n"
+           "\t-p\tsample the PC <hz> times per second of CPU time, report on exit\n"
+           "\t-m\tload the symbol map (from i8008asm -m) used by the reports\n"
+           "\t-R\trecord the host input to <log>\n"
+           "\t-P\treplay the host input from <log>, stop at its end\n"
+           "\t-b\tbatch mode: stop when the guest halts for good or waits for input past its end,\n"
+           "\t\tprint a register and cycle summary (stderr)\n"
+           "\t-H\tstop at the first HLT, implies -b\n"
+           "\t-n\tstop after <count> instructions\n"
+           "\t-T\tstop after <count> T-states\n"
+           "\t-x\tstop when the guest writes OUT/<port>, the byte written being the exit status\n"
+           "\t\t(otherwise: 0, 2 past a limit, 3 waiting for input past its end, 1 on errors)\n"
+           "\t-F\tAFL fork server: boot up to the OUT port or PC, then run each test case from there in a\n"
+           "\t\tforked child (stdin as console input), implies -b\n"
+           "\t-c\tmerge the code coverage into the bitmap file <coverage> on exit (see i8008asm -c)\n"
+           "\t-M\tcount the memory accesses per address, write them to <heatmap> on exit, report the\n"
+           "\t\twrites to the addresses fetched before (self-modifying code)\n"
+           "\t-g\tserve the GDB remote protocol on the TCP <port> (loopback) or the Unix socket <path>,\n"
+           "\t\twait for the debugger before running\n"
+           "\t-u\tlog the last executed instructions in <MB> of memory for reverse execution (see -g)\n"
+           "\t-e\trun the routine <routine>[@<symbol>|<address>][:<T-states>] natively, the symbol (default: the\n"
+           "\t\troutine name) coming from -m or the .asm rom, \"-e list\" lists them\n"
+           "\t-d\tattach the device <name>[@<inp base>[,<out base>]][:<args>], \"-d list\" lists them\n"
+           "\t\t(default: -d console -d stack -d muldiv -d dma -d pic)\n"
+           "\t<rom>\tload file as rom content (.asm: assembly source, .hex: Intel HEX, .seg: segment list, otherwise "
+           "flat binary)\n"
+           "\t\t(default: the recompiled image, if any)\n",
            prg_name);
 }
 
-static int load_rom_content(const char* rom_file)
+static void reset_platform(struct platform* platform)
 {
-    int fd;
-    int copied = 0;
-    ssize_t rc;
+    struct i8008_cpu counters = platform->cpu;
 
-    fd = open(rom_file, O_RDONLY);
-    if (fd < 0) {
-        perror("open");
-        exit(1);
-    }
-    while ((rc = read(fd, rom + copied, sizeof(rom) - copied)) > 0) {
-        copied += rc;
-    }
-    if (rc < 0) {
-        perror("read");
+    memset(platform->memory + platform->rom_size, 0, platform->memory_size - platform->rom_size);
+    platform_map_reset(platform);
+
+    platform->kickstarted                 = 0;
+    platform->stuffed_instructions_number = 0;
+    platform->int_enabled                 = 0;
+    platform->halted                      = 0;
+    pic_reset(platform);
+
+    device_reset_all(platform);
+
+    i8008_init(&platform->cpu, &platform_bus);
+
+    // keep the statistics monotonic
+    platform->cpu.instructions  = counters.instructions;
+    platform->cpu.t_states      = counters.t_states;
+    platform->cpu.stack_wraps   = counters.stack_wraps;
+    platform->cpu.coverage      = counters.coverage;
+    platform->cpu.fuse_deadline = counters.fuse_deadline;
+    memcpy(platform->cpu.fusions, counters.fusions, sizeof(counters.fusions));
+
+    if (undo)
+        undo_clear(undo);
+}
+
+static void reload_rom(struct platform* platform)
+{
+    platform->reload_pending = 0;
+
+    // on failure, keep running the previous image
+    if (image_load(platform, rom_file, &symbols))
+        return;
+    if (hle)
+        hle_resolve(hle, &symbols); // the routines may have moved
+
+    if (reset_on_reload)
+        reset_platform(platform);
+
+    fprintf(stderr, "%s: reloaded\n", rom_file);
+}
+
+static int watch_rom(void)
+{
+    char* dir = strdup(rom_file);
+
+    rom_file_name = basename(strdup(rom_file));
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    // watch the directory, editors usually replace the file
+    if (watch_fd < 0 || inotify_add_watch(watch_fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("inotify");
         return 1;
     }
-    close(fd);
+    free(dir);
 
     return 0;
 }
 
-static void setup(int argc, char** argv)
+// run between instructions, periodically or when requested
+static void housekeeping(struct event* event, uint64_t now)
 {
-    int rc;
+    struct platform* platform = container_of(event, struct platform, housekeeping);
+
+    stats_sync(platform);
+
+    if (profile_hz)
+        profiler_drain(&symbols);
+
+    if (platform->reload_pending || (watch_fd >= 0 && rom_changed()))
+        reload_rom(platform);
+
+    event_schedule(&platform->events, event, now + HOUSEKEEPING_PERIOD);
+}
+
+static void request_stats_dump(int sig) { stats_dump_requested = 1; }
+
+static void limit_reached(struct event* event, uint64_t now) { stop = STOP_LIMIT; }
+
+static void request_quit(int sig) { stop = STOP_SIGNAL; }
 
-    while ((rc = getopt(argc, argv, "th")) != -1) {
+static void setup(struct platform* platform, int argc, char** argv)
+{
+    static const char* default_devices[] = { "console", "stack", "muldiv", "dma", "pic", NULL };
+    const char** devices  = (const char**)calloc(argc + 1, sizeof(const char*));
+    const char* stats_shm = NULL;
+    const char* record    = NULL;
+    const char* play      = NULL;
+    const char* marker    = NULL;
+    const char* gdb_where = NULL;
+    size_t undo_size      = 0;
+    int watch             = 0;
+    int devices_number    = 0;
+    int rc, i;
+
+    while ((rc = getopt(argc, argv, "tIfwrs:p:m:R:P:bHn:T:x:F:c:M:g:u:e:d:h")) != -1) {
         switch (rc) {
+        case 'd':
+            if (0 == strcmp(optarg, "list")) {
+                device_list(stdout);
+                exit(0);
+            }
+            devices[devices_number++] = optarg;
+            break;
+        case 'p':
+            profile_hz = strtoul(optarg, NULL, 0);
+            if (profile_hz <= 0 || profile_hz > 1000000) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'm':
+            if (symmap_load(&symbols, optarg))
+                exit(1);
+            break;
+        case 'R':
+            record = optarg;
+            break;
+        case 'P':
+            play = optarg;
+            break;
+        case 'H':
+            stop_on_halt = 1;
+        case 'b':
+            batch = 1;
+            break;
+        case 'n':
+            instr_limit = strtoull(optarg, NULL, 0);
+            break;
+        case 'T':
+            t_state_limit = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            coverage_file = optarg;
+            break;
+        case 'M':
+            heatmap_file = optarg;
+            break;
+        case 'g':
+            gdb_where = optarg;
+            break;
+        case 'u':
+            undo_size = strtoul(optarg, NULL, 0) << 20;
+            break;
+        case 'e':
+            if (0 == strcmp(optarg, "list")) {
+                hle_list(stdout);
+                exit(0);
+            }
+            if (!hle)
+                hle = hle_create(&platform_out);
+            if (hle_add(hle, optarg))
+                exit(1);
+            break;
+        case 'F':
+            marker = optarg;
+            batch  = 1;
+            break;
+        case 'x':
+            exit_port = strtoul(optarg, NULL, 0);
+            if (exit_port < OUT_PORT_BASE || exit_port >= OUT_PORT_BASE + OUT_PORTS) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 's':
+            stats_shm = optarg;
+            break;
         case 't':
-            trace = 1;
+            trace                   = 1;
+            platform->idle.disabled = 1;
+            break;
+        case 'I':
+            platform->idle.disabled = 1;
+            break;
+        case 'f':
+            fuse = 0;
+            break;
+        case 'r':
+            reset_on_reload = 1;
+        case 'w':
+            watch = 1;
             break;
         case 'h':
             usage(argv[0]);
@@ -272,31 +647,169 @@ static void setup(int argc, char** argv)
             exit(1);
         }
     }
+    stats = stats_open(stats_shm);
+    if (!stats)
+        exit(1);
+    signal(SIGUSR1, &request_stats_dump);
+    signal(SIGINT, &request_quit);
+    signal(SIGTERM, &request_quit);
+
+    // devices first, a memory controller sets the memory size
+    if (!devices_number)
+        devices = default_devices;
+    for (; *devices; devices++) {
+        if (device_attach(platform, *devices))
+            exit(1);
+    }
+
+    platform->memory = (uint8_t*)calloc(1, platform->memory_size);
+    if (heatmap_file) {
+        heatmap                = heatmap_create(platform->memory_size);
+        platform->device_write = &device_write;
+    }
+    if (undo_size)
+        undo = undo_create(platform, undo_size);
+    platform_map_reset(platform);
+    pic_reset(platform);
+
+    if (record && play) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (record && !(platform->replay = replay_record(record)))
+        exit(1);
+    if (play && !(platform->replay = replay_play(platform, play)))
+        exit(1);
+    platform->host_input_held = play != NULL;
+    if (marker && !(forksrv = forksrv_open(platform, marker)))
+        exit(1);
+
     if (optind < argc) {
-        if (load_rom_content(argv[optind]))
+        rom_file = argv[optind];
+        if (image_load(platform, rom_file, &symbols))
+            exit(1);
+        if (watch && watch_rom())
             exit(1);
+    } else if (rec_image) {
+        for (i = 0; i < rec_image->segments_number; i++) {
+            const struct rec_segment* seg = &rec_image->segments[i];
+            if (platform_mem_load(platform, seg->addr, seg->data, seg->len))
+                exit(1);
+        }
     }
+    if (hle && hle_resolve(hle, &symbols))
+        exit(1);
 
-    fcntl(0, F_SETFL, fcntl(0, F_GETFL, 0) | O_NONBLOCK);
+    if (gdb_where && !(gdb = gdb_open(platform, gdb_where)))
+        exit(1);
+    if (gdb)
+        gdb->undo = undo;
 }
 
 int main(int argc, char** argv)
 {
-    struct platform platform = { .io_in_char = -1, 0 };
+    struct platform platform = {
+        .events       = EVENT_QUEUE_INIT,
+        .housekeeping = EVENT_INIT_PASSIVE(&housekeeping),
+        .idle.event   = EVENT_INIT(&idle_fast_forward),
+        .rom_size     = ROM_SIZE,
+        .memory_size  = ROM_SIZE + RAM_SIZE,
+    };
+    struct event limit = EVENT_INIT(&limit_reached);
+    struct hle_trap* trap;
+    void (*rec_run)(struct platform* platform, const uint64_t* deadline) = NULL;
+    int rc;
+
+    setup(&platform, argc, argv);
+
+    i8008_init(&platform.cpu, &platform_bus);
+    if (coverage_file)
+        platform.cpu.coverage = &coverage;
+    // superinstructions and recompiled code, unless something looks at each instruction
+    if (fuse && !trace && !forksrv && !gdb && !undo && !hle && instr_limit == UINT64_MAX) {
+        platform.cpu.fuse_deadline = &platform.events.deadline;
+
+        // nor at each memory access, and for the image recompiled
+        if (rec_image && !coverage_file && !heatmap && !profile_hz && !platform.replay && watch_fd < 0) {
+            if (0 == memcmp(platform.memory, rec_image->rom, REC_ROM_SIZE))
+                rec_run = rec_image->run;
+            else
+                fprintf(stderr, "%s: not the recompiled image, interpreting\n", rom_file);
+        }
+    }
+
+    if (profile_hz && profiler_start(&platform.cpu, profile_hz))
+        exit(1);
 
-    setup(argc, argv);
+    event_schedule(&platform.events, &platform.housekeeping, HOUSEKEEPING_PERIOD);
+    if (t_state_limit != UINT64_MAX)
+        event_schedule(&platform.events, &limit, t_state_limit);
 
-    platform.mem_read  = &mem_read;
-    platform.mem_write = &mem_write;
+    while (!stop && !(platform.replay && replay_done(platform.replay))) {
+        while (!stop && platform.cpu.t_states < platform.events.deadline) {
+            if (platform.cpu.instructions >= instr_limit) {
+                stop = STOP_LIMIT;
+                break;
+            }
 
-    i8008_init(&platform.cpu, &io_func);
+            if (trace)
+                print_debug_info(&platform);
+            if (forksrv)
+                forksrv_step(forksrv);
+            if (gdb && --gdb->budget <= 0 && gdb_check(gdb)) {
+                stop = STOP_SIGNAL; // killed by the debugger
+                break;
+            }
 
-    while (1) {
-        if (trace)
-            print_debug_info(&platform);
+            trap = hle && !platform.cpu.int_req ? hle_trap_at(hle, platform.cpu.stack[platform.cpu.stack_idx]) : NULL;
+            if (trap) {
+                if (undo)
+                    undo_step_all(undo);
+                hle_call(hle, trap, &platform);
+                if (gdb)
+                    gdb->budget = 0; // returned: a basic block boundary
+                continue;
+            }
 
-        i8008_cycle(&platform.cpu);
+            if (rec_run) {
+                // up to what the interpreter has to run
+                rec_run(&platform, &platform.events.deadline);
+                if (stop || platform.cpu.t_states >= platform.events.deadline)
+                    continue;
+            }
+
+            if (undo)
+                undo_step(undo);
+
+            i8008_core_cycle(&platform.cpu);
+        }
+
+        event_run(&platform.events, platform.cpu.t_states);
     }
 
-    return 0;
+    if (profile_hz)
+        profiler_report(&symbols, stderr);
+
+    device_drain_all(&platform);
+    device_close_all(&platform);
+
+    if (batch) {
+        print_summary(&platform, stderr);
+        if (hle)
+            hle_report(hle, stderr);
+    }
+
+    rc = stop_status();
+    if (coverage_file && coverage_save(&coverage, coverage_file))
+        rc = 1;
+    if (heatmap_file && heatmap_save(heatmap, heatmap_file))
+        rc = 1;
+    if (gdb)
+        gdb_close(gdb, rc);
+    if (forksrv && stop == STOP_EXIT_PORT && exit_status)
+        abort(); // the fuzzer only reports signals as crashes
+    if (platform.replay && replay_close(platform.replay, &platform))
+        rc = 1;
+
+    return rc;
 }
@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Static recompiler: turns the ROM of an image into C, to be compiled and
+// linked with the i8008emu objects instead of rec_none.o (see rec.h and the
+// %.rec makefile rule). The code is found by following the control flow
+// from the reset and RST vectors, with the instruction sizes of disasm.h:
+// each basic block becomes a C label, the jumps and calls to known
+// addresses gotos, and the returns go through a switch on the PC. The ROM
+// must not be modified, which it cannot be at power-on mapping anyway.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asm_bler.h"
+#include "disasm.h"
+#include "rec.h"
+#include "symmap.h"
+
+struct image_segment {
+    uint32_t addr; // as in asm_ctx
+    int len;
+    uint8_t* data;
+};
+
+static struct image_segment* segments;
+static int segments_number;
+
+// the first 2 KB of ROM, shown by the ROM pages at power-on
+static uint8_t rom[REC_ROM_SIZE];
+static uint8_t rom_set[REC_ROM_SIZE]; // loaded by the image
+
+static uint8_t reached[I8008_ADDR_SPACE]; // instruction decoded there
+static uint8_t leader[I8008_ADDR_SPACE]; // starting a block
+static uint16_t work[I8008_ADDR_SPACE];
+static int work_number;
+static int uses_dispatch;
+
+static struct symmap symbols;
+
+static const char* reg_names[] = { "REG_A", "REG_B", "REG_C", "REG_D", "REG_E", "REG_H", "REG_L" };
+
+static void usage(const char* prg_name)
+{
+    printf("%s [-m <map>] <image> > rec.c\n"
+           "\t-m\tname the blocks after the symbols of <map> (default: those of the .asm image)\n"
+           "\t<image>\t.asm: assembly source, otherwise flat binary\n",
+           prg_name);
+}
+
+static void add_segment(uint32_t addr, const uint8_t* data, int len)
+{
+    struct image_segment* seg;
+    int i;
+
+    segments = (struct image_segment*)realloc(segments, (segments_number + 1) * sizeof(struct image_segment));
+    seg      = &segments[segments_number++];
+
+    seg->addr = addr;
+    seg->len  = len;
+    seg->data = (uint8_t*)malloc(len);
+    memcpy(seg->data, data, len);
+
+    for (i = 0; i < len; i++) {
+        uint32_t a = addr + i;
+        int page   = (a >> PAGE_SHIFT) & (PAGES - 1);
+        int offset;
+
+        // as loaded by i8008emu, see mem_load()
+        if (a >= ASM_BANK_BASE)
+            offset = a - ASM_BANK_BASE;
+        else if (page & 2)
+            continue; // RAM
+        else
+            offset = (page & 1) * PAGE_SIZE + (a & (PAGE_SIZE - 1));
+
+        if (offset < REC_ROM_SIZE) {
+            rom[offset]     = data[i];
+            rom_set[offset] = 1;
+        }
+    }
+}
+
+static int load_asm(FILE* f, const char* file)
+{
+    struct asm_ctx ctx = { 0 };
+    struct segment* seg;
+
+    asm_ble(&ctx, (int (*)(void*)) & getc, f);
+    if (ctx.current_file)
+        file = ctx.current_file;
+
+    switch (ctx.status) {
+    case ASM_ST_OK:
+        break;
+    case ASM_ST_ERR_INSTR:
+        fprintf(stderr, "%s:%d: invalid instruction '%s'\n", file, ctx.current_line_number,
+                ctx.status_detail.err_instr);
+        return 1;
+    case ASM_ST_ERR_SYM:
+        fprintf(stderr, "%s:%d: unknown symbol '%s'\n", file, ctx.status_detail.err_sym->line_number,
+                ctx.status_detail.err_sym->name);
+        return 1;
+    case ASM_ST_ERR_OVERLAP:
+        fprintf(stderr, "%s:%d: overlapping output at address 0x%04X\n", file, ctx.current_line_number,
+                ctx.status_detail.err_addr);
+        return 1;
+    case ASM_ST_ERR_INCLUDE:
+        fprintf(stderr, "%s:%d: cannot include '%s'\n", file, ctx.current_line_number, ctx.status_detail.err_file);
+        return 1;
+    case ASM_ST_ERR_OPERAND:
+        fprintf(stderr, "%s:%d: missing operand for '%s'\n", file, ctx.current_line_number,
+                ctx.status_detail.err_instr);
+        return 1;
+    case ASM_ST_ERR_BANK:
+        fprintf(stderr, "%s:%d: address 0x%04X past the window of the bank\n", file, ctx.current_line_number,
+                ctx.status_detail.err_addr);
+        return 1;
+    }
+
+    for (seg = ctx.segments; seg; seg = seg->next)
+        add_segment(seg->addr, seg->data, seg->len);
+    if (!symbols.count)
+        symmap_from_asm(&symbols, &ctx);
+
+    asm_free(&ctx);
+
+    return 0;
+}
+
+// flat ROM content, physical addresses
+static int load_bin(FILE* f)
+{
+    static uint8_t data[0x40000];
+    size_t len = fread(data, 1, sizeof(data), f);
+
+    if (ferror(f))
+        return 1;
+    add_segment(ASM_BANK_BASE, data, len);
+    return 0;
+}
+
+static int load_image(const char* file)
+{
+    const char* ext = strrchr(file, '.');
+    FILE* f;
+    int rc;
+
+    f = fopen(file, "r");
+    if (!f) {
+        perror(file);
+        return 1;
+    }
+
+    if (ext && 0 == strcmp(ext, ".asm"))
+        rc = load_asm(f, file);
+    else
+        rc = load_bin(f);
+
+    if (rc)
+        fprintf(stderr, "%s: invalid image\n", file);
+
+    fclose(f);
+
+    return rc;
+}
+
+static int rom_offset(uint16_t addr) { return ((addr >> PAGE_SHIFT) & 1) * PAGE_SIZE + (addr & (PAGE_SIZE - 1)); }
+
+static uint8_t rom_byte(uint16_t addr) { return rom[rom_offset(addr & (I8008_ADDR_SPACE - 1))]; }
+
+// an instruction of the ROM, loaded by the image
+static int decodable(uint16_t addr)
+{
+    int size, i;
+
+    if ((addr >> PAGE_SHIFT) & 2)
+        return 0;
+    if (!rom_set[rom_offset(addr)])
+        return 0;
+
+    size = i8008_opcodes[rom_byte(addr)].size;
+    for (i = 1; i < size; i++) {
+        uint16_t a = (addr + i) & (I8008_ADDR_SPACE - 1);
+        if (((a >> PAGE_SHIFT) & 2) || !rom_set[rom_offset(a)])
+            return 0;
+    }
+    return 1;
+}
+
+static int compiled(uint16_t addr) { return reached[addr] && decodable(addr); }
+
+static void reach(uint16_t addr, int is_leader)
+{
+    addr &= I8008_ADDR_SPACE - 1;
+    if (is_leader)
+        leader[addr] = 1;
+    if (!reached[addr]) {
+        reached[addr]       = 1;
+        work[work_number++] = addr;
+    }
+}
+
+enum kind {
+    K_PLAIN,
+    K_EXIT, // HLT, INM, DCM and RETI, left to the interpreter
+    K_JMP,
+    K_JCOND,
+    K_CALL,
+    K_CCOND,
+    K_RET,
+    K_RCOND,
+    K_RST,
+    K_INP,
+    K_OUT,
+};
+
+static enum kind classify(uint8_t op)
+{
+    // RETI may enable the interrupts, see pic.legacy
+    if (op == 0xFF || op == 0x1F)
+        return K_EXIT;
+
+    switch (op >> 6) {
+    case 0:
+        switch (op & 7) {
+        case 0:
+        case 1:
+            return (op >> 3) == 0 || (op >> 3) == 7 ? K_EXIT : K_PLAIN;
+        case 3:
+            return K_RCOND;
+        case 5:
+            return K_RST;
+        case 7:
+            return K_RET;
+        default:
+            return K_PLAIN;
+        }
+    case 1:
+        if (op & 1)
+            return (op >> 4) & 3 ? K_OUT : K_INP;
+        if (op & 4)
+            return op & 2 ? K_CALL : K_JMP;
+        return op & 2 ? K_CCOND : K_JCOND;
+    default:
+        return K_PLAIN;
+    }
+}
+
+static uint16_t target(uint16_t addr) { return (rom_byte(addr + 2) << 8 | rom_byte(addr + 1)) & 0x3FFF; }
+
+// control flow recovery from the reset and RST vectors
+static void explore(void)
+{
+    int v;
+
+    for (v = 0; v < 8; v++)
+        reach(v << 3, 1);
+
+    while (work_number) {
+        uint16_t addr = work[--work_number];
+        uint16_t next;
+        uint8_t op;
+
+        if (!decodable(addr))
+            continue;
+        op   = rom_byte(addr);
+        next = (addr + i8008_opcodes[op].size) & (I8008_ADDR_SPACE - 1);
+
+        switch (classify(op)) {
+        case K_PLAIN:
+        case K_INP:
+            reach(next, 0);
+            break;
+        case K_EXIT:
+            // resumed through the dispatch
+            reach(next, 1);
+            break;
+        case K_OUT:
+            reach(next, 1);
+            uses_dispatch = 1;
+            break;
+        case K_JMP:
+            reach(target(addr), 1);
+            break;
+        case K_JCOND:
+            reach(target(addr), 1);
+            reach(next, 0);
+            break;
+        case K_CALL:
+        case K_CCOND:
+            reach(target(addr), 1);
+            reach(next, 1);
+            break;
+        case K_RET:
+            uses_dispatch = 1;
+            break;
+        case K_RCOND:
+            uses_dispatch = 1;
+            reach(next, 0);
+            break;
+        case K_RST:
+            reach(op & 0x38, 1);
+            reach(next, 1);
+            break;
+        }
+    }
+}
+
+// falling through to an address emitted elsewhere takes a goto, to a label
+static void mark_fallthroughs(void)
+{
+    int fall = -1;
+    int addr;
+
+    for (addr = 0; addr < I8008_ADDR_SPACE; addr++) {
+        enum kind kind;
+        uint8_t op;
+
+        if (!compiled(addr))
+            continue;
+        if (fall >= 0 && fall != addr)
+            leader[fall] = 1;
+
+        op   = rom_byte(addr);
+        kind = classify(op);
+        fall = (addr + i8008_opcodes[op].size) & (I8008_ADDR_SPACE - 1);
+        if (kind == K_JMP || kind == K_RET || kind == K_EXIT || kind == K_OUT)
+            fall = -1;
+        else if (fall >> PAGE_SHIFT != addr >> PAGE_SHIFT)
+            leader[fall] = 1; // checks the mapping
+    }
+    if (fall >= 0)
+        leader[fall] = 1;
+}
+
+static void emit_goto(FILE* out, uint16_t from, uint16_t to)
+{
+    if (!compiled(to))
+        fprintf(out, "REC_EXIT(0x%04X);", to);
+    else if (from >> PAGE_SHIFT == to >> PAGE_SHIFT)
+        fprintf(out, "goto L_%04X;", to);
+    else
+        fprintf(out, "REC_JUMP(0x%04X, L_%04X);", to, to);
+}
+
+// the M source or destination
+static void emit_operand(FILE* out, int reg)
+{
+    if (reg == REG_MEM)
+        fprintf(out, "platform_mem_read(platform, REC_HL)");
+    else
+        fprintf(out, "cpu->regs[%s]", reg_names[reg]);
+}
+
+static void emit_instruction(FILE* out, uint16_t addr)
+{
+    uint8_t op    = rom_byte(addr);
+    uint8_t imm   = rom_byte(addr + 1);
+    uint16_t next = (addr + i8008_opcodes[op].size) & (I8008_ADDR_SPACE - 1);
+    int dst       = (op >> 3) & 7;
+    int src       = op & 7;
+
+    fprintf(out, "    // 0x%04X %s", addr, i8008_opcodes[op].mnemonic);
+    if (i8008_opcodes[op].size == 2)
+        fprintf(out, " 0x%02X", imm);
+    else if (i8008_opcodes[op].size == 3)
+        fprintf(out, " 0x%04X", target(addr));
+    fprintf(out, "\n    ");
+
+    switch (classify(op)) {
+    case K_PLAIN:
+        if ((op & 0xC0) == 0xC0) { // Lrr, LrM, LMr
+            if (dst == REG_MEM)
+                fprintf(out, "REC_STEP(7); platform_mem_write(platform, REC_HL, cpu->regs[%s]);", reg_names[src]);
+            else {
+                fprintf(out, "REC_STEP(%d); cpu->regs[%s] = ", src == REG_MEM ? 8 : 5, reg_names[dst]);
+                emit_operand(out, src);
+                fprintf(out, ";");
+            }
+        } else if ((op & 0xC0) == 0x80) { // ALU with a register or M
+            fprintf(out, "REC_STEP(%d); rec_alu(cpu, %d, ", src == REG_MEM ? 8 : 5, dst);
+            emit_operand(out, src);
+            fprintf(out, ");");
+        } else if ((op & 7) == 6) { // LrI, LMI
+            if (dst == REG_MEM)
+                fprintf(out, "REC_STEP(9); platform_mem_write(platform, REC_HL, 0x%02X);", imm);
+            else
+                fprintf(out, "REC_STEP(8); cpu->regs[%s] = 0x%02X;", reg_names[dst], imm);
+        } else if ((op & 7) == 4) // ALU immediate
+            fprintf(out, "REC_STEP(8); rec_alu(cpu, %d, 0x%02X);", dst, imm);
+        else if ((op & 7) == 2)
+            fprintf(out, "REC_STEP(5); rec_rot(cpu, %d);", dst);
+        else // INr, DCr
+            fprintf(out, "REC_STEP(5); rec_incdec(cpu, %s, %d);", reg_names[dst], op & 1 ? -1 : 1);
+        break;
+    case K_EXIT:
+        fprintf(out, "REC_EXIT(0x%04X);", addr);
+        break;
+    case K_JMP:
+        fprintf(out, "REC_STEP(11); ");
+        emit_goto(out, addr, target(addr));
+        break;
+    case K_JCOND:
+        fprintf(out, "if (rec_cond(cpu, 0x%02X)) {\n        REC_STEP(11);\n        ", op);
+        emit_goto(out, addr, target(addr));
+        fprintf(out, "\n    }\n    REC_STEP(9);");
+        break;
+    case K_CALL:
+        fprintf(out, "REC_STEP(11); rec_call(cpu, 0x%04X, 0x%04X); ", next, target(addr));
+        emit_goto(out, addr, target(addr));
+        break;
+    case K_CCOND:
+        fprintf(out, "if (rec_cond(cpu, 0x%02X)) {\n        REC_STEP(11);\n        ", op);
+        fprintf(out, "rec_call(cpu, 0x%04X, 0x%04X);\n        ", next, target(addr));
+        emit_goto(out, addr, target(addr));
+        fprintf(out, "\n    }\n    REC_STEP(9);");
+        break;
+    case K_RET:
+        fprintf(out, "REC_STEP(5); rec_ret(cpu); goto dispatch;");
+        break;
+    case K_RCOND:
+        fprintf(out, "if (rec_cond(cpu, 0x%02X)) {\n        REC_STEP(5);\n        rec_ret(cpu);\n", op);
+        fprintf(out, "        goto dispatch;\n    }\n    REC_STEP(3);");
+        break;
+    case K_RST:
+        fprintf(out, "REC_STEP(5); rec_call(cpu, 0x%04X, 0x%04X); ", next, op & 0x38);
+        emit_goto(out, addr, op & 0x38);
+        break;
+    case K_INP:
+        fprintf(out, "REC_STEP(3); REC_PC = 0x%04X; ", next);
+        fprintf(out, "cpu->regs[REG_A] = rec_inp(platform, %d); cpu->t_states += 5;", (op >> 1) & 0x1F);
+        break;
+    case K_OUT:
+        fprintf(out, "REC_STEP(3); REC_PC = 0x%04X; REC_OUT(%d);", next, (op >> 1) & 0x1F);
+        break;
+    }
+    fprintf(out, "\n");
+}
+
+static void emit_bytes(FILE* out, const uint8_t* data, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        fprintf(out, "%s0x%02X,", i % 16 ? " " : "\n    ", data[i]);
+    fprintf(out, "\n");
+}
+
+static void emit(FILE* out, const char* image)
+{
+    int fall = -1;
+    int addr, i;
+
+    fprintf(out, "// Recompiled from %s by i8008rec, see rec.h.\n\n#include \"rec.h\"\n\n", image);
+
+    for (i = 0; i < segments_number; i++) {
+        fprintf(out, "static const uint8_t segment_%d[] = {", i);
+        emit_bytes(out, segments[i].data, segments[i].len);
+        fprintf(out, "};\n\n");
+    }
+    fprintf(out, "static const struct rec_segment segments[] = {\n");
+    for (i = 0; i < segments_number; i++)
+        fprintf(out, "    { 0x%05X, %d, segment_%d },\n", segments[i].addr, segments[i].len, i);
+    fprintf(out, "};\n\nstatic const uint8_t rom[REC_ROM_SIZE] = {");
+    emit_bytes(out, rom, REC_ROM_SIZE);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static void run(struct platform* platform, const uint64_t* deadline)\n{\n"
+                 "    struct i8008_cpu* cpu = &platform->cpu;\n\n");
+    if (uses_dispatch)
+        fprintf(out, "dispatch:\n");
+    fprintf(out, "    switch (REC_PC) {\n");
+    for (addr = 0; addr < I8008_ADDR_SPACE; addr++) {
+        if (leader[addr] && compiled(addr))
+            fprintf(out, "    case 0x%04X:\n        REC_JUMP(0x%04X, L_%04X);\n", addr, addr, addr);
+    }
+    fprintf(out, "    default:\n        return;\n    }\n");
+
+    for (addr = 0; addr < I8008_ADDR_SPACE; addr++) {
+        enum kind kind;
+        uint8_t op;
+
+        if (!compiled(addr))
+            continue;
+
+        if (fall >= 0 && fall != addr) {
+            fprintf(out, "    ");
+            emit_goto(out, fall, fall);
+            fprintf(out, "\n");
+        }
+        if (leader[addr]) {
+            i = symmap_find(&symbols, addr);
+            if (i >= 0 && symbols.entries[i].addr == addr)
+                fprintf(out, "\nL_%04X: // %s\n", addr, symbols.entries[i].name);
+            else
+                fprintf(out, "\nL_%04X:\n", addr);
+            fprintf(out, "    REC_BLOCK(0x%04X)\n", addr);
+        }
+
+        emit_instruction(out, addr);
+
+        op   = rom_byte(addr);
+        kind = classify(op);
+        fall = (addr + i8008_opcodes[op].size) & (I8008_ADDR_SPACE - 1);
+        if (kind == K_JMP || kind == K_RET || kind == K_EXIT || kind == K_OUT)
+            fall = -1;
+        else if (fall >> PAGE_SHIFT != addr >> PAGE_SHIFT) {
+            fprintf(out, "    ");
+            emit_goto(out, addr, fall);
+            fprintf(out, "\n");
+            fall = -1;
+        }
+    }
+    if (fall >= 0) {
+        fprintf(out, "    ");
+        emit_goto(out, fall, fall);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "static const struct rec_image image = {\n"
+                 "    \"%s\",\n"
+                 "    segments,\n"
+                 "    %d,\n"
+                 "    rom,\n"
+                 "    &run,\n"
+                 "};\n\n"
+                 "const struct rec_image* const rec_image = &image;\n",
+            image, segments_number);
+}
+
+int main(int argc, char** argv)
+{
+    const char* map_file = NULL;
+    int rc;
+
+    while ((rc = getopt(argc, argv, "m:h")) != -1) {
+        switch (rc) {
+        case 'm':
+            map_file = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (map_file && symmap_load(&symbols, map_file))
+        return 1;
+    if (load_image(argv[optind]))
+        return 1;
+
+    explore();
+    mark_fallthroughs();
+    emit(stdout, argv[optind]);
+
+    return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asm_bler.h"
+#include "image.h"
+
+// the image being loaded, written to the memory once it is valid as a whole:
+// a failed reload leaves the running image intact
+struct staging {
+    struct platform* platform;
+    struct chunk {
+        uint32_t addr;
+        int len;
+        struct chunk* next;
+        uint8_t data[];
+    } * chunks;
+    struct chunk** tail;
+};
+
+// keep a copy of data for platform_mem_load(), checked against the memory
+static int stage(struct staging* staging, uint32_t addr, const uint8_t* data, int len)
+{
+    struct chunk* chunk;
+
+    if (platform_mem_check(staging->platform, addr, len))
+        return 1;
+
+    chunk = (struct chunk*)malloc(sizeof(struct chunk) + len);
+    if (!chunk)
+        return 1;
+    chunk->addr = addr;
+    chunk->len  = len;
+    chunk->next = NULL;
+    memcpy(chunk->data, data, len);
+
+    *staging->tail = chunk;
+    staging->tail  = &chunk->next;
+    return 0;
+}
+
+static int load_asm(struct staging* staging, FILE* f, const char* file, struct symmap* symbols)
+{
+    struct asm_ctx ctx = { 0 };
+    struct segment* seg;
+    int rc = 0;
+
+    asm_ble(&ctx, (int (*)(void*)) & getc, f);
+    if (ctx.current_file)
+        file = ctx.current_file;
+
+    switch (ctx.status) {
+    case ASM_ST_OK:
+        break;
+    case ASM_ST_ERR_INSTR:
+        fprintf(stderr, "%s:%d: invalid instruction '%s'\n", file, ctx.current_line_number,
+                ctx.status_detail.err_instr);
+        break;
+    case ASM_ST_ERR_SYM:
+        fprintf(stderr, "%s:%d: unknown symbol '%s'\n", file, ctx.status_detail.err_sym->line_number,
+                ctx.status_detail.err_sym->name);
+        break;
+    case ASM_ST_ERR_OVERLAP:
+        fprintf(stderr, "%s:%d: overlapping output at address 0x%04X\n", file, ctx.current_line_number,
+                ctx.status_detail.err_addr);
+        break;
+    case ASM_ST_ERR_INCLUDE:
+        fprintf(stderr, "%s:%d: cannot include '%s'\n", file, ctx.current_line_number, ctx.status_detail.err_file);
+        break;
+    case ASM_ST_ERR_OPERAND:
+        fprintf(stderr, "%s:%d: missing operand for '%s'\n", file, ctx.current_line_number,
+                ctx.status_detail.err_instr);
+        break;
+    case ASM_ST_ERR_BANK:
+        fprintf(stderr, "%s:%d: address 0x%04X past the window of the bank\n", file, ctx.current_line_number,
+                ctx.status_detail.err_addr);
+        break;
+    }
+
+    if (ctx.status == ASM_ST_OK) {
+        for (seg = ctx.segments; seg; seg = seg->next) {
+            if (stage(staging, seg->addr, seg->data, seg->len))
+                rc = 1;
+        }
+        if (!rc && symbols)
+            symmap_from_asm(symbols, &ctx);
+    } else
+        rc = 1;
+
+    asm_free(&ctx);
+
+    return rc;
+}
+
+// flat ROM content
+static int load_bin(struct staging* staging, FILE* f)
+{
+    size_t rom_size = staging->platform->rom_size;
+    uint8_t* data   = (uint8_t*)malloc(rom_size);
+    size_t copied;
+    int rc;
+
+    if (!data)
+        return 1;
+
+    copied = fread(data, 1, rom_size, f);
+    rc     = (copied == 0 && ferror(f)) || stage(staging, 0, data, copied);
+
+    free(data);
+    return rc;
+}
+
+static int load_seg(struct staging* staging, FILE* f)
+{
+    uint8_t header[4];
+    uint8_t data[0x8000];
+    uint32_t high = 0;
+
+    while (fread(header, sizeof(header), 1, f) == 1) {
+        uint16_t addr = header[0] | header[1] << 8;
+        uint16_t len  = header[2] | header[3] << 8;
+
+        if (!len) {
+            // upper 16 bits of the following addresses
+            high = (uint32_t)addr << 16;
+            continue;
+        }
+        if (len > sizeof(data) || fread(data, len, 1, f) != 1)
+            return 1;
+        if (stage(staging, high | addr, data, len))
+            return 1;
+    }
+    return ferror(f);
+}
+
+static int hex_byte(const char* str, uint8_t* v)
+{
+    unsigned int byte;
+
+    if (sscanf(str, "%2x", &byte) != 1)
+        return 1;
+    *v = byte;
+    return 0;
+}
+
+static int load_ihex(struct staging* staging, FILE* f)
+{
+    char line[600];
+    uint32_t high = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        uint8_t record[256 + 5];
+        uint8_t sum = 0;
+        int i, len;
+
+        if (line[0] != ':')
+            continue;
+        if (hex_byte(line + 1, &record[0]))
+            return 1;
+        len = record[0] + 5;
+        for (i = 0; i < len; i++) {
+            if (hex_byte(line + 1 + 2 * i, &record[i]))
+                return 1;
+            sum += record[i];
+        }
+        if (sum)
+            return 1; // bad checksum
+
+        switch (record[3]) {
+        case 0x00:
+            if (stage(staging, high | record[1] << 8 | record[2], record + 4, record[0]))
+                return 1;
+            break;
+        case 0x01:
+            return 0;
+        case 0x04: // extended linear address
+            high = (uint32_t)(record[4] << 8 | record[5]) << 16;
+            break;
+        }
+    }
+    return ferror(f);
+}
+
+int image_load(struct platform* platform, const char* file, struct symmap* symbols)
+{
+    const char* ext        = strrchr(file, '.');
+    struct staging staging = { .platform = platform };
+    struct chunk* chunk;
+    FILE* f;
+    int rc;
+
+    f = fopen(file, "r");
+    if (!f) {
+        perror(file);
+        return 1;
+    }
+
+    staging.tail = &staging.chunks;
+    if (ext && 0 == strcmp(ext, ".asm"))
+        rc = load_asm(&staging, f, file, symbols);
+    else if (ext && 0 == strcmp(ext, ".hex"))
+        rc = load_ihex(&staging, f);
+    else if (ext && 0 == strcmp(ext, ".seg"))
+        rc = load_seg(&staging, f);
+    else
+        rc = load_bin(&staging, f);
+
+    if (rc) {
+        fprintf(stderr, "%s: invalid image\n", file);
+    } else {
+        memset(platform->memory, 0, platform->rom_size);
+        for (chunk = staging.chunks; chunk; chunk = chunk->next)
+            platform_mem_load(platform, chunk->addr, chunk->data, chunk->len);
+    }
+
+    while (staging.chunks) {
+        chunk          = staging.chunks;
+        staging.chunks = chunk->next;
+        free(chunk);
+    }
+
+    fclose(f);
+
+    return rc;
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include "platform.h"
+#include "symmap.h"
+
+// ROM images: .asm sources (assembled in-process), .hex Intel HEX, .seg
+// segment lists, otherwise flat binaries. The image is parsed and checked
+// as a whole first: when it is valid, the ROM is cleared and the image
+// written through platform_mem_load(), otherwise the memory is left
+// unchanged.
+
+// symbols (optional) receives the labels of an .asm image; errors are
+// reported on stderr
+int image_load(struct platform* platform, const char* file, struct symmap* symbols);
+
+#endif /* IMAGE_H_ */
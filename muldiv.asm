@@ -0,0 +1,106 @@
+; Wrapper routines for the muldiv coprocessor device, at its default
+; ports (INP/2, OUT/8 to OUT/12). Pull them in with:
+;   .include 'muldiv.asm'
+; Register pairs are written high:low. All routines clobber A.
+
+; H:L = B * C
+mul8:
+	LAB
+	OUT/8
+	LAC
+	OUT/10
+	LAI 0
+	OUT/12
+	INP/2
+	LLA
+	INP/2
+	LHA
+	RET
+
+; D:E:H:L = B:C * D:E
+mul16:
+	CALL muldiv_bc_de
+	LAI 1
+	OUT/12
+	INP/2
+	LLA
+	INP/2
+	LHA
+	INP/2
+	LEA
+	INP/2
+	LDA
+	RET
+
+; B = B / C, C = B % C
+; a zero divisor yields B = 0xFF, C = the dividend
+div8:
+	LAB
+	OUT/8
+	LAC
+	OUT/10
+	LAI 2
+	OUT/12
+	INP/2
+	LBA
+	INP/2
+	LCA
+	RET
+
+; B:C = B:C / D:E, D:E = B:C % D:E
+; a zero divisor yields B:C = 0xFFFF, D:E = the dividend
+div16:
+	CALL muldiv_bc_de
+	LAI 3
+	OUT/12
+	INP/2
+	LCA
+	INP/2
+	LBA
+	INP/2
+	LEA
+	INP/2
+	LDA
+	RET
+
+; D:H:L = H:L as 5 packed BCD digits
+bin2bcd:
+	LAL
+	OUT/8
+	LAH
+	OUT/9
+	LAI 4
+	OUT/12
+	INP/2
+	LLA
+	INP/2
+	LHA
+	INP/2
+	LDA
+	RET
+
+; H:L = H:L as 4 packed BCD digits
+bcd2bin:
+	LAL
+	OUT/8
+	LAH
+	OUT/9
+	LAI 5
+	OUT/12
+	INP/2
+	LLA
+	INP/2
+	LHA
+	RET
+
+; operand A = B:C, operand B = D:E
+muldiv_bc_de:
+	LAC
+	OUT/8
+	LAB
+	OUT/9
+	LAE
+	OUT/10
+	LAD
+	OUT/11
+	RET
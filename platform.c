@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <string.h>
+
+#include "asm_bler.h"
+#include "platform.h"
+
+void platform_map(struct platform* platform, int page, size_t phys)
+{
+    platform->read_pages[page] = platform->memory + phys;
+    if (phys < platform->rom_size)
+        platform->write_pages[page] = platform->scratch_page;
+    else
+        platform->write_pages[page] = platform->memory + phys;
+}
+
+// physical address behind addr in the power-on mapping
+static size_t reset_phys(struct platform* platform, uint16_t addr)
+{
+    int page = (addr >> PAGE_SHIFT) & (PAGES - 1);
+    size_t phys;
+
+    if (page & 2) // RAM
+        phys = platform->rom_size + (page & 1) * PAGE_SIZE;
+    else
+        phys = (page & 1) * PAGE_SIZE;
+    return phys + (addr & (PAGE_SIZE - 1));
+}
+
+void platform_map_reset(struct platform* platform)
+{
+    int page;
+
+    for (page = 0; page < PAGES; page++)
+        platform_map(platform, page, reset_phys(platform, page << PAGE_SHIFT));
+}
+
+static size_t load_phys(struct platform* platform, uint32_t addr)
+{
+    return addr < ASM_BANK_BASE ? reset_phys(platform, addr) : addr - ASM_BANK_BASE;
+}
+
+int platform_mem_check(struct platform* platform, uint32_t addr, int len)
+{
+    for (; len--; addr++) {
+        if (load_phys(platform, addr) >= platform->memory_size)
+            return 1;
+    }
+    return 0;
+}
+
+int platform_mem_load(struct platform* platform, uint32_t addr, const uint8_t* data, int len)
+{
+    for (; len--; addr++) {
+        size_t phys = load_phys(platform, addr);
+        if (phys >= platform->memory_size)
+            return 1;
+        platform->memory[phys] = *(data++);
+    }
+    return 0;
+}
+
+void platform_irq_update(struct platform* platform)
+{
+    if (pic_next(platform) >= 0)
+        i8008_int_req(&platform->cpu, 1);
+}
+
+int platform_idle_poll(struct platform* platform, int port, uint8_t value)
+{
+    struct i8008_cpu* cpu = &platform->cpu;
+    struct idle* idle     = &platform->idle;
+    struct idle_state state;
+    int detected = 0;
+
+    memset(&state, 0, sizeof(state));
+    memcpy(state.regs, cpu->regs, sizeof(state.regs));
+    memcpy(state.stack, cpu->stack, sizeof(state.stack));
+    state.flags     = i8008_get_flags(cpu);
+    state.stack_idx = cpu->stack_idx;
+    state.port      = port;
+    state.value     = value;
+
+    if (idle->valid && !idle->dirty && cpu->t_states - idle->t_states <= IDLE_MAX_PERIOD
+        && 0 == memcmp(&state, &idle->last, sizeof(state))) {
+        // the guest will loop identically until a device event
+        idle->period.t_states     = cpu->t_states - idle->t_states;
+        idle->period.instructions = cpu->instructions - idle->instructions;
+        detected                  = 1;
+    }
+
+    idle->last         = state;
+    idle->valid        = 1;
+    idle->dirty        = 0;
+    idle->t_states     = cpu->t_states;
+    idle->instructions = cpu->instructions;
+
+    return detected;
+}
+
+uint64_t platform_idle_run(struct platform* platform, uint64_t deadline)
+{
+    struct idle_period* period = &platform->idle.period;
+    uint64_t now               = platform_now(platform);
+    uint64_t iterations        = 0;
+
+    if (deadline != EVENT_NEVER && deadline > now) {
+        iterations = (deadline - now) / period->t_states;
+
+        platform->cpu.t_states += iterations * period->t_states;
+        platform->cpu.instructions += iterations * period->instructions;
+    }
+
+    platform->idle.valid = 0;
+    return iterations;
+}
+
+int platform_halt(struct platform* platform)
+{
+    uint64_t deadline;
+
+    if (pic_next(platform) >= 0)
+        return 0;
+
+    deadline = event_active_deadline(&platform->events);
+    if (deadline == EVENT_NEVER)
+        return 1;
+    if (deadline > platform->cpu.t_states)
+        platform->cpu.t_states = deadline;
+    return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef PLATFORM_H_
+#define PLATFORM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "event.h"
+#include "i8008.h"
+
+#define container_of(ptr, type, member) (type*)((char*)(ptr)-offsetof(type, member))
+
+#define INP_PORTS 8 // INP/0 to INP/7
+#define OUT_PORTS 24 // OUT/8 to OUT/31
+#define OUT_PORT_BASE 8
+
+#define IRQ_LINES 8
+
+#define PAGE_SHIFT 10
+#define PAGE_SIZE (1 << PAGE_SHIFT) // address space mapping granularity
+#define PAGES 16 // 16 KB address space
+
+#define ROM_SIZE 2048 // defaults, without memory controller
+#define RAM_SIZE 2048
+
+#define IDLE_MAX_PERIOD 256 // longest polling loop considered, in T-states
+
+struct platform;
+struct replay;
+
+// Port-mapped device. Implementations embed it in their own state and use
+// container_of() from the callbacks.
+struct device {
+    const struct device_type* type;
+    struct platform* platform;
+
+    int inp_base; // first INP port, -1 if none
+    int out_base; // first OUT port (8 to 31), -1 if none
+
+    // port is relative to the base
+    uint8_t (*inp)(struct device* device, int port);
+    void (*out)(struct device* device, int port, uint8_t value);
+
+    // input ports whose value only changes on the device events (bitmask,
+    // relative to inp_base), see the polling loop detection
+    unsigned int status_ports;
+
+    // host file descriptor the platform waits for while the guest is idle,
+    // fd_event (when set) is scheduled as soon as it is readable
+    int fd;
+    struct event* fd_event;
+
+    // host output not written yet (optional): writes what it can to out_fd
+    // without blocking, returns the number of bytes still pending
+    size_t (*flush)(struct device* device);
+    int out_fd;
+
+    // interrupt request on the irq_line of the controller (-1 if none, see
+    // device_type.irq), see platform_irq_update()
+    int irq;
+    int irq_line;
+
+    // host input, fed back by a replay (optional)
+    void (*input)(struct device* device, uint8_t value);
+
+    void (*reset)(struct device* device); // optional
+    void (*close)(struct device* device); // optional
+
+    struct device* next;
+};
+
+struct device_type {
+    const char* name;
+    const char* help;
+    int inp_ports; // number of ports used
+    int out_ports;
+    int default_inp_base;
+    int default_out_base;
+    int irq; // raises interrupts, an interrupt controller line is assigned
+    // args: text following the ':' of the command line option, or NULL
+    struct device* (*create)(struct platform* platform, const char* args);
+};
+
+struct platform {
+    struct i8008_cpu cpu;
+    uint8_t addr_low;
+    uint8_t addr_high;
+    uint8_t ctrl;
+
+    int kickstarted;
+    uint8_t stuffed_instructions[3];
+    int stuffed_instructions_number;
+
+    // physical memory: ROM, then RAM
+    uint8_t* memory;
+    size_t rom_size;
+    size_t memory_size;
+
+    // address space, by pages, see platform_map(); writes to a ROM page
+    // land in the scratch page
+    uint8_t* read_pages[PAGES];
+    uint8_t* write_pages[PAGES];
+    uint8_t scratch_page[PAGE_SIZE];
+
+    int int_enabled; // master interrupt enable
+    int halted; // the CPU waits for an interrupt
+
+    // vectored interrupt controller, see dev_pic.c
+    struct pic {
+        uint8_t mask;
+        uint8_t in_service;
+        uint8_t vectors[IRQ_LINES]; // RST number per line
+        int lines; // assigned so far
+        int mask_next; // the next command byte is the mask
+        int read_select; // register read by the port
+
+        // until the guest writes to the controller, interrupts work as they
+        // did without it: any request wakes HLT up, an interrupt is RST 1
+        // and disables the interrupts, RETI (0x1F) enables them again
+        int legacy;
+        int legacy_line; // served with the interrupts enabled, -1 if none
+    } pic;
+
+    struct device* devices;
+    struct device* inp_devices[INP_PORTS];
+    struct device* out_devices[OUT_PORTS];
+
+    int reload_pending;
+
+    struct replay* replay; // record or replay, NULL if none
+    int host_input_held; // the devices do not read host input (replay, fork server boot)
+
+    // a device (DMA, disk) is about to write len bytes of guest memory from
+    // addr (optional), the CPU writes going through the bus instead
+    void (*device_write)(struct platform* platform, uint16_t addr, int len);
+
+    struct event_queue events;
+    struct event housekeeping;
+
+    // polling loop detection: two successive reads of a status port from
+    // the same CPU state, with no side effect in between
+    struct idle {
+        struct idle_state {
+            uint8_t regs[7];
+            uint8_t flags;
+            int stack_idx;
+            uint16_t stack[8];
+            int port;
+            uint8_t value;
+        } last;
+        int valid;
+        int dirty;
+        int disabled; // the polling loops run (i8008emu -I)
+
+        // counters at the last read
+        uint64_t t_states;
+        uint64_t instructions;
+        uint64_t mem_fetches;
+        uint64_t mem_reads;
+        uint64_t io;
+
+        // counters increments per loop iteration
+        struct idle_period {
+            uint64_t t_states;
+            uint64_t instructions;
+            uint64_t mem_fetches;
+            uint64_t mem_reads;
+            uint64_t io;
+        } period;
+
+        struct event event;
+    } idle;
+};
+
+// current time, in T-states
+static inline uint64_t platform_now(struct platform* platform) { return platform->cpu.t_states; }
+
+static inline uint8_t platform_mem_read(struct platform* platform, uint16_t addr)
+{
+    return platform->read_pages[(addr >> PAGE_SHIFT) & (PAGES - 1)][addr & (PAGE_SIZE - 1)];
+}
+
+static inline void platform_mem_write(struct platform* platform, uint16_t addr, uint8_t value)
+{
+    platform->write_pages[(addr >> PAGE_SHIFT) & (PAGES - 1)][addr & (PAGE_SIZE - 1)] = value;
+}
+
+// see platform.device_write
+static inline void platform_device_write(struct platform* platform, uint16_t addr, int len)
+{
+    if (platform->device_write)
+        platform->device_write(platform, addr, len);
+}
+
+// physical address backing addr, for reads
+static inline size_t platform_mem_phys(struct platform* platform, uint16_t addr)
+{
+    return platform->read_pages[(addr >> PAGE_SHIFT) & (PAGES - 1)] - platform->memory + (addr & (PAGE_SIZE - 1));
+}
+
+// host memory backing addr, NULL if write is set and it is read-only,
+// *len is set to the number of contiguous bytes from there
+static inline uint8_t* platform_mem_map(struct platform* platform, uint16_t addr, int write, int* len)
+{
+    int page = (addr >> PAGE_SHIFT) & (PAGES - 1);
+
+    *len = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+    if (write && platform->write_pages[page] == platform->scratch_page)
+        return NULL;
+    return platform->read_pages[page] + (addr & (PAGE_SIZE - 1));
+}
+
+// map a page of the address space onto the physical memory at phys
+void platform_map(struct platform* platform, int page, size_t phys);
+
+// power-on mapping: 2 KB of ROM then 2 KB of RAM, repeated
+void platform_map_reset(struct platform* platform);
+
+// request an interrupt if enabled and the controller has a line to serve
+void platform_irq_update(struct platform* platform);
+
+// load image bytes: addresses below ASM_BANK_BASE go through the power-on
+// mapping, the others are physical addresses offset by ASM_BANK_BASE;
+// bypasses the ROM write protection
+int platform_mem_load(struct platform* platform, uint32_t addr, const uint8_t* data, int len);
+
+// 1 when platform_mem_load() would fail, the memory being left untouched
+int platform_mem_check(struct platform* platform, uint32_t addr, int len);
+
+// a status port was read (value) during the polling loop detection, see
+// struct idle: returns 1 when it is a loop, idle.period then giving its
+// T-states and instructions per iteration (the other counters are up to
+// the caller)
+int platform_idle_poll(struct platform* platform, int port, uint8_t value);
+
+// the detected polling loop runs at once up to deadline (if not
+// EVENT_NEVER), returns the number of iterations skipped
+uint64_t platform_idle_run(struct platform* platform, uint64_t deadline);
+
+// the CPU halted: lets the time run until an interrupt can be served, up to
+// the next device event, returns 1 when only the host can wake it up
+int platform_halt(struct platform* platform);
+
+// halted for good: only the guest can enable the interrupts (console input
+// still wakes a legacy guest up)
+static inline int platform_halt_over(struct platform* platform)
+{
+    return !platform->int_enabled && !platform->pic.legacy;
+}
+
+void pic_reset(struct platform* platform);
+
+// highest priority line that can interrupt now, -1 if none
+int pic_next(struct platform* platform);
+
+// interrupt acknowledge: the instruction the CPU executes
+uint8_t pic_acknowledge(struct platform* platform);
+
+// RETI (0x1F) fetched, see pic.legacy
+void pic_reti(struct platform* platform);
+
+// parse "<name>[@<inp base>[,<out base>]][:<args>]", create and attach the device
+int device_attach(struct platform* platform, const char* spec);
+
+void device_reset_all(struct platform* platform);
+
+// write the pending host output of the devices, waiting for their out_fd
+// to be writable (until a signal)
+void device_drain_all(struct platform* platform);
+
+// close and free the devices, their events are left in the queue
+void device_close_all(struct platform* platform);
+
+void device_list(FILE* out);
+
+#endif /* PLATFORM_H_ */
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef PLATFORM_BUS_H_
+#define PLATFORM_BUS_H_
+
+#include "platform.h"
+
+// The bus of the platform: memory, devices, interrupt acknowledge, HLT and
+// polling loop detection, for a front end to instantiate as i8008_core.h.
+// It defines its hooks, includes this file, and builds the core with
+// platform_bus() as I8008_CORE_IO. The hooks are statements, called inline:
+//
+// PLATFORM_HOOK_HALT(platform)             the CPU halted, see platform_halt()
+// PLATFORM_HOOK_INTERRUPT(platform, instr) interrupt acknowledge, instr stuffed
+// PLATFORM_HOOK_MEM(platform, addr, ctrl)  memory fetch (I8008_T2_CTRL_PCI),
+//                                          read (_PCR), or before a write (_PCW)
+// PLATFORM_HOOK_IO(platform, port)         INP or OUT bus cycle
+// PLATFORM_HOOK_OUT(platform, port, value) before the device, may return
+//                                          from platform_out() to skip it
+// PLATFORM_HOOK_IDLE(platform, port, loop) status port read, loop being the
+//                                          result of platform_idle_poll()
+//
+// Only PLATFORM_HOOK_HALT is required.
+
+#ifndef PLATFORM_HOOK_HALT
+#error "PLATFORM_HOOK_HALT must be defined"
+#endif
+#ifndef PLATFORM_HOOK_INTERRUPT
+#define PLATFORM_HOOK_INTERRUPT(platform, instr)
+#endif
+#ifndef PLATFORM_HOOK_MEM
+#define PLATFORM_HOOK_MEM(platform, addr, ctrl)
+#endif
+#ifndef PLATFORM_HOOK_IO
+#define PLATFORM_HOOK_IO(platform, port)
+#endif
+#ifndef PLATFORM_HOOK_OUT
+#define PLATFORM_HOOK_OUT(platform, port, value)
+#endif
+#ifndef PLATFORM_HOOK_IDLE
+#define PLATFORM_HOOK_IDLE(platform, port, loop)
+#endif
+
+#define PLATFORM_INSTR_RETI 0x1F
+
+// INP/0 to INP/7, OUT/8 to OUT/31
+static inline int platform_io_port(struct platform* platform) { return (platform->addr_high >> 1) & 0x1F; }
+
+static inline uint8_t platform_inp(struct platform* platform, int port)
+{
+    struct device* device = platform->inp_devices[port];
+    uint8_t value;
+
+    if (!device) {
+        platform->idle.dirty = 1;
+        return 0;
+    }
+
+    value = device->inp(device, port - device->inp_base);
+
+    if (!platform->idle.disabled && (device->status_ports & (1 << (port - device->inp_base)))) {
+        int loop = platform_idle_poll(platform, port, value);
+        PLATFORM_HOOK_IDLE(platform, port, loop);
+        if (loop)
+            event_schedule(&platform->events, &platform->idle.event, 0);
+    } else {
+        platform->idle.dirty = 1;
+    }
+
+    return value;
+}
+
+static inline void platform_out(struct platform* platform, int port, uint8_t value)
+{
+    struct device* device = platform->out_devices[port - OUT_PORT_BASE];
+
+    platform->idle.dirty = 1;
+
+    PLATFORM_HOOK_OUT(platform, port, value);
+
+    if (device)
+        device->out(device, port - device->out_base, value);
+}
+
+static inline uint8_t platform_bus(struct i8008_cpu* cpu, enum i8008_state state, uint8_t bus_out)
+{
+    struct platform* platform = container_of(cpu, struct platform, cpu);
+
+    switch (state) {
+    case I8008_STATE_T1I:
+        platform->idle.dirty = 1;
+        i8008_int_req(cpu, 0); // acknowledge the interrupt
+        platform->stuffed_instructions[0]     = pic_acknowledge(platform);
+        platform->stuffed_instructions_number = 1;
+        PLATFORM_HOOK_INTERRUPT(platform, platform->stuffed_instructions[0]);
+    case I8008_STATE_T1:
+        platform->addr_low = bus_out;
+        break;
+    case I8008_STATE_T2:
+        platform->ctrl      = bus_out & I8008_T2_CTRL_MSK;
+        platform->addr_high = bus_out & ~I8008_T2_CTRL_MSK;
+        break;
+    case I8008_STATE_T3: {
+        uint16_t addr = platform->addr_high;
+        addr          = (addr << 8) | platform->addr_low;
+        switch (platform->ctrl) {
+        case I8008_T2_CTRL_PCI: {
+            uint8_t instr;
+            if (platform->stuffed_instructions_number)
+                return platform->stuffed_instructions[--platform->stuffed_instructions_number];
+
+            PLATFORM_HOOK_MEM(platform, addr, I8008_T2_CTRL_PCI);
+            instr = platform_mem_read(platform, addr);
+            if (instr == PLATFORM_INSTR_RETI)
+                pic_reti(platform);
+            return instr;
+        }
+        case I8008_T2_CTRL_PCR:
+            PLATFORM_HOOK_MEM(platform, addr, I8008_T2_CTRL_PCR);
+            return platform_mem_read(platform, addr);
+        case I8008_T2_CTRL_PCC: {
+            int port = platform_io_port(platform);
+            if (port < INP_PORTS) {
+                PLATFORM_HOOK_IO(platform, port);
+                return platform_inp(platform, port);
+            }
+            break;
+        }
+        case I8008_T2_CTRL_PCW:
+            platform->idle.dirty = 1;
+            PLATFORM_HOOK_MEM(platform, addr, I8008_T2_CTRL_PCW);
+            platform_mem_write(platform, addr, bus_out);
+            break;
+        }
+        break;
+    }
+    case I8008_STATE_STOPPED:
+        // Only an interrupt can make us return
+        if (platform->kickstarted) {
+            platform->halted = 1;
+            PLATFORM_HOOK_HALT(platform);
+        } else {
+            // the CPU starts in STOPPED state, wake it
+            platform->kickstarted = 1;
+        }
+        i8008_int_req(&platform->cpu, 1);
+        break;
+    case I8008_STATE_WAIT:
+        if (platform->ctrl == I8008_T2_CTRL_PCC) {
+            int port = platform_io_port(platform);
+            if (port >= OUT_PORT_BASE) {
+                PLATFORM_HOOK_IO(platform, port);
+                platform_out(platform, port, platform->addr_low);
+                return bus_out;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+#endif /* PLATFORM_BUS_H_ */
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "profiler.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define SAMPLES_NUMBER 4096 // power of 2
+#define ADDR_SPACE 0x4000
+
+struct sample {
+    uint16_t stack[8];
+    uint8_t stack_idx;
+};
+
+static struct i8008_cpu* profiled_cpu;
+
+// single producer (signal handler), single consumer (profiler_drain)
+static struct sample samples[SAMPLES_NUMBER];
+static unsigned int samples_head;
+static unsigned int samples_tail;
+static unsigned int samples_dropped;
+
+static unsigned int total_samples;
+static unsigned int pc_hits[ADDR_SPACE];
+static unsigned int* sym_self; // per symbol, indexed as in the map
+static unsigned int* sym_total; // including callees
+static int sym_count;
+
+static void sample_handler(int sig)
+{
+    unsigned int head = __atomic_load_n(&samples_head, __ATOMIC_RELAXED);
+    unsigned int tail = __atomic_load_n(&samples_tail, __ATOMIC_ACQUIRE);
+    struct sample* sample;
+
+    if (head - tail >= SAMPLES_NUMBER) {
+        samples_dropped++;
+        return;
+    }
+
+    sample = &samples[head % SAMPLES_NUMBER];
+    memcpy(sample->stack, profiled_cpu->stack, sizeof(sample->stack));
+    sample->stack_idx = profiled_cpu->stack_idx;
+
+    __atomic_store_n(&samples_head, head + 1, __ATOMIC_RELEASE);
+}
+
+int profiler_start(struct i8008_cpu* cpu, int hz)
+{
+    struct itimerval timer = { 0 };
+    struct sigaction action;
+
+    profiled_cpu = cpu;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sample_handler;
+    action.sa_flags   = SA_RESTART;
+    if (sigaction(SIGPROF, &action, NULL) < 0) {
+        perror("sigaction");
+        return 1;
+    }
+
+    // tv_usec has to stay below one second
+    timer.it_interval.tv_sec  = 1 / hz;
+    timer.it_interval.tv_usec = 1000000 / hz % 1000000;
+    timer.it_value            = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) < 0) {
+        perror("setitimer");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void account(const struct symmap* map, const struct sample* sample)
+{
+    int seen[8];
+    int depth, i;
+
+    pc_hits[sample->stack[sample->stack_idx] % ADDR_SPACE]++;
+    total_samples++;
+
+    if (!map->count)
+        return;
+
+    if (sym_count != map->count) {
+        // (re)loaded map
+        sym_count = map->count;
+        sym_self  = (unsigned int*)realloc(sym_self, sym_count * sizeof(unsigned int));
+        sym_total = (unsigned int*)realloc(sym_total, sym_count * sizeof(unsigned int));
+        memset(sym_self, 0, sym_count * sizeof(unsigned int));
+        memset(sym_total, 0, sym_count * sizeof(unsigned int));
+    }
+
+    // walk from the current PC down to the outermost return address,
+    // each symbol of the chain is accounted once
+    for (depth = 0; depth <= sample->stack_idx; depth++) {
+        int sym = symmap_find(map, sample->stack[sample->stack_idx - depth]);
+
+        seen[depth] = sym;
+        if (sym < 0)
+            continue;
+        if (depth == 0)
+            sym_self[sym]++;
+        for (i = 0; seen[i] != sym; i++)
+            ;
+        if (i == depth)
+            sym_total[sym]++;
+    }
+}
+
+void profiler_drain(const struct symmap* map)
+{
+    unsigned int tail = samples_tail;
+    unsigned int head = __atomic_load_n(&samples_head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        account(map, &samples[tail % SAMPLES_NUMBER]);
+        tail++;
+    }
+
+    __atomic_store_n(&samples_tail, tail, __ATOMIC_RELEASE);
+}
+
+static int compare_self(const void* a, const void* b)
+{
+    unsigned int hits_a = sym_self[*(const int*)a], hits_b = sym_self[*(const int*)b];
+
+    if (hits_a == hits_b)
+        return sym_total[*(const int*)b] - sym_total[*(const int*)a];
+    return hits_a < hits_b ? 1 : -1;
+}
+
+static int compare_pc(const void* a, const void* b)
+{
+    unsigned int hits_a = pc_hits[*(const int*)a], hits_b = pc_hits[*(const int*)b];
+
+    return hits_a == hits_b ? 0 : hits_a < hits_b ? 1 : -1;
+}
+
+void profiler_report(const struct symmap* map, FILE* out)
+{
+    struct itimerval timer = { 0 };
+    int* order;
+    int i, count;
+
+    setitimer(ITIMER_PROF, &timer, NULL);
+    profiler_drain(map);
+
+    fprintf(out, "=== profile: %u samples, %u dropped ===\n", total_samples, samples_dropped);
+    if (!total_samples)
+        return;
+
+    if (sym_count) {
+        count = sym_count;
+        order = (int*)malloc(count * sizeof(int));
+        for (i = 0; i < count; i++)
+            order[i] = i;
+        qsort(order, count, sizeof(int), &compare_self);
+
+        fprintf(out, "  self%%  total%%   samples  symbol\n");
+        for (i = 0; i < count && sym_total[order[i]]; i++) {
+            int sym = order[i];
+            fprintf(out, "%6.2f  %6.2f  %8u  %s\n", 100.0 * sym_self[sym] / total_samples,
+                    100.0 * sym_total[sym] / total_samples, sym_self[sym], map->entries[sym].name);
+        }
+    } else {
+        count = ADDR_SPACE;
+        order = (int*)malloc(count * sizeof(int));
+        for (i = 0; i < count; i++)
+            order[i] = i;
+        qsort(order, count, sizeof(int), &compare_pc);
+
+        fprintf(out, "  self%%   samples  PC\n");
+        for (i = 0; i < count && i < 32 && pc_hits[order[i]]; i++)
+            fprintf(out, "%6.2f  %8u  0x%04X\n", 100.0 * pc_hits[order[i]] / total_samples, pc_hits[order[i]],
+                    order[i]);
+    }
+
+    free(order);
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <stdio.h>
+
+#include "i8008.h"
+#include "symmap.h"
+
+// Sample the PC and call chain of cpu hz times per second of host CPU time.
+int profiler_start(struct i8008_cpu* cpu, int hz);
+
+// Move the pending samples into the histogram. Cheap when none are pending.
+void profiler_drain(const struct symmap* map);
+
+void profiler_report(const struct symmap* map, FILE* out);
+
+#endif /* PROFILER_H_ */
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef REC_H_
+#define REC_H_
+
+#include <stdint.h>
+
+#include "platform.h"
+
+// Ahead of time recompiled code, see i8008rec.c. i8008emu is linked either
+// with rec_none.o (no recompiled code), or with the C output of i8008rec,
+// compiled: its run() executes the guest from the PC, one C label per basic
+// block of the ROM, until an instruction it does not cover (HLT, code
+// outside of the ROM, a ROM not mapped as at power-on), the deadline or an
+// interrupt request, which are left to the interpreter.
+//
+// The registers, flags, stack, instruction and T-state counters are those
+// of the interpreter. The deadline and interrupts are only checked at the
+// start of the blocks, the memory accesses are not counted, and the I/O
+// goes through rec_inp() and rec_out(), the I/O of the interpreter.
+
+struct rec_segment {
+    uint32_t addr; // as in the .seg files
+    int len;
+    const uint8_t* data;
+};
+
+struct rec_image {
+    const char* name; // the image recompiled
+
+    // loaded when i8008emu is given no image
+    const struct rec_segment* segments;
+    int segments_number;
+
+    // the ROM at power-on (the first 2 KB): the code is used only if the
+    // loaded image has the same
+    const uint8_t* rom;
+
+    void (*run)(struct platform* platform, const uint64_t* deadline);
+};
+
+// NULL without recompiled code
+extern const struct rec_image* const rec_image;
+
+// provided by i8008emu: INP, and OUT returning non-zero when the execution
+// has to stop
+uint8_t rec_inp(struct platform* platform, int port);
+int rec_out(struct platform* platform, int port, uint8_t value);
+
+// what follows is for the generated code
+
+// see i8008.c
+extern uint8_t i8008_zsp_flags[256];
+
+#define REC_ROM_SIZE (2 * PAGE_SIZE)
+
+#define REC_PC (cpu->stack[cpu->stack_idx])
+#define REC_HL (cpu->regs[REG_H] << 8 | cpu->regs[REG_L])
+
+// entering a block
+#define REC_BLOCK(addr)                                                                                           \
+    if (cpu->t_states >= *deadline || cpu->int_req) {                                                            \
+        REC_PC = (addr);                                                                                          \
+        return;                                                                                                   \
+    }
+
+// the fetch cycle and the following ones of an instruction
+#define REC_STEP(t) (cpu->instructions++, cpu->t_states += (t))
+
+// to the interpreter
+#define REC_EXIT(addr)                                                                                            \
+    do {                                                                                                          \
+        REC_PC = (addr);                                                                                          \
+        return;                                                                                                   \
+    } while (0)
+
+// to the block at addr, in another page
+#define REC_JUMP(addr, label)                                                                                     \
+    do {                                                                                                          \
+        if (!rec_mapped(platform, addr))                                                                          \
+            REC_EXIT(addr);                                                                                       \
+        goto label;                                                                                               \
+    } while (0)
+
+// OUT, then back through the dispatch: the mapping may have changed
+#define REC_OUT(port)                                                                                             \
+    do {                                                                                                          \
+        int stop = rec_out(platform, port, cpu->regs[REG_A]);                                                     \
+        cpu->t_states += 3;                                                                                       \
+        if (stop)                                                                                                 \
+            return;                                                                                               \
+        goto dispatch;                                                                                            \
+    } while (0)
+
+// is the ROM page of addr mapped as at power-on
+static inline int rec_mapped(struct platform* platform, uint16_t addr)
+{
+    int page = (addr >> PAGE_SHIFT) & (PAGES - 1);
+
+    return platform->read_pages[page] == platform->memory + (page & 1) * PAGE_SIZE;
+}
+
+// the operations below are those of i8008_core.h, op_code being constant
+
+static inline void rec_alu(struct i8008_cpu* cpu, int op, uint8_t v)
+{
+    uint16_t result = cpu->regs[REG_A];
+    int carry       = cpu->flags & I8008_F_CARRY;
+
+    switch (op) {
+    case 1: // ADC
+        result += carry;
+    case 0: // ADD
+        result += v;
+        break;
+    case 3: // SBB
+        result -= carry;
+    case 2: // SUB
+    case 7: // CMP
+        result -= v;
+        break;
+    case 4:
+        result &= v;
+        break;
+    case 5:
+        result ^= v;
+        break;
+    case 6:
+        result |= v;
+        break;
+    }
+
+    if (op != 7)
+        cpu->regs[REG_A] = result;
+    cpu->flags_result = result;
+    cpu->flags_lazy   = 1;
+    cpu->flags        = (cpu->flags & ~I8008_F_CARRY) | !!(result & 0x100);
+}
+
+// INr, DCr: the carry is left
+static inline void rec_incdec(struct i8008_cpu* cpu, int reg, int delta)
+{
+    cpu->regs[reg] += delta;
+    cpu->flags_result = cpu->regs[reg];
+    cpu->flags_lazy   = 1;
+}
+
+// RLC, RRC, RAL, RAR
+static inline void rec_rot(struct i8008_cpu* cpu, int op)
+{
+    uint8_t a = cpu->regs[REG_A];
+    int carry = cpu->flags & I8008_F_CARRY;
+
+    switch (op) {
+    case 0:
+        cpu->regs[REG_A] = a << 1 | a >> 7;
+        carry            = a >> 7;
+        break;
+    case 1:
+        cpu->regs[REG_A] = a >> 1 | a << 7;
+        carry            = a & 1;
+        break;
+    case 2:
+        cpu->regs[REG_A] = a << 1 | carry;
+        carry            = a >> 7;
+        break;
+    case 3:
+        cpu->regs[REG_A] = a >> 1 | carry << 7;
+        carry            = a & 1;
+        break;
+    }
+    cpu->flags = (cpu->flags & ~I8008_F_CARRY) | carry;
+}
+
+// condition of a conditional jump, call or return
+static inline int rec_cond(struct i8008_cpu* cpu, uint8_t op_code)
+{
+    int flag_val;
+
+    if (cpu->flags_lazy) {
+        cpu->flags      = (cpu->flags & I8008_F_CARRY) | i8008_zsp_flags[cpu->flags_result];
+        cpu->flags_lazy = 0;
+    }
+    flag_val = cpu->flags & (1 << ((op_code >> 3) & 3));
+
+    return op_code & 0x20 ? !!flag_val : !flag_val;
+}
+
+// CAL, RST: ret is the return address
+static inline void rec_call(struct i8008_cpu* cpu, uint16_t ret, uint16_t target)
+{
+    cpu->stack[cpu->stack_idx] = ret;
+    cpu->stack_idx             = (cpu->stack_idx + 1) % 8;
+    if (cpu->stack_idx == 0)
+        cpu->stack_wraps++;
+    cpu->stack[cpu->stack_idx] = target;
+}
+
+static inline void rec_ret(struct i8008_cpu* cpu)
+{
+    if (cpu->stack_idx == 0)
+        cpu->stack_wraps++;
+    cpu->stack_idx = (cpu->stack_idx + 7) % 8;
+}
+
+#endif /* REC_H_ */
@@ -0,0 +1,12 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "rec.h"
+
+// i8008emu without recompiled code, see rec.h
+const struct rec_image* const rec_image = NULL;
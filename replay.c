@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "replay.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct replay {
+    FILE* log;
+    int playing;
+
+    // next record of the log being replayed
+    struct replay_record {
+        enum {
+            REC_IN,
+            REC_IRQ,
+            REC_END,
+        } type;
+        uint64_t instructions;
+        uint64_t t_states;
+        char device[16];
+        int value; // input byte, RST number
+    } next;
+    int line_number;
+    int done;
+    int diverged;
+
+    struct platform* platform;
+    struct event event;
+};
+
+static void diverge(struct replay* replay, const char* reason)
+{
+    struct i8008_cpu* cpu = &replay->platform->cpu;
+
+    fprintf(stderr, "replay: diverged at instruction %" PRIu64 ", T-state %" PRIu64 " (log line %d): %s\n",
+            cpu->instructions, cpu->t_states, replay->line_number, reason);
+    replay->diverged = 1;
+    replay->done     = 1;
+    event_cancel(&replay->platform->events, &replay->event);
+}
+
+// read the next record and schedule its event
+static void replay_advance(struct replay* replay)
+{
+    struct replay_record* rec = &replay->next;
+    char line[128];
+
+    for (;;) {
+        if (!fgets(line, sizeof(line), replay->log)) {
+            // truncated log, the recording did not end cleanly
+            rec->type         = REC_END;
+            rec->instructions = replay->platform->cpu.instructions;
+            rec->t_states     = replay->platform->cpu.t_states;
+            break;
+        }
+        replay->line_number++;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (sscanf(line, "in %" SCNu64 " %" SCNu64 " %15s %i", &rec->instructions, &rec->t_states, rec->device,
+                   &rec->value)
+            == 4)
+            rec->type = REC_IN;
+        else if (sscanf(line, "irq %" SCNu64 " %" SCNu64 " %i", &rec->instructions, &rec->t_states, &rec->value) == 3)
+            rec->type = REC_IRQ;
+        else if (sscanf(line, "end %" SCNu64 " %" SCNu64, &rec->instructions, &rec->t_states) == 2)
+            rec->type = REC_END;
+        else {
+            diverge(replay, "invalid record");
+            return;
+        }
+        break;
+    }
+
+    // an interrupt is checked when acknowledged, the event only catches a
+    // missing one
+    event_schedule(&replay->platform->events, &replay->event,
+                   rec->type == REC_IRQ ? rec->t_states + 1 : rec->t_states);
+}
+
+static void replay_event(struct event* event, uint64_t now)
+{
+    struct replay* replay     = container_of(event, struct replay, event);
+    struct replay_record* rec = &replay->next;
+    struct device* device;
+
+    switch (rec->type) {
+    case REC_IN:
+        if (now != rec->t_states || replay->platform->cpu.instructions != rec->instructions) {
+            diverge(replay, "input out of sync");
+            return;
+        }
+        for (device = replay->platform->devices; device; device = device->next) {
+            if (device->input && 0 == strcmp(device->type->name, rec->device))
+                break;
+        }
+        if (!device) {
+            diverge(replay, "no device to take the input");
+            return;
+        }
+        device->input(device, rec->value);
+        replay_advance(replay);
+        break;
+    case REC_IRQ:
+        diverge(replay, "missing interrupt");
+        break;
+    case REC_END:
+        replay->done = 1;
+        break;
+    }
+}
+
+struct replay* replay_record(const char* file)
+{
+    struct replay* replay;
+    FILE* log = fopen(file, "w");
+
+    if (!log) {
+        perror(file);
+        return NULL;
+    }
+    fprintf(log, "# i8008emu replay log\n");
+
+    replay      = (struct replay*)calloc(1, sizeof(struct replay));
+    replay->log = log;
+
+    return replay;
+}
+
+struct replay* replay_play(struct platform* platform, const char* file)
+{
+    struct replay* replay;
+    FILE* log = fopen(file, "r");
+
+    if (!log) {
+        perror(file);
+        return NULL;
+    }
+
+    replay           = (struct replay*)calloc(1, sizeof(struct replay));
+    replay->log      = log;
+    replay->playing  = 1;
+    replay->platform = platform;
+    replay->event    = (struct event)EVENT_INIT(&replay_event);
+
+    replay_advance(replay);
+
+    return replay;
+}
+
+int replay_playing(const struct replay* replay) { return replay->playing; }
+
+void replay_input(struct replay* replay, struct platform* platform, struct device* device, uint8_t value)
+{
+    if (replay->playing)
+        return;
+    fprintf(replay->log, "in %" PRIu64 " %" PRIu64 " %s 0x%02X\n", platform->cpu.instructions,
+            platform->cpu.t_states, device->type->name, value);
+}
+
+void replay_interrupt(struct replay* replay, struct platform* platform, int rst)
+{
+    struct replay_record* rec = &replay->next;
+
+    if (!replay->playing) {
+        fprintf(replay->log, "irq %" PRIu64 " %" PRIu64 " %d\n", platform->cpu.instructions,
+                platform->cpu.t_states, rst);
+        return;
+    }
+
+    if (replay->done)
+        return;
+    if (rec->type != REC_IRQ || rec->t_states != platform->cpu.t_states
+        || rec->instructions != platform->cpu.instructions || rec->value != rst) {
+        diverge(replay, "unexpected interrupt");
+        return;
+    }
+    replay_advance(replay);
+}
+
+int replay_done(const struct replay* replay) { return replay->done; }
+
+int replay_close(struct replay* replay, struct platform* platform)
+{
+    int diverged = replay->diverged;
+
+    if (!replay->playing)
+        fprintf(replay->log, "end %" PRIu64 " %" PRIu64 "\n", platform->cpu.instructions, platform->cpu.t_states);
+    else if (!diverged)
+        fprintf(stderr, "replay: completed, %" PRIu64 " instructions, %" PRIu64 " T-states\n",
+                platform->cpu.instructions, platform->cpu.t_states);
+
+    fclose(replay->log);
+    free(replay);
+
+    return diverged;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdint.h>
+
+#include "platform.h"
+
+// Deterministic record/replay. The host input is the only source of non
+// determinism: the log holds the input bytes delivered to the devices, and
+// the interrupts as checkpoints, stamped with the instruction and T-state
+// counters. It is a text file, one record per line:
+//   in <instructions> <T-states> <device> <byte>
+//   irq <instructions> <T-states> <RST number>
+//   end <instructions> <T-states>
+// A replay feeds the input back at the same T-states without waiting for
+// the host, and stops at the end of the log or on the first divergence.
+
+struct replay;
+
+struct replay* replay_record(const char* file);
+
+struct replay* replay_play(struct platform* platform, const char* file);
+
+int replay_playing(const struct replay* replay);
+
+// a device got a byte from the host, recorded
+void replay_input(struct replay* replay, struct platform* platform, struct device* device, uint8_t value);
+
+// interrupt acknowledge, recorded or checked
+void replay_interrupt(struct replay* replay, struct platform* platform, int rst);
+
+// the replay reached the end of the log or diverged
+int replay_done(const struct replay* replay);
+
+// end the recording, or report the replay outcome: returns 1 on divergence
+int replay_close(struct replay* replay, struct platform* platform);
+
+#endif /* REPLAY_H_ */
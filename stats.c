@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "stats.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct i8008_stats* stats_open(const char* shm_name)
+{
+    static struct i8008_stats private_stats;
+    struct i8008_stats* stats = &private_stats;
+
+    if (shm_name) {
+        int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("shm_open");
+            return NULL;
+        }
+        if (ftruncate(fd, sizeof(*stats)) < 0) {
+            perror("ftruncate");
+            close(fd);
+            return NULL;
+        }
+        stats = (struct i8008_stats*)mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (stats == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+    }
+
+    stats->magic   = I8008_STATS_MAGIC;
+    stats->version = I8008_STATS_VERSION;
+
+    return stats;
+}
+
+void stats_dump(const struct i8008_stats* stats, FILE* out)
+{
+    static const char* fusions[I8008_FUSIONS] = {
+        [I8008_FUSE_LAM_CPI_RTZ] = "LAM;CPI;RTZ",
+        [I8008_FUSE_LAL_ADI_LLA] = "LAL;ADI;LLA",
+        [I8008_FUSE_LLI_LHI]     = "LLI;LHI",
+        [I8008_FUSE_LHI_LLI]     = "LHI;LLI",
+    };
+    int port, i;
+
+    fprintf(out, "instructions  %" PRIu64 "\n", stats->instructions);
+    fprintf(out, "t-states      %" PRIu64 "\n", stats->t_states);
+    fprintf(out, "mem fetches   %" PRIu64 "\n", stats->mem_fetches);
+    fprintf(out, "mem reads     %" PRIu64 "\n", stats->mem_reads);
+    fprintf(out, "mem writes    %" PRIu64 "\n", stats->mem_writes);
+    for (port = 0; port < 32; port++) {
+        if (stats->io[port])
+            fprintf(out, "%s port %-2d   %" PRIu64 "\n", port < 8 ? "INP" : "OUT", port, stats->io[port]);
+    }
+    fprintf(out, "interrupts    %" PRIu64 "\n", stats->interrupts);
+    fprintf(out, "halt time     %" PRIu64 ".%09" PRIu64 " s\n", stats->halt_ns / 1000000000,
+            stats->halt_ns % 1000000000);
+    fprintf(out, "stack wraps   %" PRIu64 "\n", stats->stack_wraps);
+    for (i = 0; i < I8008_FUSIONS; i++)
+        fprintf(out, "fused %-11s %" PRIu64 "\n", fusions[i], stats->fusions[i]);
+}
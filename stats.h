@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "i8008.h"
+
+#define I8008_STATS_MAGIC 0x53383038 // "808S"
+#define I8008_STATS_VERSION 2
+
+// Layout of the shared memory page, monitors may map it read-only.
+// Counters are updated with plain stores: a reader may see a value a few
+// instructions old, never a torn one on 64-bit hosts.
+struct i8008_stats {
+    uint32_t magic;
+    uint32_t version;
+
+    uint64_t instructions;
+    uint64_t t_states;
+
+    uint64_t mem_fetches;
+    uint64_t mem_reads;
+    uint64_t mem_writes;
+    uint64_t io[32]; // INP ports 0-7, OUT ports 8-31
+
+    uint64_t interrupts;
+    uint64_t halt_ns; // host time spent in HALT
+    uint64_t stack_wraps;
+    uint64_t fusions[I8008_FUSIONS]; // by enum i8008_fusion
+};
+
+// Map the counters in the POSIX shared memory object shm_name, or in
+// private memory when shm_name is NULL.
+struct i8008_stats* stats_open(const char* shm_name);
+
+void stats_dump(const struct i8008_stats* stats, FILE* out);
+
+#endif /* STATS_H_ */
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "symmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void add_entry(struct symmap* map, int addr, const char* name)
+{
+    map->entries = (struct symmap_entry*)realloc(map->entries, (map->count + 1) * sizeof(struct symmap_entry));
+
+    map->entries[map->count].addr = addr;
+    map->entries[map->count].name = strdup(name);
+    map->count++;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    return (int)((const struct symmap_entry*)a)->addr - (int)((const struct symmap_entry*)b)->addr;
+}
+
+int symmap_load(struct symmap* map, const char* file)
+{
+    char line[256], name[256];
+    unsigned int addr;
+    FILE* f;
+
+    f = fopen(file, "r");
+    if (!f) {
+        perror(file);
+        return 1;
+    }
+
+    symmap_free(map);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%i %255s", &addr, name) == 2)
+            add_entry(map, addr, name);
+    }
+    fclose(f);
+
+    qsort(map->entries, map->count, sizeof(struct symmap_entry), &compare_entries);
+
+    return 0;
+}
+
+void symmap_from_asm(struct symmap* map, struct asm_ctx* ctx)
+{
+    struct symbol* sym;
+
+    symmap_free(map);
+    for (sym = ctx->symbols; sym; sym = sym->next)
+        add_entry(map, sym->addr, sym->name);
+
+    qsort(map->entries, map->count, sizeof(struct symmap_entry), &compare_entries);
+}
+
+int symmap_find(const struct symmap* map, uint16_t addr)
+{
+    int low = 0, high = map->count;
+
+    // first entry above addr
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (map->entries[mid].addr <= addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low - 1;
+}
+
+int symmap_lookup(const struct symmap* map, const char* name)
+{
+    int i;
+
+    for (i = 0; i < map->count; i++) {
+        if (0 == strcmp(map->entries[i].name, name))
+            return map->entries[i].addr;
+    }
+    return -1;
+}
+
+void symmap_free(struct symmap* map)
+{
+    while (map->count)
+        free(map->entries[--map->count].name);
+
+    free(map->entries);
+    map->entries = NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef SYMMAP_H_
+#define SYMMAP_H_
+
+#include <stdint.h>
+
+#include "asm_bler.h"
+
+// Symbol map, as written by "i8008asm -m": one "<address> <name>" per line.
+struct symmap {
+    int count;
+    struct symmap_entry {
+        uint16_t addr;
+        char* name;
+    } * entries; // sorted by address
+};
+
+int symmap_load(struct symmap* map, const char* file);
+
+void symmap_from_asm(struct symmap* map, struct asm_ctx* ctx);
+
+// index of the closest symbol at or below addr, -1 if none
+int symmap_find(const struct symmap* map, uint16_t addr);
+
+// address of the symbol named name, -1 if unknown
+int symmap_lookup(const struct symmap* map, const char* name);
+
+void symmap_free(struct symmap* map);
+
+#endif /* SYMMAP_H_ */
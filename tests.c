@@ -6,10 +6,18 @@
  * LICENSE file in the root directory of this source tree.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "asm_bler.h"
+#include "hle.h"
+#include "i8008.h"
+#include "image.h"
+#include "replay.h"
+#include "undo.h"
 
 struct feed_ctx {
     char* str;
@@ -43,8 +51,8 @@ static void test_lai()
     asm_ble(&ctx, &feed, &feeder);
 
     ASSERT(ctx.pc == 2);
-    ASSERT(ctx.output[0] == 0x06);
-    ASSERT(ctx.output[1] == 0x42);
+    ASSERT(*asm_locate(&ctx, 0) == 0x06);
+    ASSERT(*asm_locate(&ctx, 1) == 0x42);
 
     asm_free(&ctx);
 }
@@ -57,9 +65,9 @@ static void test_jmp()
     asm_ble(&ctx, &feed, &feeder);
 
     ASSERT(ctx.pc == 0x45);
-    ASSERT((ctx.output[0x40 + 2] & 0xC7) == 0x44);
-    ASSERT(ctx.output[0x40 + 3] == 0x40);
-    ASSERT(ctx.output[0x40 + 4] == 0x00);
+    ASSERT((*asm_locate(&ctx, 0x40 + 2) & 0xC7) == 0x44);
+    ASSERT(*asm_locate(&ctx, 0x40 + 3) == 0x40);
+    ASSERT(*asm_locate(&ctx, 0x40 + 4) == 0x00);
 
     asm_free(&ctx);
 }
@@ -72,7 +80,7 @@ static void test_ret()
     asm_ble(&ctx, &feed, &feeder);
 
     ASSERT(ctx.pc == 0x1);
-    ASSERT((ctx.output[0] & 0xC7) == 0x07);
+    ASSERT((*asm_locate(&ctx, 0) & 0xC7) == 0x07);
 
     asm_free(&ctx);
 }
@@ -85,7 +93,7 @@ static void test_lam()
     asm_ble(&ctx, &feed, &feeder);
 
     ASSERT(ctx.pc == 0x1);
-    ASSERT(ctx.output[0] == 0xC7);
+    ASSERT(*asm_locate(&ctx, 0) == 0xC7);
 
     asm_free(&ctx);
 }
@@ -98,11 +106,975 @@ static void test_set()
     asm_ble(&ctx, &feed, &feeder);
 
     ASSERT(ctx.pc == 0x1);
-    ASSERT(ctx.output[0] == ' ');
+    ASSERT(*asm_locate(&ctx, 0) == ' ');
 
     asm_free(&ctx);
 }
 
+static void test_out()
+{
+    struct asm_ctx ctx     = { 0 };
+    struct feed_ctx feeder = { .str = "OUT/1\nOUT/25\nOUT/8\nOUT/31", 0 };
+
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.pc == 0x4);
+    ASSERT(*asm_locate(&ctx, 0) == 0x73);
+    ASSERT(*asm_locate(&ctx, 1) == 0x73);
+    ASSERT(*asm_locate(&ctx, 2) == 0x51);
+    ASSERT(*asm_locate(&ctx, 3) == 0x7F);
+
+    asm_free(&ctx);
+}
+
+static void test_segments()
+{
+    struct asm_ctx ctx     = { 0 };
+    struct feed_ctx feeder = { .str = ".org 0x3000\nLAI 1\n.org 0x10\nRET\n.org 0x3002\nRET", 0 };
+
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.status == ASM_ST_OK);
+    ASSERT(ctx.segments->addr == 0x10 && ctx.segments->len == 1);
+    ASSERT(ctx.segments->next->addr == 0x3000 && ctx.segments->next->len == 3);
+    ASSERT(ctx.segments->next->next == NULL);
+    ASSERT(asm_locate(&ctx, 0x11) == NULL);
+    ASSERT(*asm_locate(&ctx, 0x3001) == 1);
+    ASSERT(asm_image_end(&ctx) == 0x3003);
+
+    asm_free(&ctx);
+}
+
+static void test_overlap()
+{
+    struct asm_ctx ctx     = { 0 };
+    struct feed_ctx feeder = { .str = ".org 0x10\nRET\n.org 0x0E\nLAI 1\nRET", 0 };
+
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.status == ASM_ST_ERR_OVERLAP);
+    ASSERT(ctx.status_detail.err_addr == 0x10);
+    ASSERT(ctx.current_line_number == 5);
+
+    asm_free(&ctx);
+}
+
+static void test_include()
+{
+    struct asm_ctx ctx     = { 0 };
+    struct feed_ctx feeder = { .str = ".org 0x40\nCALL div8\nRET\n.include 'muldiv.asm'\nLAI 1", 0 };
+    int div8;
+
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.status == ASM_ST_OK);
+    ASSERT(ctx.current_file == NULL && ctx.current_line_number == 5);
+    div8 = *asm_locate(&ctx, 0x41) | *asm_locate(&ctx, 0x42) << 8;
+    ASSERT(div8 > 0x44 && *asm_locate(&ctx, div8) == 0xC1); // LAB
+    ASSERT(*asm_locate(&ctx, asm_image_end(&ctx) - 2) == 0x06); // LAI after the included code
+
+    asm_free(&ctx);
+
+    memset(&ctx, 0, sizeof(ctx));
+    feeder.idx = 0;
+    feeder.str = ".include 'does_not_exist.asm'";
+
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.status == ASM_ST_ERR_INCLUDE);
+    ASSERT(0 == strcmp(ctx.status_detail.err_file, "does_not_exist.asm"));
+
+    asm_free(&ctx);
+}
+
+static void test_bank()
+{
+    struct asm_ctx ctx     = { 0 };
+    struct feed_ctx feeder = { .str = ".bank 3 0x800\n.org 0x1004\nfoo: JMP foo\n.bank -1\n.org 0x10\nRET", 0 };
+
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.status == ASM_ST_OK);
+    ASSERT(ctx.segments->addr == 0x10);
+    ASSERT(ctx.segments->next->addr == ASM_BANK_BASE + 3 * 0x800 + 4);
+    ASSERT(*asm_locate(&ctx, ASM_BANK_BASE + 3 * 0x800 + 5) == 0x04); // foo, as seen from the window
+    ASSERT(*asm_locate(&ctx, ASM_BANK_BASE + 3 * 0x800 + 6) == 0x10);
+
+    asm_free(&ctx);
+
+    // the operands do not carry over to the next line
+    memset(&ctx, 0, sizeof(ctx));
+    feeder.idx = 0;
+    feeder.str = ".org\nLAI 1";
+
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.status == ASM_ST_ERR_OPERAND && ctx.current_line_number == 1);
+    ASSERT(0 == strcmp(ctx.status_detail.err_instr, ".org"));
+
+    asm_free(&ctx);
+
+    memset(&ctx, 0, sizeof(ctx));
+    feeder.idx = 0;
+    feeder.str = ".bank 2\n.org 0x10\nRET";
+
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.status == ASM_ST_ERR_OPERAND && ctx.current_line_number == 1);
+    ASSERT(0 == strcmp(ctx.status_detail.err_instr, ".bank"));
+
+    asm_free(&ctx);
+
+    // the code has to stay in the window of its bank
+    memset(&ctx, 0, sizeof(ctx));
+    feeder.idx = 0;
+    feeder.str = ".bank 1 0x800\n.org 0x17FE\nLAI 1\nRET";
+
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.status == ASM_ST_ERR_BANK && ctx.current_line_number == 4);
+    ASSERT(ctx.status_detail.err_addr == 0x1800);
+
+    asm_free(&ctx);
+}
+
+static void test_listing()
+{
+    struct asm_ctx ctx     = { 0 };
+    struct feed_ctx feeder = { .str = ".org 0x40\nLAI 1 ; one\nfoo:\nJMP foo", 0 };
+    struct line* line;
+
+    ctx.listing = 1;
+    asm_ble(&ctx, &feed, &feeder);
+
+    ASSERT(ctx.status == ASM_ST_OK);
+    line = ctx.lines;
+    ASSERT(line->len == 0);
+    line = line->next;
+    ASSERT(line->addr == 0x40 && line->len == 2 && line->line_number == 2);
+    ASSERT(0 == strcmp(line->text, "LAI 1 ; one"));
+    line = line->next;
+    ASSERT(line->addr == 0x42 && line->len == 0);
+    line = line->next;
+    ASSERT(line->addr == 0x42 && line->len == 3 && !line->next);
+
+    asm_free(&ctx);
+}
+
+static void test_image_invalid()
+{
+    // a valid record, then a bad checksum
+    static const char hex[] = ":0100000007F8\n:0100010008F0\n";
+    static const char file[] = "tests_image.hex";
+    struct platform platform = { .rom_size = 2048, .memory_size = 4096 };
+    FILE* f                  = fopen(file, "w");
+
+    ASSERT(f && fputs(hex, f) >= 0 && 0 == fclose(f));
+
+    platform.memory    = (uint8_t*)calloc(1, platform.memory_size);
+    platform.memory[0] = 0x42;
+    platform.memory[1] = 0x43;
+    platform_map_reset(&platform);
+
+    ASSERT(image_load(&platform, file, NULL) == 1);
+    ASSERT(platform.memory[0] == 0x42 && platform.memory[1] == 0x43); // left as is
+
+    remove(file);
+    free(platform.memory);
+}
+
+static void test_pic_legacy()
+{
+    struct platform platform = { 0 };
+    struct device requester  = { .irq = 1, .irq_line = 0 };
+    struct device* pic;
+
+    ASSERT(0 == device_attach(&platform, "pic"));
+    pic = platform.out_devices[23 - OUT_PORT_BASE];
+    pic_reset(&platform);
+    requester.next   = platform.devices;
+    platform.devices = &requester;
+
+    // the request wakes HLT up with the interrupts disabled, RETI enables them
+    platform.halted = 1;
+    ASSERT(pic_next(&platform) == 0);
+    ASSERT(pic_acknowledge(&platform) == 0x0D && !platform.int_enabled && !platform.halted); // RST 1
+    pic_reti(&platform);
+    ASSERT(platform.int_enabled);
+
+    // a command ends the legacy mode, the interrupt served being in service
+    ASSERT(pic_acknowledge(&platform) == 0x0D && !platform.int_enabled);
+    pic->out(pic, 0, 0x80); // EOI
+    ASSERT(!platform.pic.legacy && !platform.pic.in_service && platform.int_enabled);
+
+    platform.int_enabled = 0;
+    platform.halted      = 1;
+    ASSERT(pic_next(&platform) < 0);
+    pic_reti(&platform);
+    ASSERT(!platform.int_enabled);
+
+    platform.devices = requester.next;
+    device_close_all(&platform);
+}
+
+// operands, command, then the result bytes, least significant first
+static uint32_t muldiv_run(struct device* muldiv, uint16_t a, uint16_t b, uint8_t command, int bytes)
+{
+    uint32_t value = 0;
+    int i;
+
+    muldiv->out(muldiv, 0, a);
+    muldiv->out(muldiv, 1, a >> 8);
+    muldiv->out(muldiv, 2, b);
+    muldiv->out(muldiv, 3, b >> 8);
+    muldiv->out(muldiv, 4, command);
+    for (i = 0; i < bytes; i++)
+        value |= (uint32_t)muldiv->inp(muldiv, 0) << (8 * i);
+    return value;
+}
+
+static void test_muldiv()
+{
+    struct platform platform = { 0 };
+    struct device* muldiv;
+
+    ASSERT(0 == device_attach(&platform, "muldiv"));
+    muldiv = platform.devices;
+
+    ASSERT(muldiv_run(muldiv, 200, 100, 0, 2) == 20000);
+    ASSERT(muldiv_run(muldiv, 0x1234, 0x5602, 0, 2) == 0x68); // low bytes only
+    ASSERT(muldiv_run(muldiv, 0xFFFF, 0xFFFF, 1, 4) == 0xFFFE0001);
+    ASSERT(muldiv_run(muldiv, 200, 7, 2, 2) == (28 | 4 << 8));
+    ASSERT(muldiv_run(muldiv, 42, 0, 2, 2) == (0xFF | 42 << 8)); // divide by zero
+    ASSERT(muldiv_run(muldiv, 50000, 300, 3, 4) == (166 | 200 << 16));
+    ASSERT(muldiv_run(muldiv, 1234, 0, 3, 4) == (0xFFFF | 1234 << 16));
+    ASSERT(muldiv_run(muldiv, 65535, 0, 4, 3) == 0x065535);
+    ASSERT(muldiv_run(muldiv, 0x9999, 0, 5, 2) == 9999);
+
+    // past the result
+    ASSERT(muldiv_run(muldiv, 3, 5, 0, 4) == 15);
+    ASSERT(muldiv->inp(muldiv, 0) == 0);
+
+    device_close_all(&platform);
+}
+
+static uint16_t dma_write_addr;
+static int dma_write_len;
+
+static void dma_device_write(struct platform* platform, uint16_t addr, int len)
+{
+    dma_write_addr = addr;
+    dma_write_len  = len;
+}
+
+// start a transfer, returns the status once done
+static uint8_t dma_run(struct device* dma, uint16_t src, uint16_t dst, uint16_t len, uint8_t mode)
+{
+    struct platform* platform = dma->platform;
+
+    dma->out(dma, 0, src);
+    dma->out(dma, 1, src >> 8);
+    dma->out(dma, 2, dst);
+    dma->out(dma, 3, dst >> 8);
+    dma->out(dma, 4, len);
+    dma->out(dma, 5, len >> 8);
+    dma->out(dma, 6, mode);
+    ASSERT(dma->inp(dma, 0) & 1); // busy
+    event_run(&platform->events, platform->events.deadline);
+    return dma->inp(dma, 0);
+}
+
+static void test_dma()
+{
+    struct platform platform = { .events = EVENT_QUEUE_INIT, .rom_size = ROM_SIZE, .memory_size = ROM_SIZE + RAM_SIZE };
+    struct device* dma;
+    int i;
+
+    ASSERT(0 == device_attach(&platform, "dma"));
+    dma                   = platform.devices;
+    platform.device_write = &dma_device_write;
+    platform.memory       = (uint8_t*)calloc(1, platform.memory_size);
+    platform_map_reset(&platform);
+    for (i = 0; i < 6; i++)
+        platform_mem_write(&platform, 0x800 + i, 'a' + i);
+
+    // copy, busy for 8 T-states of setup and 3 per memory access
+    ASSERT(dma_run(dma, 0x800, 0x900, 6, 0) == 0);
+    ASSERT(platform.events.deadline == EVENT_NEVER);
+    ASSERT(0 == memcmp(platform.memory + ROM_SIZE + 0x100, "abcdef", 6));
+    ASSERT(dma_write_addr == 0x900 && dma_write_len == 6);
+    dma->out(dma, 6, 0);
+    ASSERT(platform.events.deadline == 8 + 2 * 6 * 3);
+    event_run(&platform.events, platform.events.deadline);
+
+    // overlapping forward copy: the first byte is replicated
+    ASSERT(dma_run(dma, 0x900, 0x901, 5, 0) == 0);
+    ASSERT(0 == memcmp(platform.memory + ROM_SIZE + 0x100, "aaaaaa", 6));
+
+    // fill, the source low byte being the value
+    ASSERT(dma_run(dma, '*', 0x902, 2, 1) == 0);
+    ASSERT(0 == memcmp(platform.memory + ROM_SIZE + 0x100, "aa**aa", 6));
+    ASSERT(dma_write_addr == 0x902 && dma_write_len == 2);
+
+    // compare: mismatch, and the first different source byte lower
+    ASSERT(dma_run(dma, 0x900, 0x900, 6, 2) == 0);
+    ASSERT(dma_run(dma, 0x900, 0x800, 6, 2) == (1 << 1 | 1 << 2)); // 'a' < 'b'
+    ASSERT(dma_run(dma, 0x800, 0x900, 6, 2) == 1 << 1);
+    ASSERT(dma_run(dma, 0x800, 0x900, 1, 2) == 0);
+
+    // completion interrupt, acknowledged by the status read
+    dma->out(dma, 6, 1 | 1 << 2);
+    ASSERT(!dma->irq);
+    event_run(&platform.events, platform.events.deadline);
+    ASSERT(dma->irq);
+    ASSERT(dma->inp(dma, 0) == 0 && !dma->irq);
+
+    device_close_all(&platform);
+    free(platform.memory);
+}
+
+// the machine of test_replay(), on the bus of the front ends: a halted
+// guest waits for the console input, the run stops when it is over
+static int machine_stopped;
+
+static void machine_stop(struct event* event, uint64_t now)
+{
+    (void)event;
+    (void)now;
+}
+
+static struct event machine_stop_event = EVENT_INIT_PASSIVE(&machine_stop);
+
+static void machine_halt(struct platform* platform)
+{
+    struct device* device;
+
+    // as i8008emu: the host events run here, until one raises an interrupt
+    while (platform_halt(platform)) {
+        for (device = platform->devices; device && !device->fd_event; device = device->next)
+            ;
+        if (!device || platform->host_input_held) {
+            machine_stopped = 1;
+            event_schedule(&platform->events, &machine_stop_event, 0); // ends the batch
+            return;
+        }
+        event_schedule(&platform->events, device->fd_event, platform_now(platform)); // a file is always readable
+        event_run(&platform->events, platform_now(platform));
+    }
+}
+
+static void machine_interrupt(struct platform* platform, uint8_t instr)
+{
+    if ((instr & 0xC7) == 0x05 && platform->replay) // RST
+        replay_interrupt(platform->replay, platform, (instr >> 3) & 7);
+}
+
+#define PLATFORM_HOOK_HALT(platform) machine_halt(platform)
+#define PLATFORM_HOOK_INTERRUPT(platform, instr) machine_interrupt(platform, instr)
+#include "platform_bus.h"
+
+#define I8008_CORE_IO(cpu, state, bus_out) platform_bus(cpu, state, bus_out)
+#include "i8008_core.h"
+#undef assert // from <assert.h>, see ASSERT()
+
+static void machine_run(struct platform* platform, const char* console, const char* image)
+{
+    platform->rom_size    = ROM_SIZE;
+    platform->memory_size = ROM_SIZE + RAM_SIZE;
+    ASSERT(0 == device_attach(platform, console));
+    platform->memory = (uint8_t*)calloc(1, platform->memory_size);
+    platform_map_reset(platform);
+    pic_reset(platform);
+    ASSERT(0 == image_load(platform, image, NULL));
+
+    i8008_init(&platform->cpu, &platform_bus);
+    platform->cpu.fuse_deadline = &platform->events.deadline;
+
+    machine_stopped = 0;
+    while (!machine_stopped && !(platform->replay && replay_done(platform->replay))) {
+        i8008_core_run(&platform->cpu, &platform->events.deadline);
+        event_run(&platform->events, platform_now(platform));
+    }
+    device_drain_all(platform);
+}
+
+static void test_replay()
+{
+    // echo the input, counting the bytes in B, from the RST 1 handler
+    static const char program[] = ".org 0\nJMP start\n.org 8\nJMP irq\n.org 0x40\n"
+                                  "start:\nLAI 1\nOUT/0\nwait:\nHLT\nJMP wait\n"
+                                  "irq:\nINP/1\nOUT/1\nINB\nRETI\n";
+    static const char image[] = "tests_replay.asm";
+    static const char log[]   = "tests_replay.log";
+    struct platform recorded  = { .events = EVENT_QUEUE_INIT };
+    struct platform replayed  = { .events = EVENT_QUEUE_INIT };
+    char output[16];
+    FILE* f;
+
+    f = fopen(image, "w");
+    ASSERT(f && fputs(program, f) >= 0 && 0 == fclose(f));
+    f = fopen("tests_replay.in", "w");
+    ASSERT(f && fputs("hi!", f) >= 0 && 0 == fclose(f));
+
+    ASSERT((recorded.replay = replay_record(log)) != NULL);
+    machine_run(&recorded, "console:tests_replay.in,tests_replay.out", image);
+    ASSERT(recorded.cpu.regs[1] == 3 && recorded.halted); // B
+    ASSERT(0 == replay_close(recorded.replay, &recorded));
+
+    // nothing from the host, the log feeds the input
+    replayed.host_input_held = 1;
+    ASSERT((replayed.replay = replay_play(&replayed, log)) != NULL);
+    machine_run(&replayed, "console:/dev/null,tests_replay.replayed", image);
+    ASSERT(replay_done(replayed.replay));
+    ASSERT(0 == replay_close(replayed.replay, &replayed));
+
+    ASSERT(0 == memcmp(recorded.cpu.regs, replayed.cpu.regs, sizeof(recorded.cpu.regs)));
+    ASSERT(i8008_get_flags(&recorded.cpu) == i8008_get_flags(&replayed.cpu));
+    ASSERT(recorded.cpu.stack_idx == replayed.cpu.stack_idx);
+    ASSERT(0 == memcmp(recorded.cpu.stack, replayed.cpu.stack, sizeof(recorded.cpu.stack)));
+    ASSERT(recorded.cpu.instructions == replayed.cpu.instructions);
+    ASSERT(recorded.cpu.t_states == replayed.cpu.t_states);
+    ASSERT(0 == memcmp(recorded.memory, replayed.memory, recorded.memory_size));
+
+    f = fopen("tests_replay.replayed", "r");
+    ASSERT(f && fread(output, 1, sizeof(output), f) == 3 && 0 == fclose(f));
+    ASSERT(0 == memcmp(output, "hi!", 3));
+
+    device_close_all(&recorded);
+    device_close_all(&replayed);
+    free(recorded.memory);
+    free(replayed.memory);
+    remove(image);
+    remove(log);
+    remove("tests_replay.in");
+    remove("tests_replay.out");
+    remove("tests_replay.replayed");
+}
+
+static void test_console_pending()
+{
+    static uint8_t output[0x20000];
+    struct platform platform = { .events = EVENT_QUEUE_INIT };
+    struct device* console;
+    char spec[32];
+    int fds[2], i;
+    size_t len = 0;
+    ssize_t rc;
+
+    // more than the pipe takes, written while nobody reads
+    ASSERT(0 == pipe(fds));
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    snprintf(spec, sizeof(spec), "console:/dev/null,&%d", fds[1]);
+    ASSERT(0 == device_attach(&platform, spec));
+    console = platform.out_devices[24 + 1 - OUT_PORT_BASE];
+    for (i = 0; i < (int)sizeof(output); i++)
+        console->out(console, 1, i * 7);
+    ASSERT(console->flush(console) > 0);
+
+    while (len < sizeof(output)) {
+        rc = read(fds[0], output + len, sizeof(output) - len);
+        ASSERT(rc > 0);
+        len += rc;
+        console->flush(console);
+    }
+    ASSERT(console->flush(console) == 0);
+    for (i = 0; i < (int)sizeof(output); i++)
+        ASSERT(output[i] == (uint8_t)(i * 7));
+
+    device_close_all(&platform);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static uint8_t cpu_mem[0x4000];
+static uint16_t cpu_addr;
+static uint8_t cpu_ctrl;
+
+static uint8_t cpu_io(struct i8008_cpu* cpu, enum i8008_state state, uint8_t bus_out)
+{
+    switch (state) {
+    case I8008_STATE_T1:
+    case I8008_STATE_T1I:
+        cpu_addr = bus_out;
+        break;
+    case I8008_STATE_T2:
+        cpu_ctrl = bus_out & I8008_T2_CTRL_MSK;
+        cpu_addr |= (bus_out & 0x3F) << 8;
+        break;
+    case I8008_STATE_T3:
+        if (cpu_ctrl == I8008_T2_CTRL_PCW)
+            cpu_mem[cpu_addr] = bus_out;
+        else
+            return cpu_mem[cpu_addr];
+        break;
+    case I8008_STATE_STOPPED:
+        i8008_int_req(cpu, 1);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+// execute the instruction at 0x3FF0, the source registers hold b and HL points to b
+static void cpu_exec(struct i8008_cpu* cpu, uint8_t op_code, uint8_t a, uint8_t b, int carry)
+{
+    int r;
+
+    cpu_mem[0x3FF0] = op_code;
+    cpu_mem[0x3FF1] = b;
+    cpu_mem[0x3FF2] = 0x3F;
+
+    for (r = REG_B; r <= REG_L; r++)
+        cpu->regs[r] = b;
+    cpu->regs[REG_A] = a;
+    cpu_mem[(b << 8 | b) & 0x3FFF] = b;
+
+    cpu->stack_idx = 1;
+    cpu->stack[0]  = 0x1234;
+    cpu->stack[1]  = 0x3FF0;
+    i8008_set_flags(cpu, carry ? I8008_F_CARRY : 0);
+
+    i8008_cycle(cpu);
+}
+
+// straightforward eager flags computation
+static uint8_t reference_flags(uint8_t v, int carry)
+{
+    int bits = 0, i;
+
+    for (i = 0; i < 8; i++)
+        bits += (v >> i) & 1;
+
+    return (carry ? I8008_F_CARRY : 0) | (v == 0 ? I8008_F_ZERO : 0) | (v & 0x80 ? I8008_F_SIGN : 0)
+        | (bits % 2 ? 0 : I8008_F_PARITY);
+}
+
+static void test_flags_alu()
+{
+    struct i8008_cpu cpu;
+    int op_code, a, b, c;
+
+    i8008_init(&cpu, &cpu_io);
+    i8008_int_req(&cpu, 0);
+
+    for (op_code = 0; op_code < 256; op_code++) {
+        int op        = (op_code >> 3) & 7;
+        int src       = op_code & 7;
+        int immediate = (op_code & 0xC7) == 0x04;
+
+        if ((op_code & 0xC0) != 0x80 && !immediate)
+            continue;
+
+        for (a = 0; a < 256; a++) {
+            for (b = 0; b < 256; b++) {
+                for (c = 0; c < 2; c++) {
+                    int operand = (!immediate && src == REG_A) ? a : b;
+                    int result;
+
+                    switch (op) {
+                    case 0:
+                        result = a + operand;
+                        break;
+                    case 1:
+                        result = a + operand + c;
+                        break;
+                    case 2:
+                    case 7:
+                        result = a - operand;
+                        break;
+                    case 3:
+                        result = a - operand - c;
+                        break;
+                    case 4:
+                        result = a & operand;
+                        break;
+                    case 5:
+                        result = a ^ operand;
+                        break;
+                    default:
+                        result = a | operand;
+                        break;
+                    }
+
+                    cpu_exec(&cpu, op_code, a, b, c);
+
+                    ASSERT(cpu.regs[REG_A] == (op == 7 ? a : (uint8_t)result));
+                    ASSERT(i8008_get_flags(&cpu) == reference_flags(result, result & 0x100));
+                }
+            }
+        }
+    }
+}
+
+static void test_flags_incdec()
+{
+    struct i8008_cpu cpu;
+    int r, v, c;
+
+    i8008_init(&cpu, &cpu_io);
+    i8008_int_req(&cpu, 0);
+
+    for (r = REG_B; r <= REG_L; r++) {
+        for (v = 0; v < 256; v++) {
+            for (c = 0; c < 2; c++) {
+                cpu_exec(&cpu, r << 3, 0, v, c); // INr
+                ASSERT(cpu.regs[r] == (uint8_t)(v + 1));
+                ASSERT(i8008_get_flags(&cpu) == reference_flags(v + 1, c));
+
+                cpu_exec(&cpu, r << 3 | 1, 0, v, c); // DCr
+                ASSERT(cpu.regs[r] == (uint8_t)(v - 1));
+                ASSERT(i8008_get_flags(&cpu) == reference_flags(v - 1, c));
+            }
+        }
+    }
+}
+
+static void test_flags_conditions()
+{
+    struct i8008_cpu cpu;
+    int op_code, v;
+
+    i8008_init(&cpu, &cpu_io);
+    i8008_int_req(&cpu, 0);
+
+    for (op_code = 0; op_code < 256; op_code++) {
+        int is_jump = (op_code & 0xC7) == 0x40; // JFc JTc
+        int is_ret  = (op_code & 0xC7) == 0x03; // RFc RTc
+
+        if (!is_jump && !is_ret)
+            continue;
+
+        for (v = 0; v < 256; v++) {
+            int flag  = reference_flags(v, 0) & (1 << ((op_code >> 3) & 3));
+            int taken = (op_code & 0x20) ? !!flag : !flag;
+
+            cpu_exec(&cpu, 0x04, v, 0, 0); // ADI 0: lazy flags from v
+            cpu.stack[1]    = 0x3FF0;
+            cpu_mem[0x3FF0] = op_code;
+            i8008_cycle(&cpu);
+
+            if (is_jump)
+                ASSERT(cpu.stack[cpu.stack_idx] == (taken ? 0x3F00 : 0x3FF3));
+            else
+                ASSERT(cpu.stack_idx == (taken ? 0 : 1));
+        }
+    }
+}
+
+static void test_coverage()
+{
+    static struct i8008_coverage coverage;
+    struct i8008_cpu cpu;
+
+    i8008_init(&cpu, &cpu_io);
+    i8008_int_req(&cpu, 0);
+    cpu.coverage = &coverage;
+
+    cpu_exec(&cpu, 0x04, 0, 0, 0); // ADI 0: zero
+    cpu.stack[1]    = 0x3FF0;
+    cpu_mem[0x3FF0] = 0x68; // JTZ
+    i8008_cycle(&cpu);
+
+    ASSERT(coverage.executed[0x3FF0]);
+    ASSERT(coverage.taken[0x3FF0] && !coverage.not_taken[0x3FF0]);
+
+    cpu_exec(&cpu, 0x04, 1, 0, 0);
+    cpu.stack[1]    = 0x3FF0;
+    cpu_mem[0x3FF0] = 0x68;
+    i8008_cycle(&cpu);
+
+    ASSERT(coverage.not_taken[0x3FF0]);
+    ASSERT(!coverage.executed[0x3FF3]);
+}
+
+static uint32_t fusion_bus; // hash of the bus activity
+
+static uint8_t fusion_io(struct i8008_cpu* cpu, enum i8008_state state, uint8_t bus_out)
+{
+    uint8_t value = cpu_io(cpu, state, bus_out);
+
+    fusion_bus = (fusion_bus * 31 + state) * 31 + (bus_out ^ value);
+    return value;
+}
+
+// the same run with and without superinstructions, up to a deadline
+static void test_fusion()
+{
+    static const uint8_t program[] = {
+        0x2E, 0x20, // LHI 0x20
+        0x36, 0x00, // LLI 0
+        0x46, 0x10, 0x00, // CALL scan
+        0x36, 0x00, // LLI 0
+        0x2E, 0x20, // LHI 0x20
+        0x44, 0x04, 0x00, // JMP 4
+    };
+    static const uint8_t scan[] = {
+        0xC7, // scan: LAM
+        0x3C, 0x00, // CPI 0
+        0x2B, // RTZ
+        0xC6, // LAL
+        0x04, 0x01, // ADI 1
+        0xF0, // LLA
+        0x44, 0x10, 0x00, // JMP scan
+    };
+    struct i8008_cpu cpu[2];
+    uint32_t bus[2];
+    uint64_t deadline = 10001;
+    int f;
+
+    for (f = 0; f < 2; f++) {
+        memset(cpu_mem, 0, sizeof(cpu_mem));
+        memcpy(cpu_mem, program, sizeof(program));
+        memcpy(cpu_mem + 0x10, scan, sizeof(scan));
+        strcpy((char*)cpu_mem + 0x2000, "fused");
+
+        i8008_init(&cpu[f], &fusion_io);
+        i8008_int_req(&cpu[f], 0);
+        cpu[f].fuse_deadline = f ? &deadline : NULL;
+        fusion_bus           = 0;
+        while (cpu[f].t_states < deadline)
+            i8008_cycle(&cpu[f]);
+        bus[f] = fusion_bus;
+    }
+
+    ASSERT(bus[0] == bus[1]);
+    ASSERT(cpu[0].instructions == cpu[1].instructions && cpu[0].t_states == cpu[1].t_states);
+    ASSERT(0 == memcmp(cpu[0].regs, cpu[1].regs, sizeof(cpu[0].regs)));
+    ASSERT(cpu[0].stack_idx == cpu[1].stack_idx && 0 == memcmp(cpu[0].stack, cpu[1].stack, sizeof(cpu[0].stack)));
+    ASSERT(i8008_get_flags(&cpu[0]) == i8008_get_flags(&cpu[1]));
+    ASSERT(cpu[1].fusions[I8008_FUSE_LAM_CPI_RTZ] > 100 && cpu[1].fusions[I8008_FUSE_LAL_ADI_LLA] > 100);
+    ASSERT(cpu[1].fusions[I8008_FUSE_LHI_LLI] == 1 && cpu[1].fusions[I8008_FUSE_LLI_LHI] > 10);
+}
+
+static int run_out_ends; // an OUT ends the batch
+static uint64_t run_deadline;
+
+static uint8_t run_io(struct i8008_cpu* cpu, enum i8008_state state, uint8_t bus_out)
+{
+    if (state == I8008_STATE_WAIT && cpu_ctrl == I8008_T2_CTRL_PCC && run_out_ends)
+        run_deadline = 0;
+    return cpu_io(cpu, state, bus_out);
+}
+
+static void test_run()
+{
+    static const uint8_t program[] = {
+        0x08, // INB
+        0x08, // INB
+        0x51, // OUT/8
+        0x44, 0x00, 0x00, // JMP 0
+    };
+    struct i8008_cpu cpu;
+    uint64_t instructions;
+
+    memset(cpu_mem, 0, sizeof(cpu_mem));
+    memcpy(cpu_mem, program, sizeof(program));
+    i8008_init(&cpu, &run_io);
+    i8008_int_req(&cpu, 0);
+
+    // the callback moves the deadline
+    run_out_ends = 1;
+    run_deadline = UINT64_MAX;
+    instructions = i8008_run(&cpu, &run_deadline);
+    ASSERT(cpu.regs[REG_B] == 2 && instructions == cpu.instructions);
+
+    // up to the deadline, the last instruction crossing it
+    run_out_ends = 0;
+    run_deadline = cpu.t_states + 1000;
+    instructions = i8008_run(&cpu, &run_deadline);
+    ASSERT(cpu.t_states >= run_deadline && cpu.t_states < run_deadline + 11);
+    ASSERT(instructions > 100 && cpu.regs[REG_B] > 2 * 30); // 27 T-states per iteration
+}
+
+static struct undo* undo_log;
+
+static uint8_t undo_io(struct i8008_cpu* cpu, enum i8008_state state, uint8_t bus_out)
+{
+    struct platform* platform = container_of(cpu, struct platform, cpu);
+    uint16_t addr             = platform->addr_high << 8 | platform->addr_low;
+
+    switch (state) {
+    case I8008_STATE_T1:
+        platform->addr_low = bus_out;
+        break;
+    case I8008_STATE_T2:
+        platform->ctrl      = bus_out & I8008_T2_CTRL_MSK;
+        platform->addr_high = bus_out & 0x3F;
+        break;
+    case I8008_STATE_T3:
+        if (platform->ctrl != I8008_T2_CTRL_PCW)
+            return platform_mem_read(platform, addr);
+        undo_write(undo_log, addr);
+        platform_mem_write(platform, addr, bus_out);
+        break;
+    case I8008_STATE_STOPPED:
+        i8008_int_req(cpu, 1); // boot
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+struct undo_check {
+    uint8_t regs[7];
+    uint16_t pc;
+    uint32_t sum; // of the written memory
+};
+
+static void undo_check_state(struct platform* platform, struct undo_check* check)
+{
+    int i;
+
+    memset(check, 0, sizeof(*check));
+    memcpy(check->regs, platform->cpu.regs, sizeof(check->regs));
+    check->pc  = platform->cpu.stack[platform->cpu.stack_idx];
+    check->sum = 0;
+    for (i = 0; i < 256; i++)
+        check->sum = check->sum * 31 + platform->memory[0x2000 + i];
+}
+
+static int undo_matches(struct platform* platform, struct undo_check* check)
+{
+    struct undo_check now;
+
+    undo_check_state(platform, &now);
+    return 0 == memcmp(&now, check, sizeof(now));
+}
+
+// run a loop writing the memory, then go back
+static void test_undo()
+{
+    static const uint8_t program[] = {
+        0x2E, 0x20, // LHI 0x20
+        0x36, 0x00, // LLI 0
+        0x30, // loop: INL
+        0xC6, // LAL
+        0x81, // ADB
+        0xF8, // LMA
+        0xC8, // LBA
+        0x44, 0x04, 0x00, // JMP loop
+    };
+    // a log large enough, then one that drops the oldest records
+    static const size_t sizes[] = { 16 * UNDO_CHUNK_SIZE, 2 * UNDO_CHUNK_SIZE };
+    static struct undo_check checks[50001];
+    static struct platform platform;
+    uint64_t undone;
+    int n, i, s;
+
+    platform.memory      = (uint8_t*)calloc(1, 0x4000);
+    platform.memory_size = 0x4000; // all RAM
+    for (i = 0; i < PAGES; i++)
+        platform.read_pages[i] = platform.write_pages[i] = platform.memory + i * PAGE_SIZE;
+
+    for (s = 0; s < 2; s++) {
+        memset(platform.memory, 0, platform.memory_size);
+        memcpy(platform.memory, program, sizeof(program));
+        i8008_init(&platform.cpu, &undo_io);
+        i8008_int_req(&platform.cpu, 0);
+        platform.cpu.stack_idx = 0;
+        platform.cpu.stack[0]  = 0;
+        undo_log               = undo_create(&platform, sizes[s]);
+
+        for (n = 0; n < 50000; n++) {
+            undo_check_state(&platform, &checks[n]);
+            undo_step(undo_log);
+            i8008_cycle(&platform.cpu);
+        }
+        undo_check_state(&platform, &checks[n]);
+
+        ASSERT(undo_back(undo_log, 1) == 1);
+        n--;
+        ASSERT(undo_matches(&platform, &checks[n]));
+
+        // back to before the LMA, within the last 256 iterations
+        ASSERT(undo_back_to_write(undo_log, 0x2010) > 0);
+        ASSERT(platform.cpu.stack[0] == 7 && platform.cpu.regs[REG_L] == 0x10);
+        for (i = 0; i < 6 * 256 && !undo_matches(&platform, &checks[n - i]); i++)
+            ;
+        ASSERT(i < 6 * 256);
+        n -= i;
+
+        // forward again, then back across chunks
+        for (i = 0; i < 10; i++) {
+            undo_step(undo_log);
+            i8008_cycle(&platform.cpu);
+        }
+        ASSERT(undo_matches(&platform, &checks[n + 10]));
+        undone = undo_back(undo_log, 40000);
+        ASSERT(s == 0 ? undone == 40000 : undone < 40000);
+        n += 10 - undone;
+        ASSERT(undo_matches(&platform, &checks[n]));
+    }
+}
+
+static char hle_output[16];
+static int hle_output_len;
+
+static void hle_out(struct platform* platform, int port, uint8_t value)
+{
+    if (port == 25 && hle_output_len < sizeof(hle_output) - 1)
+        hle_output[hle_output_len++] = value;
+}
+
+// call the native routines as the guest would, then undo a call
+static void test_hle()
+{
+    static struct symmap_entry entries[] = { { 0x0200, "div16" }, { 0x0300, "text" } };
+    static const struct symmap symbols = { 2, entries };
+    static struct platform platform;
+    struct i8008_cpu* cpu = &platform.cpu;
+    struct hle* hle       = hle_create(&hle_out);
+    int i;
+
+    platform.memory      = (uint8_t*)calloc(1, 0x4000);
+    platform.memory_size = 0x4000;
+    for (i = 0; i < PAGES; i++)
+        platform.read_pages[i] = platform.write_pages[i] = platform.memory + i * PAGE_SIZE;
+    strcpy((char*)platform.memory + 0x2000, "hi!");
+
+    ASSERT(hle_add(hle, "div16") == 0);
+    ASSERT(hle_add(hle, "print@text") == 0);
+    ASSERT(hle_add(hle, "mul8@0x400:12") == 0);
+    ASSERT(hle_resolve(hle, &symbols) == 0);
+    ASSERT(hle_trap_at(hle, 0x0200) && !hle_trap_at(hle, 0x0201));
+
+    // 1000 / 7 from a CALL at 0x0100
+    cpu->stack_idx   = 1;
+    cpu->stack[0]    = 0x0103;
+    cpu->stack[1]    = 0x0200;
+    cpu->regs[REG_B] = 0x03;
+    cpu->regs[REG_C] = 0xE8;
+    cpu->regs[REG_D] = 0x00;
+    cpu->regs[REG_E] = 0x07;
+    hle_call(hle, hle_trap_at(hle, 0x0200), &platform);
+    ASSERT(cpu->regs[REG_B] == 0 && cpu->regs[REG_C] == 142 && cpu->regs[REG_E] == 6);
+    ASSERT(cpu->stack_idx == 0 && cpu->stack[0] == 0x0103);
+    ASSERT(cpu->t_states == 131 && cpu->instructions == 1);
+
+    // the configured cost
+    cpu->stack_idx   = 1;
+    cpu->stack[1]    = 0x0400;
+    cpu->regs[REG_B] = 200;
+    cpu->regs[REG_C] = 3;
+    hle_call(hle, hle_trap_at(hle, 0x0400), &platform);
+    ASSERT(cpu->regs[REG_H] == 0x02 && cpu->regs[REG_L] == 0x58 && cpu->t_states == 143);
+
+    // logged as a whole
+    undo_log         = undo_create(&platform, 2 * UNDO_CHUNK_SIZE);
+    cpu->stack_idx   = 1;
+    cpu->stack[1]    = 0x0300;
+    cpu->regs[REG_H] = 0x20;
+    cpu->regs[REG_L] = 0x00;
+    undo_step_all(undo_log);
+    hle_call(hle, hle_trap_at(hle, 0x0300), &platform);
+    ASSERT(0 == strcmp(hle_output, "hi!"));
+    ASSERT(cpu->regs[REG_L] == 0x03 && cpu->regs[REG_A] == 0 && (i8008_get_flags(cpu) & I8008_F_ZERO));
+    ASSERT(undo_back(undo_log, 1) == 1);
+    ASSERT(cpu->stack_idx == 1 && cpu->stack[1] == 0x0300 && cpu->regs[REG_L] == 0x00);
+}
+
 int main()
 {
     test_lai();
@@ -110,6 +1082,26 @@ int main()
     test_ret();
     test_lam();
     test_set();
+    test_out();
+    test_segments();
+    test_overlap();
+    test_include();
+    test_bank();
+    test_flags_alu();
+    test_flags_incdec();
+    test_flags_conditions();
+    test_listing();
+    test_image_invalid();
+    test_pic_legacy();
+    test_console_pending();
+    test_muldiv();
+    test_dma();
+    test_replay();
+    test_coverage();
+    test_fusion();
+    test_run();
+    test_undo();
+    test_hle();
 
     fprintf(stdout, "Passed\n");
     return 0;
@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "undo.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "disasm.h"
+
+// Record layout, from its start: the registers, the flags (the flags
+// with the lazy bit 7, and the last result), the PC (LE16) or the stack
+// pointer and the stack entries at and above it when set in the header,
+// the written bytes (address LE16, old value), the interrupt state, then
+// the header (LE16), last so that the log is read backwards.
+#define H_REGS 0x007F // one bit per register
+#define H_FLAGS 0x0080
+#define H_BRANCH 0x0100 // stack pointer and entries: calls and returns
+#define H_PC_STEP_SHIFT 9 // 2 bits: PC increment of the other instructions
+#define H_MISC 0x0800
+#define H_WRITES_SHIFT 12 // 2 bits: written bytes
+#define H_PC 0x4000 // jumps
+
+#define H_ALL (H_REGS | H_FLAGS | H_BRANCH)
+
+#define RECORD_MAX (7 + 2 + 5 + 3 * UNDO_MAX_WRITES + 1 + 2)
+
+struct record {
+    unsigned int header;
+    uint8_t regs[7];
+    uint8_t flags[2];
+    uint8_t stack_idx;
+    uint16_t stack[2]; // at stack_idx and above, or the PC
+    uint8_t misc;
+    uint16_t write_addrs[UNDO_MAX_WRITES];
+    uint8_t write_values[UNDO_MAX_WRITES];
+    int writes;
+};
+
+// what each instruction changes, see init_opcode_headers()
+static uint16_t opcode_headers[256];
+
+static void init_opcode_headers(void)
+{
+    int op;
+
+    for (op = 0; op < 256; op++) {
+        unsigned int header = 0;
+        int reg             = (op >> 3) & 7;
+
+        switch (op >> 6) {
+        case 0:
+            switch (op & 7) {
+            case 0: // INr, DCr (HLT for A, nothing for M)
+            case 1:
+                if (reg != REG_A && reg != REG_MEM)
+                    header = 1 << reg | H_FLAGS;
+                break;
+            case 2: // rotations
+                header = 1 << REG_A | H_FLAGS;
+                break;
+            case 3: // returns, the conditional ones materialize the flags
+            case 7:
+                header = H_BRANCH | (op & 4 ? 0 : H_FLAGS);
+                break;
+            case 4: // ALU immediate, CPI only sets the flags
+                header = (reg == 7 ? 0 : 1 << REG_A) | H_FLAGS;
+                break;
+            case 5: // RST
+                header = H_BRANCH;
+                break;
+            case 6: // LrI
+                if (reg != REG_MEM)
+                    header = 1 << reg;
+                break;
+            }
+            break;
+        case 1:
+            if (!(op & 1)) // jumps and calls
+                header = (op & 2 ? H_BRANCH : H_PC) | (op & 4 ? 0 : H_FLAGS);
+            else if (!(op & 0x30)) // INP
+                header = 1 << REG_A | H_FLAGS;
+            break;
+        case 2: // ALU
+            header = (reg == 7 ? 0 : 1 << REG_A) | H_FLAGS;
+            break;
+        case 3: // Lrr (HLT for M to M)
+            if (reg != REG_MEM)
+                header = 1 << reg;
+            break;
+        }
+
+        if (!(header & (H_BRANCH | H_PC)))
+            header |= i8008_opcodes[op].size << H_PC_STEP_SHIFT;
+        opcode_headers[op] = header;
+    }
+}
+
+static uint8_t get_misc(struct platform* platform)
+{
+    return (platform->cpu.int_req ? UNDO_MISC_INT_REQ : 0) | (platform->halted ? UNDO_MISC_HALTED : 0)
+        | (platform->int_enabled ? UNDO_MISC_INT_ENABLED : 0);
+}
+
+static void set_misc(struct platform* platform, uint8_t misc)
+{
+    platform->cpu.int_req = !!(misc & UNDO_MISC_INT_REQ);
+    platform->halted      = !!(misc & UNDO_MISC_HALTED);
+    platform->int_enabled = !!(misc & UNDO_MISC_INT_ENABLED);
+}
+
+// the record ending at end, returns its start
+static const uint8_t* decode(const uint8_t* end, struct record* record)
+{
+    const uint8_t *p = end - 2, *q;
+    int i, len = 0;
+
+    record->header = p[0] | p[1] << 8;
+
+    if (record->header & H_MISC)
+        record->misc = *(--p);
+    record->writes = (record->header >> H_WRITES_SHIFT) & 3;
+    for (i = record->writes - 1; i >= 0; i--) {
+        p -= 3;
+        record->write_addrs[i]  = p[0] | p[1] << 8;
+        record->write_values[i] = p[2];
+    }
+
+    for (i = 0; i < 7; i++)
+        len += (record->header >> i) & 1;
+    if (record->header & H_FLAGS)
+        len += 2;
+    if (record->header & H_BRANCH)
+        len += 5;
+    if (record->header & H_PC)
+        len += 2;
+    p -= len;
+
+    q = p;
+    for (i = 0; i < 7; i++) {
+        if (record->header & (1 << i))
+            record->regs[i] = *(q++);
+    }
+    if (record->header & H_FLAGS) {
+        record->flags[0] = *(q++);
+        record->flags[1] = *(q++);
+    }
+    if (record->header & H_BRANCH) {
+        record->stack_idx = q[0];
+        record->stack[0]  = q[1] | q[2] << 8;
+        record->stack[1]  = q[3] | q[4] << 8;
+    }
+    if (record->header & H_PC)
+        record->stack[0] = q[0] | q[1] << 8;
+
+    return p;
+}
+
+static void apply(struct platform* platform, const struct record* record)
+{
+    struct i8008_cpu* cpu = &platform->cpu;
+    int i;
+
+    for (i = record->writes - 1; i >= 0; i--)
+        platform_mem_write(platform, record->write_addrs[i], record->write_values[i]);
+
+    if (record->header & H_MISC)
+        set_misc(platform, record->misc);
+
+    if (record->header & H_BRANCH) {
+        cpu->stack_idx                          = record->stack_idx;
+        cpu->stack[record->stack_idx]           = record->stack[0];
+        cpu->stack[(record->stack_idx + 1) % 8] = record->stack[1];
+    } else if (record->header & H_PC)
+        cpu->stack[cpu->stack_idx] = record->stack[0];
+    else
+        cpu->stack[cpu->stack_idx] -= (record->header >> H_PC_STEP_SHIFT) & 3;
+
+    if (record->header & H_FLAGS) {
+        cpu->flags        = record->flags[0] & 0x7F;
+        cpu->flags_lazy   = record->flags[0] >> 7;
+        cpu->flags_result = record->flags[1];
+    }
+    for (i = 0; i < 7; i++) {
+        if (record->header & (1 << i))
+            cpu->regs[i] = record->regs[i];
+    }
+}
+
+static struct undo_chunk* chunk_at(struct undo* undo, int idx)
+{
+    return &undo->chunks[(undo->first + idx) % undo->chunks_number];
+}
+
+// start a chunk at the current instruction boundary, dropping the oldest one if needed
+static void open_chunk(struct undo* undo)
+{
+    struct platform* platform = undo->platform;
+    struct i8008_cpu* cpu     = &platform->cpu;
+    struct undo_chunk* chunk;
+
+    if (undo->used == undo->chunks_number) {
+        undo->first = (undo->first + 1) % undo->chunks_number;
+        undo->used--;
+    }
+    chunk          = chunk_at(undo, undo->used++);
+    chunk->used    = 0;
+    chunk->records = 0;
+    undo->head     = chunk;
+
+    memcpy(chunk->state.regs, cpu->regs, sizeof(cpu->regs));
+    chunk->state.flags        = cpu->flags;
+    chunk->state.flags_result = cpu->flags_result;
+    chunk->state.flags_lazy   = cpu->flags_lazy;
+    chunk->state.stack_idx    = cpu->stack_idx;
+    chunk->state.misc         = get_misc(platform);
+    memcpy(chunk->state.stack, cpu->stack, sizeof(cpu->stack));
+    if (chunk->ram) {
+        memcpy(chunk->ram, platform->memory + platform->rom_size, platform->memory_size - platform->rom_size);
+        memcpy(chunk->scratch, platform->scratch_page, PAGE_SIZE);
+    }
+}
+
+static void restore_snapshot(struct undo* undo, struct undo_chunk* chunk)
+{
+    struct platform* platform = undo->platform;
+    struct i8008_cpu* cpu     = &platform->cpu;
+
+    memcpy(platform->memory + platform->rom_size, chunk->ram, platform->memory_size - platform->rom_size);
+    memcpy(platform->scratch_page, chunk->scratch, PAGE_SIZE);
+
+    memcpy(cpu->regs, chunk->state.regs, sizeof(cpu->regs));
+    cpu->flags        = chunk->state.flags;
+    cpu->flags_result = chunk->state.flags_result;
+    cpu->flags_lazy   = chunk->state.flags_lazy;
+    cpu->stack_idx    = chunk->state.stack_idx;
+    memcpy(cpu->stack, chunk->state.stack, sizeof(cpu->stack));
+    set_misc(platform, chunk->state.misc);
+
+    chunk->used    = 0;
+    chunk->records = 0;
+}
+
+// the instruction has run: complete its record
+static void commit(struct undo* undo)
+{
+    struct undo_chunk* chunk = undo->head;
+    uint8_t* p               = chunk->data + chunk->used + undo->pending_len;
+    unsigned int header      = undo->pending_header | undo->writes << H_WRITES_SHIFT;
+    int i;
+
+    for (i = 0; i < undo->writes; i++) {
+        *(p++) = undo->write_addrs[i];
+        *(p++) = undo->write_addrs[i] >> 8;
+        *(p++) = undo->write_values[i];
+    }
+    if (get_misc(undo->platform) != undo->pending_misc) {
+        header |= H_MISC;
+        *(p++) = undo->pending_misc;
+    }
+    *(p++) = header;
+    *(p++) = header >> 8;
+
+    chunk->used = p - chunk->data;
+    chunk->records++;
+    undo->pending = 0;
+}
+
+static void log_step(struct undo* undo, unsigned int header)
+{
+    struct platform* platform = undo->platform;
+    struct i8008_cpu* cpu     = &platform->cpu;
+    uint8_t *start, *p;
+    int i;
+
+    if (undo->pending)
+        commit(undo);
+    if (!undo->used || undo->head->used > UNDO_CHUNK_SIZE - RECORD_MAX)
+        open_chunk(undo);
+
+    start = p = undo->head->data + undo->head->used;
+    if (header & H_REGS) {
+        for (i = 0; i < 7; i++) {
+            if (header & (1 << i))
+                *(p++) = cpu->regs[i];
+        }
+    }
+    if (header & H_FLAGS) {
+        *(p++) = cpu->flags | (cpu->flags_lazy ? 0x80 : 0);
+        *(p++) = cpu->flags_result;
+    }
+    if (header & H_BRANCH) {
+        *(p++) = cpu->stack_idx;
+        *(p++) = cpu->stack[cpu->stack_idx];
+        *(p++) = cpu->stack[cpu->stack_idx] >> 8;
+        *(p++) = cpu->stack[(cpu->stack_idx + 1) % 8];
+        *(p++) = cpu->stack[(cpu->stack_idx + 1) % 8] >> 8;
+    }
+    if (header & H_PC) {
+        *(p++) = cpu->stack[cpu->stack_idx];
+        *(p++) = cpu->stack[cpu->stack_idx] >> 8;
+    }
+
+    undo->pending        = 1;
+    undo->pending_len    = p - start;
+    undo->pending_header = header;
+    undo->pending_misc   = get_misc(platform);
+    undo->writes         = 0;
+}
+
+void undo_step(struct undo* undo)
+{
+    struct platform* platform = undo->platform;
+    struct i8008_cpu* cpu     = &platform->cpu;
+
+    // an interrupt cycle runs the acknowledged instruction, not the one at the PC
+    if (cpu->int_req)
+        log_step(undo, H_ALL);
+    else
+        log_step(undo, opcode_headers[platform_mem_read(platform, cpu->stack[cpu->stack_idx])]);
+}
+
+void undo_step_all(struct undo* undo) { log_step(undo, H_ALL); }
+
+void undo_clear(struct undo* undo)
+{
+    undo->used    = 0;
+    undo->pending = 0;
+    undo->writes  = 0;
+}
+
+// the chunk holding the last record, NULL if the log is empty
+static struct undo_chunk* last_chunk(struct undo* undo)
+{
+    if (undo->pending)
+        commit(undo);
+
+    while (undo->used) {
+        struct undo_chunk* chunk = chunk_at(undo, undo->used - 1);
+        if (chunk->records)
+            return chunk;
+        if (undo->used == 1)
+            break;
+        undo->used--; // its start is the end of the previous one
+        undo->head = chunk_at(undo, undo->used - 1);
+    }
+    return NULL;
+}
+
+static void pop_record(struct undo* undo, struct undo_chunk* chunk, struct record* record)
+{
+    chunk->used = decode(chunk->data + chunk->used, record) - chunk->data;
+    chunk->records--;
+    apply(undo->platform, record);
+}
+
+uint64_t undo_back(struct undo* undo, uint64_t count)
+{
+    struct undo_chunk* chunk;
+    struct record record;
+    uint64_t done = 0;
+
+    while (done < count && (chunk = last_chunk(undo))) {
+        if (chunk->ram && chunk->records <= count - done) {
+            done += chunk->records;
+            restore_snapshot(undo, chunk);
+        } else {
+            pop_record(undo, chunk, &record);
+            done++;
+        }
+    }
+    return done;
+}
+
+int undo_instruction(struct undo* undo, uint16_t writes[UNDO_MAX_WRITES])
+{
+    struct undo_chunk* chunk = last_chunk(undo);
+    struct record record;
+    int i;
+
+    if (!chunk)
+        return -1;
+
+    pop_record(undo, chunk, &record);
+    for (i = 0; i < record.writes; i++)
+        writes[i] = record.write_addrs[i];
+    return record.writes;
+}
+
+uint64_t undo_back_to_write(struct undo* undo, uint16_t addr)
+{
+    uint64_t count = 0;
+    int idx, i;
+
+    if (!last_chunk(undo))
+        return 0;
+
+    // find it first, undo_back() skips whole chunks
+    for (idx = undo->used - 1; idx >= 0; idx--) {
+        struct undo_chunk* chunk = chunk_at(undo, idx);
+        const uint8_t* p         = chunk->data + chunk->used;
+
+        while (p > chunk->data) {
+            struct record record;
+
+            p = decode(p, &record);
+            count++;
+            for (i = 0; i < record.writes; i++) {
+                if (record.write_addrs[i] == addr)
+                    return undo_back(undo, count);
+            }
+        }
+    }
+    return 0;
+}
+
+struct undo* undo_create(struct platform* platform, size_t size)
+{
+    struct undo* undo = (struct undo*)calloc(1, sizeof(struct undo));
+    size_t ram_size   = platform->memory_size - platform->rom_size;
+    int i;
+
+    if (!opcode_headers[0])
+        init_opcode_headers();
+
+    undo->platform      = platform;
+    undo->chunks_number = (size + UNDO_CHUNK_SIZE - 1) / UNDO_CHUNK_SIZE;
+    if (undo->chunks_number < 2)
+        undo->chunks_number = 2;
+    undo->chunks = (struct undo_chunk*)calloc(undo->chunks_number, sizeof(struct undo_chunk));
+
+    for (i = 0; i < undo->chunks_number; i++) {
+        undo->chunks[i].data = (uint8_t*)malloc(UNDO_CHUNK_SIZE);
+        // snapshots at most double the log size
+        if (ram_size <= UNDO_CHUNK_SIZE) {
+            undo->chunks[i].ram     = (uint8_t*)malloc(ram_size);
+            undo->chunks[i].scratch = (uint8_t*)malloc(PAGE_SIZE);
+        }
+    }
+
+    return undo;
+}
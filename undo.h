@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2022, Olivier Valentin
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#ifndef UNDO_H_
+#define UNDO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "platform.h"
+
+// Reverse execution log. Before each instruction, undo_step() saves the
+// old values of what it may change, known from its opcode: the registers,
+// the flags, the PC for the jumps, the stack pointer and entries for the
+// calls and returns; the PC increment of the other instructions is folded
+// into the record header. The old values of the memory bytes it writes
+// (see undo_write()) and of the interrupt state are added once it ran. A
+// typical record is 2 to 6 bytes.
+//
+// The records fill fixed size chunks, used as a ring: when it is full, the
+// oldest chunk is dropped. Each chunk starts with a snapshot of the CPU and
+// the RAM (when the RAM is small enough), which undoes all of its records
+// at once.
+//
+// The devices state, the host input and the counters are not rolled back,
+// and the memory writes are undone through the current mapping: running
+// forward again after going back executes live. The memory written by a
+// device (DMA, disk) is not logged either: it is only restored by the
+// snapshots, when going back past the start of a chunk.
+
+#define UNDO_CHUNK_SIZE 65536
+#define UNDO_MAX_WRITES 3 // per instruction
+
+enum undo_misc {
+    UNDO_MISC_INT_REQ     = 1 << 0,
+    UNDO_MISC_HALTED      = 1 << 1,
+    UNDO_MISC_INT_ENABLED = 1 << 2,
+};
+
+// full CPU state, for the snapshots
+struct undo_state {
+    uint8_t regs[7];
+    uint8_t flags;
+    uint8_t flags_result;
+    uint8_t flags_lazy;
+    uint8_t stack_idx;
+    uint8_t misc; // UNDO_MISC_* bits
+    uint16_t stack[8];
+};
+
+struct undo_chunk {
+    uint8_t* data;
+    size_t used;
+    uint64_t records;
+
+    // state at the chunk start, no RAM if too large (see undo_create())
+    struct undo_state state;
+    uint8_t* ram;
+    uint8_t* scratch;
+};
+
+struct undo {
+    struct platform* platform;
+
+    struct undo_chunk* chunks;
+    int chunks_number;
+    int first; // oldest chunk
+    int used; // chunks in use, from first
+    struct undo_chunk* head; // the last one
+
+    // record of the instruction being executed, at the end of the head chunk
+    int pending;
+    size_t pending_len;
+    unsigned int pending_header;
+    uint8_t pending_misc;
+
+    // memory written by the instruction
+    uint16_t write_addrs[UNDO_MAX_WRITES];
+    uint8_t write_values[UNDO_MAX_WRITES];
+    int writes;
+};
+
+// size: bytes of records, rounded to chunks
+struct undo* undo_create(struct platform* platform, size_t size);
+
+// the CPU is about to execute an instruction: log it
+void undo_step(struct undo* undo);
+
+// same, for a change its opcode does not tell (see hle.h): the registers,
+// the flags and a return
+void undo_step_all(struct undo* undo);
+
+// forget the history (machine reset)
+void undo_clear(struct undo* undo);
+
+// the following ones go back from the last instruction executed
+
+// undo up to count instructions, returns how many were
+uint64_t undo_back(struct undo* undo, uint64_t count);
+
+// undo the last instruction, returns the number of bytes it wrote (their
+// addresses in writes), -1 if the log is empty
+int undo_instruction(struct undo* undo, uint16_t writes[UNDO_MAX_WRITES]);
+
+// undo up to and including the last instruction that wrote addr, returns
+// the number of instructions undone, 0 if none in the log (nothing undone)
+uint64_t undo_back_to_write(struct undo* undo, uint16_t addr);
+
+// the CPU is about to write addr
+static inline void undo_write(struct undo* undo, uint16_t addr)
+{
+    if (undo->writes < UNDO_MAX_WRITES) {
+        // the old value is the one written over, the scratch page for the ROM
+        undo->write_addrs[undo->writes] = addr;
+        undo->write_values[undo->writes++]
+            = undo->platform->write_pages[(addr >> PAGE_SHIFT) & (PAGES - 1)][addr & (PAGE_SIZE - 1)];
+    }
+}
+
+#endif /* UNDO_H_ */